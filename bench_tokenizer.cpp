@@ -0,0 +1,211 @@
+#include "chat.h"
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <atomic>
+#include <cstring>
+#include <new>
+
+// counts heap allocations, so that tokenizer allocation pressure can be reported
+static std::atomic<size_t> alloc_count(0);
+
+void *operator new(size_t size)
+{
+    alloc_count++;
+    void *p = malloc(size > 0 ? size : 1);
+    if (nullptr == p) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t size) noexcept
+{
+    free(p);
+}
+
+struct Args
+{
+    std::vector<std::string> model_paths;
+    std::string corpus_fn;
+    int repeat = 3;
+    bool show_failures = false;
+};
+
+static const char *default_corpus =
+    "The quick brown fox jumps over the lazy dog.\n"
+    "Large language models are trained on trillions of tokens of text and code.\n"
+    "int main(int argc, char **argv) { return printf(\"hello, world\\n\") > 0 ? 0 : 1; }\n"
+    "def fib(n):\n    return n if n < 2 else fib(n - 1) + fib(n - 2)\n"
+    "大型语言模型在海量文本上进行预训练，然后通过指令微调来对齐人类偏好。\n"
+    "机器学习是人工智能的一个分支，它使计算机能够从数据中学习。\n"
+    "Les modèles de langage sont évalués sur des tâches de compréhension et de génération.\n"
+    "Привет, как дела? Сегодня отличная погода для прогулки.\n"
+    "東京は日本の首都であり、世界有数の大都市です。\n"
+    "Numbers: 3.14159, 2.71828, 1,000,000 and 0x7fffffff; emoji: 😀🚀✨\n"
+    "    indented   text\twith\ttabs   and    multiple     spaces\n";
+
+static void usage(const std::string &prog)
+{
+    std::cout << "Usage: " << prog << " [options]\n"
+              << "\n"
+              << "Options:\n"
+              << "  -h, --help              show this help message and exit\n"
+              << "  -m, --model PATH        model path (can be specified multiple times)\n"
+              << "  -f, --corpus FILE       corpus file, encoded line by line (default: a built-in multilingual sample)\n"
+              << "  -r, --repeat N          number of passes over the corpus (default: 3)\n"
+              << "  --show_failures         print lines failing encode/decode round-trip\n"
+              << std::endl;
+}
+
+static bool parse_args(Args &args, int argc, const char **argv)
+{
+    for (int c = 1; c < argc; c++)
+    {
+        const char *arg = argv[c];
+        if ((strcmp(arg, "--help") == 0) || (strcmp(arg, "-h") == 0))
+            return false;
+        else if ((strcmp(arg, "--show_failures") == 0))
+            args.show_failures = true;
+        else if (((strcmp(arg, "--model") == 0) || (strcmp(arg, "-m") == 0)) && (c + 1 < argc))
+            args.model_paths.push_back(argv[++c]);
+        else if (((strcmp(arg, "--corpus") == 0) || (strcmp(arg, "-f") == 0)) && (c + 1 < argc))
+            args.corpus_fn = argv[++c];
+        else if (((strcmp(arg, "--repeat") == 0) || (strcmp(arg, "-r") == 0)) && (c + 1 < argc))
+            args.repeat = std::max(1, atoi(argv[++c]));
+        else
+        {
+            std::cerr << "Unknown or incomplete argument: " << arg << std::endl;
+            return false;
+        }
+    }
+    return args.model_paths.size() > 0;
+}
+
+static std::vector<std::string> load_corpus(const std::string &fn)
+{
+    std::vector<std::string> lines;
+    std::string line;
+
+    if (fn.size() > 0)
+    {
+        std::ifstream f(fn);
+        CHATLLM_CHECK(f.is_open()) << "failed to open corpus file " << fn;
+        while (std::getline(f, line))
+            if (line.size() > 0) lines.push_back(line);
+    }
+    else
+    {
+        std::istringstream f(default_corpus);
+        while (std::getline(f, line))
+            if (line.size() > 0) lines.push_back(line);
+    }
+
+    return lines;
+}
+
+static const char *processor_name(tokenizer::Processor *tp)
+{
+    if (dynamic_cast<tokenizer::BPEProcessor3 *>(tp))       return "BPEProcessor3 (BPE, SentencePiece path)";
+    if (dynamic_cast<tokenizer::BPEProcessor2 *>(tp))       return "BPEProcessor2 (GPT-2 BPE)";
+    if (dynamic_cast<tokenizer::BPEProcessor1 *>(tp))       return "BPEProcessor1 (SentencePiece BPE)";
+    if (dynamic_cast<tokenizer::UnigramProcessor *>(tp))    return "UnigramProcessor";
+    return "unknown";
+}
+
+static void bench(const Args &args, const std::string &path, const std::vector<std::string> &corpus)
+{
+    using clock = std::chrono::steady_clock;
+
+    auto t0 = clock::now();
+    chatllm::TokenizerObject obj(path);
+    chatllm::BaseTokenizer *tok = obj.tokenizer.get();
+    auto t1 = clock::now();
+
+    size_t bytes = 0;
+    for (auto &s : corpus) bytes += s.size();
+
+    std::vector<std::vector<int>> ids(corpus.size());
+    size_t tokens = 0;
+    size_t allocs = alloc_count;
+    auto t2 = clock::now();
+    for (int r = 0; r < args.repeat; r++)
+    {
+        for (size_t i = 0; i < corpus.size(); i++)
+        {
+            ids[i].clear();
+            tok->encode(corpus[i], ids[i]);
+            tokens += ids[i].size();
+        }
+    }
+    auto t3 = clock::now();
+    allocs = alloc_count - allocs;
+
+    std::vector<std::string> decoded(corpus.size());
+    auto t4 = clock::now();
+    for (int r = 0; r < args.repeat; r++)
+    {
+        for (size_t i = 0; i < corpus.size(); i++)
+            decoded[i] = tok->decode(ids[i]);
+    }
+    auto t5 = clock::now();
+
+    size_t passed = 0;
+    for (size_t i = 0; i < corpus.size(); i++)
+    {
+        if (decoded[i] == corpus[i])
+            passed++;
+        else if (args.show_failures)
+            std::cout << "  round-trip failed: [" << corpus[i] << "] -> [" << decoded[i] << "]" << std::endl;
+    }
+
+    const double load_ms    = std::chrono::duration<double, std::milli>(t1 - t0).count();
+    const double encode_s   = std::chrono::duration<double>(t3 - t2).count();
+    const double decode_s   = std::chrono::duration<double>(t5 - t4).count();
+    const double total_mb   = (double)bytes * args.repeat / 1024 / 1024;
+    const double total_kb   = (double)bytes * args.repeat / 1024;
+
+    std::cout << path << std::endl
+              << "  model type     : " << obj.loader->model_type << std::endl
+              << "  processor      : " << processor_name(tok->tp) << std::endl
+              << "  vocab size     : " << tok->tp->GetPieceSize() << std::endl
+              << std::fixed << std::setprecision(2)
+              << "  load           : " << load_ms << " ms" << std::endl
+              << "  encode         : " << total_mb / encode_s << " MB/s, " << tokens / encode_s << " tokens/s" << std::endl
+              << "  decode         : " << total_mb / decode_s << " MB/s, " << tokens / decode_s << " tokens/s" << std::endl
+              << "  allocations    : " << allocs / total_kb << " per KB" << std::endl
+              << "  bytes per token: " << (double)bytes * args.repeat / std::max(tokens, (size_t)1) << std::endl
+              << "  round-trip     : " << passed << "/" << corpus.size() << " lines" << std::endl
+              << std::endl;
+}
+
+int main(int argc, const char **argv)
+{
+    Args args;
+    if (!parse_args(args, argc, argv))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    try
+    {
+        std::vector<std::string> corpus = load_corpus(args.corpus_fn);
+        CHATLLM_CHECK(corpus.size() > 0) << "corpus is empty";
+
+        for (auto &path : args.model_paths)
+            bench(args, path, corpus);
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
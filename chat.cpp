@@ -1,5 +1,6 @@
 #include "chat.h"
 #include <algorithm>
+#include <array>
 #include <cmath>
 #include <codecvt>
 #include <cstring>
@@ -14,7 +15,10 @@
 #include <functional>
 
 #include <sys/stat.h>
+#include <atomic>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #ifdef __has_include
 #if __has_include(<unistd.h>)
@@ -22,10 +26,21 @@
 #if defined(_POSIX_MAPPED_FILES)
 #include <sys/mman.h>
 #endif
-#if defined(_POSIX_MEMLOCK_RANGE)
 #include <sys/resource.h>
 #endif
 #endif
+
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+#if !defined(_WIN32)
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
 #endif
 
 #if defined(_WIN32)
@@ -220,20 +235,53 @@ namespace chatllm
         return text;
     }
 
+    void BaseTokenizer::sync_history_ledger(const std::vector<std::string> &history)
+    {
+        std::hash<std::string> hasher;
+        size_t valid = 0;
+        while ((valid < ledger.msg_hashes.size()) && (valid < history.size())
+               && (ledger.msg_hashes[valid] == hasher(history[valid])))
+            valid++;
+
+        ledger.msg_hashes.resize(valid);
+        ledger.prefix_tokens.resize(valid + 1);
+        ledger.rounds.resize(valid / 2);
+
+        for (size_t i = valid; i < history.size(); i++)
+        {
+            ledger.msg_hashes.push_back(hasher(history[i]));
+            ledger.prefix_tokens.push_back(ledger.prefix_tokens.back() + encode(history[i]).size());
+        }
+    }
+
+    void BaseTokenizer::reset_history_ledger(void)
+    {
+        ledger = HistoryLedger();
+    }
+
     int BaseTokenizer::get_history_start(const std::vector<std::string> &history, int max_length) const
     {
-        int start = (int)history.size() - 1;
-        size_t total_id_num = encode(history[start]).size();
-        start--;
-        while (start >= 1)
+        const int n = (int)history.size();
+        CHATLLM_CHECK(ledger.msg_hashes.size() == history.size()) << "history ledger out of sync";
+
+        // tokens in messages [i, n)
+        auto tail_tokens = [this, n](int i) { return ledger.prefix_tokens[n] - ledger.prefix_tokens[i]; };
+
+        // find the latest round (user message at `start + 1`) with
+        // tokens of messages [start - 1, n) reaching `max_length`.
+        // tail_tokens is monotonic, so a binary search over rounds is enough.
+        int lo = 0;
+        int hi = (n - 1) / 2;
+        while (lo < hi)
         {
-            total_id_num += encode(history[start]).size();
-            total_id_num += encode(history[start - 1]).size();
-            if ((int)total_id_num >= max_length)
-                break;
-            start -= 2;
+            int mid = (lo + hi) / 2;
+            int start = n - 2 - 2 * mid;
+            if ((int)tail_tokens(start - 1) >= max_length)
+                hi = mid;
+            else
+                lo = mid + 1;
         }
-        return start + 1;
+        return n - 1 - 2 * lo;
     }
 
     std::vector<int> BaseTokenizer::encode_history(BaseHistoryEncoder *encoder, const std::vector<std::string> &history, int max_length, const bool incremental)
@@ -243,14 +291,29 @@ namespace chatllm
 
         if (!incremental)
         {
+            sync_history_ledger(history);
+
             int start = get_history_start(history, max_length / 2);
             history_offset = start;
 
+            const size_t context = std::hash<std::string>()(sys_prompt) * 2 + (encoder->skip_sys_prompt ? 1 : 0);
+            ledger.rounds.resize(history.size() / 2);
+
             for (; start <= (int)history.size() - 3; start += 2)
             {
-                std::string user = trim(history[start]);
-                std::string ai = trim(history[start + 1]);
-                encoder->append_pair((start - history_offset) / 2, user, ai, input_ids);
+                const int round_idx = (start - history_offset) / 2;
+                HistoryLedger::Round &round = ledger.rounds[start / 2];
+                if ((round.encoder != encoder) || (round.round_idx != round_idx) || (round.context != context))
+                {
+                    std::string user = trim(history[start]);
+                    std::string ai = trim(history[start + 1]);
+                    round.ids.clear();
+                    encoder->append_pair(round_idx, user, ai, round.ids);
+                    round.encoder   = encoder;
+                    round.round_idx = round_idx;
+                    round.context   = context;
+                }
+                input_ids.insert(input_ids.end(), round.ids.begin(), round.ids.end());
             }
         }
 
@@ -447,6 +510,17 @@ namespace chatllm
         return oss.str();
     }
 
+    static size_t get_page_size(void)
+    {
+#if defined(_WIN32)
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return info.dwPageSize;
+#else
+        return sysconf(_SC_PAGESIZE);
+#endif
+    }
+
 #ifdef _POSIX_MAPPED_FILES
     MappedFile::MappedFile(const std::string &path)
     {
@@ -456,14 +530,89 @@ namespace chatllm
         struct stat sb;
         CHATLLM_CHECK(fstat(fd, &sb) == 0) << strerror(errno);
         size = sb.st_size;
+        mtime = sb.st_mtime;
+        inode = sb.st_ino;
 
         data = (char *)mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
         CHATLLM_CHECK(data != MAP_FAILED) << strerror(errno);
+        locked = false;
 
         CHATLLM_CHECK(close(fd) == 0) << strerror(errno);
     }
 
-    MappedFile::~MappedFile() { CHATLLM_CHECK(munmap(data, size) == 0) << strerror(errno); }
+    MappedFile::~MappedFile()
+    {
+        if (locked)
+            munlock(data, size);
+        CHATLLM_CHECK(munmap(data, size) == 0) << strerror(errno);
+    }
+
+    void MappedFile::advise(size_t offset, size_t length, Advice advice)
+    {
+        const size_t page_size = get_page_size();
+        const size_t start = offset & ~(page_size - 1);
+        if (start >= size) return;
+        length = std::min(offset + length, size) - start;
+
+        int flag = MADV_NORMAL;
+        switch (advice)
+        {
+        case Advice::Random:        flag = MADV_RANDOM;     break;
+        case Advice::Sequential:    flag = MADV_SEQUENTIAL; break;
+        case Advice::WillNeed:      flag = MADV_WILLNEED;   break;
+        case Advice::DontNeed:      flag = MADV_DONTNEED;   break;
+        case Advice::HugePage:
+#ifdef MADV_HUGEPAGE
+            flag = MADV_HUGEPAGE;
+            break;
+#else
+            return;
+#endif
+        default:
+            break;
+        }
+
+        madvise(data + start, length, flag);
+    }
+
+    bool MappedFile::lock(void)
+    {
+        if (!locked)
+            locked = mlock(data, size) == 0;
+        return locked;
+    }
+
+    bool MappedFile::lock(size_t offset, size_t length)
+    {
+        const size_t page_size = get_page_size();
+        const size_t start = offset & ~(page_size - 1);
+        if (start >= size) return false;
+        return mlock(data + start, std::min(offset + length, size) - start) == 0;
+    }
+
+    void MappedFile::unlock(size_t offset, size_t length)
+    {
+        const size_t page_size = get_page_size();
+        const size_t start = (offset + page_size - 1) & ~(page_size - 1);
+        const size_t end   = std::min(offset + length, size) & ~(page_size - 1);
+        if (start >= end) return;
+        munlock(data + start, end - start);
+    }
+
+    float MappedFile::resident_ratio(void) const
+    {
+        const size_t page_size = get_page_size();
+        const size_t n = (size + page_size - 1) / page_size;
+        if (n == 0) return 1.0f;
+
+        std::vector<unsigned char> vec(n);
+        if (mincore(data, size, vec.data()) != 0) return -1.0f;
+
+        size_t resident = 0;
+        for (auto v : vec)
+            resident += v & 1;
+        return (float)resident / n;
+    }
 #elif defined(_WIN32)
     MappedFile::MappedFile(const std::string &path)
     {
@@ -473,6 +622,8 @@ namespace chatllm
         struct _stat64 sb;
         CHATLLM_CHECK(_fstat64(fd, &sb) == 0) << strerror(errno);
         size = sb.st_size;
+        mtime = sb.st_mtime;
+        inode = sb.st_ino;
 
         HANDLE hFile = (HANDLE)_get_osfhandle(fd);
 
@@ -483,16 +634,87 @@ namespace chatllm
         CloseHandle(hMapping);
 
         CHATLLM_CHECK(data != NULL) << strerror(errno);
+        locked = false;
 
         CHATLLM_CHECK(close(fd) == 0) << strerror(errno);
     }
 
     MappedFile::~MappedFile()
     {
+        if (locked)
+            VirtualUnlock(data, size);
         CHATLLM_CHECK(UnmapViewOfFile(data)) << strerror(errno);
     }
+
+    void MappedFile::advise(size_t offset, size_t length, Advice advice)
+    {
+        if ((advice != Advice::WillNeed) || (offset >= size)) return;
+
+        WIN32_MEMORY_RANGE_ENTRY range;
+        range.VirtualAddress = data + offset;
+        range.NumberOfBytes  = std::min(length, size - offset);
+        PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+    }
+
+    bool MappedFile::lock(void)
+    {
+        if (!locked)
+            locked = VirtualLock(data, size) != 0;
+        return locked;
+    }
+
+    bool MappedFile::lock(size_t offset, size_t length)
+    {
+        if (offset >= size) return false;
+        return VirtualLock(data + offset, std::min(length, size - offset)) != 0;
+    }
+
+    void MappedFile::unlock(size_t offset, size_t length)
+    {
+        const size_t page_size = get_page_size();
+        const size_t start = (offset + page_size - 1) & ~(page_size - 1);
+        const size_t end   = std::min(offset + length, size) & ~(page_size - 1);
+        if (start >= end) return;
+        VirtualUnlock(data + start, end - start);
+    }
+
+    float MappedFile::resident_ratio(void) const
+    {
+        return -1.0f;
+    }
 #endif
 
+    void MappedFile::prefault(size_t offset, size_t length, int num_threads)
+    {
+        if (offset >= size) return;
+        length = std::min(length, size - offset);
+        num_threads = std::max(1, num_threads);
+
+        const size_t page_size = get_page_size();
+        const size_t chunk = ((length / num_threads) + page_size - 1) & ~(page_size - 1);
+
+        auto touch = [this, page_size](size_t from, size_t to)
+        {
+            char sum = 0;
+            for (size_t i = from; i < to; i += page_size)
+                sum += *(volatile const char *)(data + i);
+            volatile char sink = sum;
+            (void)sink;
+        };
+
+        std::vector<std::thread> threads;
+        for (int i = 1; i < num_threads; i++)
+        {
+            size_t from = offset + i * chunk;
+            if (from >= offset + length) break;
+            threads.emplace_back(touch, from, std::min(from + chunk, offset + length));
+        }
+        touch(offset, std::min(offset + chunk, offset + length));
+
+        for (auto &t : threads)
+            t.join();
+    }
+
     void ModelLoader::seek(int64_t offset, int whence)
     {
         if (whence == SEEK_SET)
@@ -541,116 +763,2046 @@ namespace chatllm
             /*.padding      =*/ { 0 },
         };
 
-        // TODO: this should not be needed as long as we don't rely on aligned SIMD loads
-        //ggml_assert_aligned(result->data);
+        // TODO: this should not be needed as long as we don't rely on aligned SIMD loads
+        //ggml_assert_aligned(result->data);
+
+        for (int i = 0; i < n_dims; i++) {
+            result->ne[i] = ne[i];
+        }
+
+        result->nb[0] = ggml_type_size(type);
+        result->nb[1] = result->nb[0]*(result->ne[0]/ggml_blck_size(type));
+        for (int i = 2; i < GGML_MAX_DIMS; i++) {
+            result->nb[i] = result->nb[i - 1]*result->ne[i - 1];
+        }
+
+        return result;
+    }
+
+    void ModelLoader::read_tensor_info(TensorInfo &info)
+    {
+        std::fill(info.ne, info.ne + 4, 1);
+
+        info.ndim = read_basic<int>();
+        for (int i = info.ndim - 1; i >= 0; i--)
+            info.ne[i] = read_basic<int>();
+        info.type = (ggml_type)read_basic<int>();
+
+        if (container >= 2)
+        {
+            info.offset   = read_basic<int64_t>();
+            info.checksum = read_basic<uint32_t>();
+        }
+        else
+        {
+            constexpr int64_t MEM_ALIGNED = 16;
+            info.offset   = (tell() + (MEM_ALIGNED - 1)) & ~(MEM_ALIGNED - 1);
+            info.checksum = 0;
+
+            struct ggml_tensor t;
+            ggml_init_tensor(&t, info.type, info.ndim, info.ne);
+            seek(info.offset + ggml_nbytes(&t), SEEK_SET);
+        }
+    }
+
+    void ModelLoader::load_tensor_directory(void)
+    {
+        tensor_dict.clear();
+
+        int64_t n = read_basic<int64_t>();
+        offset_config = read_basic<int64_t>();
+
+        tensor_dict.reserve(n);
+        for (int64_t i = 0; i < n; i++)
+        {
+            int name_size = read_basic<int>();
+            std::string name = read_string(name_size);
+
+            TensorInfo info;
+            read_tensor_info(info);
+            CHATLLM_CHECK(info.offset % CONTAINER_V2_ALIGN == 0) << "tensor " << name << " is not aligned";
+            tensor_dict.emplace(std::move(name), info);
+        }
+
+        seek(offset_config, SEEK_SET);
+    }
+
+    void ModelLoader::load_all_tensors(void)
+    {
+        // the directory has been loaded along with the file header
+        if (container >= 2) return;
+
+        tensor_dict.clear();
+
+        while (tell() < (int64_t)size)
+        {
+            int name_size = read_basic<int>();
+            std::string weight_name = read_string(name_size);
+
+            TensorInfo info;
+            read_tensor_info(info);
+            tensor_dict.emplace(std::move(weight_name), info);
+        }
+    }
+
+    MappedFile *ModelLoader::tensor_file(const TensorInfo &info) const
+    {
+        return info.shard == 0 ? mapped_file.get() : shards[info.shard - 1].get();
+    }
+
+    const char *ModelLoader::tensor_data(const TensorInfo &info) const
+    {
+        return tensor_file(info)->data + info.offset;
+    }
+
+    std::vector<MappedFile *> ModelLoader::get_mapped_files(void) const
+    {
+        std::vector<MappedFile *> r{mapped_file.get()};
+        for (auto &f : shards)
+            r.push_back(f.get());
+        return r;
+    }
+
+    static int64_t align_to(int64_t v, int64_t align)
+    {
+        return (v + align - 1) / align * align;
+    }
+
+    static size_t stored_size(const ModelLoader::TensorInfo &t)
+    {
+        const int64_t rows = t.ne[1] * t.ne[2] * t.ne[3];
+        return t.bf16 ? sizeof(uint16_t) * t.ne[0] * rows : ggml_row_size(t.type, t.ne[0]) * rows;
+    }
+
+    void ModelLoader::add_shard(const std::string &path)
+    {
+        MappedFile *file = new MappedFile(path);
+        CHATLLM_CHECK(file->size >= 8) << "shard " << path << " is truncated";
+        const int shard = (int)shards.size() + 1;
+
+        if (memcmp(file->data, "ggm2", 4) == 0)
+        {
+            ModelLoader sub(file);
+            sub.seek(4 + 2 * sizeof(int), SEEK_SET);
+            sub.container = 2;
+            sub.load_tensor_directory();
+            for (auto &kv : sub.tensor_dict)
+            {
+                kv.second.shard = shard;
+                tensor_dict[kv.first] = kv.second;
+            }
+            shards.push_back(std::move(sub.mapped_file));
+            return;
+        }
+
+        // safetensors: a header (of `header_size` bytes) follows the size
+        const uint64_t header_size = *(const uint64_t *)file->data;
+        shards.emplace_back(file);
+        if (memcmp(file->data, "GGUF", 4) == 0)
+            index_gguf(file, shard);
+        else if ((file->size > 8) && (header_size <= (uint64_t)file->size - 8) && (file->data[8] == '{'))
+            index_safetensors(file, shard);
+        else
+            CHATLLM_THROW << "shard " << path << " is neither a chatllm (v2), safetensors nor GGUF file";
+    }
+
+    // just enough JSON for headers of safetensors
+    class JsonScanner
+    {
+    public:
+        JsonScanner(const char *p, const char *end) : p(p), end(end) {}
+
+        bool accept(char c)
+        {
+            skip_ws();
+            if ((p >= end) || (*p != c)) return false;
+            p++;
+            return true;
+        }
+
+        void expect(char c)
+        {
+            CHATLLM_CHECK(accept(c)) << "bad safetensors header: `" << c << "` expected at " << (const void *)p;
+        }
+
+        std::string string(void)
+        {
+            std::string r;
+            expect('"');
+            while ((p < end) && (*p != '"'))
+            {
+                char c = *p++;
+                if ((c == '\\') && (p < end))
+                {
+                    c = *p++;
+                    switch (c)
+                    {
+                    case 'n': c = '\n'; break;
+                    case 't': c = '\t'; break;
+                    case 'u': p += 4; c = '?'; break;
+                    default: break;
+                    }
+                }
+                r.push_back(c);
+            }
+            expect('"');
+            return r;
+        }
+
+        int64_t integer(void)
+        {
+            skip_ws();
+            int64_t v = 0;
+            bool neg = (p < end) && (*p == '-');
+            if (neg) p++;
+            CHATLLM_CHECK((p < end) && isdigit((unsigned char)*p)) << "bad safetensors header: integer expected";
+            while ((p < end) && isdigit((unsigned char)*p))
+                v = v * 10 + (*p++ - '0');
+            return neg ? -v : v;
+        }
+
+        void integers(std::vector<int64_t> &values)
+        {
+            expect('[');
+            if (accept(']')) return;
+            do values.push_back(integer()); while (accept(','));
+            expect(']');
+        }
+
+        void skip_value(void)
+        {
+            skip_ws();
+            CHATLLM_CHECK(p < end) << "bad safetensors header: value expected";
+            if (*p == '"')
+                string();
+            else if (accept('{'))
+            {
+                if (accept('}')) return;
+                do
+                {
+                    string();
+                    expect(':');
+                    skip_value();
+                } while (accept(','));
+                expect('}');
+            }
+            else if (accept('['))
+            {
+                if (accept(']')) return;
+                do skip_value(); while (accept(','));
+                expect(']');
+            }
+            else
+            {
+                while ((p < end) && !strchr(",]} \t\r\n", *p)) p++;
+            }
+        }
+
+    private:
+        void skip_ws(void)
+        {
+            while ((p < end) && isspace((unsigned char)*p)) p++;
+        }
+
+        const char *p;
+        const char *end;
+    };
+
+    // layout: uint64 header size | JSON header | data. tensors of other dtypes (such as integer buffers) are ignored.
+    void ModelLoader::index_safetensors(MappedFile *file, int shard)
+    {
+        const int64_t base = 8 + *(const uint64_t *)file->data;
+        JsonScanner json(file->data + 8, file->data + base);
+
+        json.expect('{');
+        if (json.accept('}')) return;
+        do
+        {
+            std::string name = json.string();
+            json.expect(':');
+            if (name == "__metadata__")
+            {
+                json.skip_value();
+                continue;
+            }
+
+            std::string dtype;
+            std::vector<int64_t> shape;
+            std::vector<int64_t> offsets;
+            json.expect('{');
+            do
+            {
+                std::string key = json.string();
+                json.expect(':');
+                if (key == "dtype")
+                    dtype = json.string();
+                else if (key == "shape")
+                    json.integers(shape);
+                else if (key == "data_offsets")
+                    json.integers(offsets);
+                else
+                    json.skip_value();
+            } while (json.accept(','));
+            json.expect('}');
+
+            TensorInfo info;
+            if (dtype == "F32")
+                info.type = GGML_TYPE_F32;
+            else if (dtype == "F16")
+                info.type = GGML_TYPE_F16;
+            else if (dtype == "BF16")
+            {
+                info.type = GGML_TYPE_F32;
+                info.bf16 = true;
+            }
+            else
+                continue;
+
+            CHATLLM_CHECK((shape.size() <= 4) && (offsets.size() == 2)) << "tensor " << name << " is not supported";
+            CHATLLM_CHECK(base + offsets[1] <= (int64_t)file->size) << "tensor " << name << " is truncated";
+
+            std::fill(info.ne, info.ne + 4, 1);
+            info.ndim = std::max(1, (int)shape.size());
+            for (size_t i = 0; i < shape.size(); i++)
+                info.ne[shape.size() - 1 - i] = shape[i];
+            info.offset   = base + offsets[0];
+            info.checksum = 0;
+            info.shard    = shard;
+            tensor_dict[name] = info;
+        } while (json.accept(','));
+        json.expect('}');
+    }
+
+    struct BoundedReader
+    {
+        const char *p;
+        const char *end;
+
+        template <typename T> T read(void)
+        {
+            T v;
+            skip(sizeof(T));
+            memcpy(&v, p - sizeof(T), sizeof(T));
+            return v;
+        }
+
+        void skip(uint64_t n)
+        {
+            CHATLLM_CHECK(n <= (uint64_t)(end - p)) << "file is truncated";
+            p += n;
+        }
+
+        std::string read_string(void)
+        {
+            uint64_t n = read<uint64_t>();
+            skip(n);
+            return std::string(p - n, p);
+        }
+    };
+
+    static void gguf_skip_value(BoundedReader &r, uint32_t type)
+    {
+        static const uint64_t sizes[] = {1, 1, 2, 2, 4, 4, 4, 1, 0, 0, 8, 8, 8};
+        CHATLLM_CHECK(type < sizeof(sizes) / sizeof(sizes[0])) << "unknown GGUF value type " << type;
+
+        if (type == 8)
+            r.read_string();
+        else if (type == 9)
+        {
+            uint32_t elem = r.read<uint32_t>();
+            uint64_t n = r.read<uint64_t>();
+            CHATLLM_CHECK(elem < sizeof(sizes) / sizeof(sizes[0])) << "unknown GGUF value type " << elem;
+            if (sizes[elem] > 0)
+                r.skip(n * sizes[elem]);
+            else
+                for (uint64_t i = 0; i < n; i++) gguf_skip_value(r, elem);
+        }
+        else
+            r.skip(sizes[type]);
+    }
+
+    // names of llama.cpp (`blk.0.attn_q.weight`) to ours (`model.layers.0.self_attn.q_proj.weight`)
+    static std::string gguf_tensor_name(const std::string &name)
+    {
+        static const std::map<std::string, std::string> globals =
+        {
+            {"token_embd",  "model.embed_tokens"},
+            {"output_norm", "model.norm"},
+            {"output",      "lm_head"},
+        };
+        static const std::map<std::string, std::string> layers =
+        {
+            {"attn_norm",   "input_layernorm"},
+            {"attn_q",      "self_attn.q_proj"},
+            {"attn_k",      "self_attn.k_proj"},
+            {"attn_v",      "self_attn.v_proj"},
+            {"attn_output", "self_attn.o_proj"},
+            {"ffn_norm",    "post_attention_layernorm"},
+            {"ffn_gate",    "mlp.gate_proj"},
+            {"ffn_up",      "mlp.up_proj"},
+            {"ffn_down",    "mlp.down_proj"},
+        };
+
+        const size_t dot = name.find_last_of('.');
+        if (dot == std::string::npos) return name;
+        const std::string stem = name.substr(0, dot);
+        const std::string suffix = name.substr(dot);
+
+        auto g = globals.find(stem);
+        if (g != globals.end()) return g->second + suffix;
+
+        if (stem.rfind("blk.", 0) != 0) return name;
+        const size_t sep = stem.find('.', 4);
+        if (sep == std::string::npos) return name;
+        auto l = layers.find(stem.substr(sep + 1));
+        if (l == layers.end()) return name;
+        return "model.layers." + stem.substr(4, sep - 4) + "." + l->second + suffix;
+    }
+
+    // GGUF v2 & v3. data are ggml tensors already (attention weights are permuted for RoPE as ours), so they are
+    // mapped as they are, and names of llama.cpp are translated.
+    void ModelLoader::index_gguf(MappedFile *file, int shard)
+    {
+        BoundedReader r{file->data + 4, file->data + file->size};
+
+        const uint32_t version = r.read<uint32_t>();
+        CHATLLM_CHECK(version >= 2) << "GGUF v" << version << " is not supported";
+        const uint64_t n_tensors = r.read<uint64_t>();
+        const uint64_t n_kv      = r.read<uint64_t>();
+
+        uint64_t alignment = 32;
+        for (uint64_t i = 0; i < n_kv; i++)
+        {
+            std::string key = r.read_string();
+            uint32_t type = r.read<uint32_t>();
+            if ((key == "general.alignment") && (type == 4))
+                alignment = r.read<uint32_t>();
+            else
+                gguf_skip_value(r, type);
+        }
+
+        std::vector<std::pair<std::string, TensorInfo>> infos;
+        for (uint64_t i = 0; i < n_tensors; i++)
+        {
+            std::string name = r.read_string();
+            TensorInfo info;
+            info.ndim = (int)r.read<uint32_t>();
+            CHATLLM_CHECK((info.ndim >= 1) && (info.ndim <= 4)) << "tensor " << name << " has " << info.ndim << " dims";
+            std::fill(info.ne, info.ne + 4, 1);
+            for (int j = 0; j < info.ndim; j++)
+                info.ne[j] = (int64_t)r.read<uint64_t>();
+            uint32_t type = r.read<uint32_t>();
+            CHATLLM_CHECK((type < GGML_TYPE_COUNT) && (ggml_blck_size((ggml_type)type) > 0)) << "tensor " << name << " has unknown type " << type;
+            info.type     = (ggml_type)type;
+            info.offset   = (int64_t)r.read<uint64_t>();
+            info.checksum = 0;
+            info.shard    = shard;
+            infos.emplace_back(gguf_tensor_name(name), info);
+        }
+
+        const int64_t base = align_to(r.p - file->data, alignment);
+        for (auto &kv : infos)
+        {
+            kv.second.offset += base;
+            CHATLLM_CHECK(kv.second.offset + (int64_t)stored_size(kv.second) <= (int64_t)file->size) << "tensor " << kv.first << " is truncated";
+            tensor_dict[kv.first] = kv.second;
+        }
+    }
+
+    void ModelLoader::read_tensor(const std::string &name, ggml_tensor *tensor)
+    {
+        TensorInfo info;
+
+        if (tensor_dict.size() > 0)
+        {
+            auto search = tensor_dict.find(name);
+            CHATLLM_CHECK(search != tensor_dict.end()) << "tensor not exist: " << name;
+            info = search->second;
+        }
+        else
+        {
+            // read and check tensor name
+            int name_size = read_basic<int>();
+            CHATLLM_CHECK(name_size == (int)name.size())
+                << "tensor " << name << " name size mismatch: expect " << name.size() << " but got " << name_size
+                << "(part of name: " << read_string(name.size()) << ")";
+            std::string weight_name = read_string(name_size);
+            CHATLLM_CHECK(weight_name == name) << "tensor name mismatch: expect " << name << " but got " << weight_name;
+
+            read_tensor_info(info);
+        }
+
+        ggml_set_name(tensor, name.c_str());
+
+        // tensor parallelism: a dimension of `tensor` is a slice of the stored one
+        const TensorInfo whole = info;
+        int64_t pieces = 1;
+        size_t piece_size = 0;
+        const bool sliced = (tp_size > 1) && slice_tensor(info, tensor, pieces, piece_size);
+
+        // check tensor shape
+        {
+            int n_dims = ggml_n_dims(tensor);
+
+            // a quick fix
+            if ((n_dims == 1) && (info.ndim == 2) && (tensor->ne[1] == 1))
+                n_dims = 2;
+
+            CHATLLM_CHECK(info.ndim == n_dims)
+                << "tensor " << name << " ndim mismatch: expect " << n_dims << " but got " << info.ndim;
+            for (int i = info.ndim - 1; i >= 0; i--)
+            {
+                CHATLLM_CHECK(info.ne[i] == tensor->ne[i]) << "tensor " << name << " shape mismatch at dim " << i
+                                                           << ": expect " << tensor->ne[i] << " but got " << info.ne[i];
+            }
+        }
+
+        // check tensor dtype
+        bool convert = false;
+        {
+            ggml_type dtype = info.type;
+
+            // weights may have been re-quantized per tensor (see `quantize`), adopt the type in the file
+            const auto &types = weight_types();
+            if (!info.bf16 && (dtype != tensor->type) && (tensor->flags & ANY_WEIGHT_TYPE)
+                && (std::find(types.begin(), types.end(), dtype) != types.end()) && (tensor->ne[0] % ggml_blck_size(dtype) == 0))
+            {
+                tensor->type  = dtype;
+                tensor->nb[0] = ggml_type_size(dtype);
+                tensor->nb[1] = tensor->nb[0] * (tensor->ne[0] / ggml_blck_size(dtype));
+                for (int i = 2; i < GGML_MAX_DIMS; i++)
+                    tensor->nb[i] = tensor->nb[i - 1] * tensor->ne[i - 1];
+            }
+
+            // floating point data of another dtype (such as bf16 of safetensors) are converted
+            convert = info.bf16 || ((dtype != tensor->type) && ((dtype == GGML_TYPE_F32) || (dtype == GGML_TYPE_F16)));
+
+            CHATLLM_CHECK(convert || (dtype == tensor->type))
+                << "tensor " << name << " dtype mismatch: expect " << tensor->type << " but got " << dtype;
+        }
+
+        // map tensor data
+        const size_t data_size = stored_size(whole);
+        CHATLLM_CHECK(whole.offset + data_size <= tensor_file(info)->size) << "tensor " << name << " is truncated";
+        if (pieces > 1)
+        {
+            CHATLLM_CHECK(!convert) << "tensor " << name << " can't be both sliced and converted";
+            copy_pieces(info, pieces, piece_size, data_size / pieces, tensor);
+        }
+        else if (convert)
+            convert_tensor(name, info, tensor);
+        else
+            tensor->data = const_cast<char *>(tensor_data(info));
+        if (0 == info.shard)
+            seek(whole.offset + data_size, SEEK_SET);
+
+        // weights read by `Linear::forward` only, with data mapped as it is, are repacked later (see `repack_tensors`)
+        tensor->extra = nullptr;
+        if ((tensor->flags & RepackedTensor::LINEAR_WEIGHT) && (tensor->data == tensor_data(info))
+            && RepackedTensor::is_supported(tensor->type, ggml_n_dims(tensor), tensor->ne))
+            repack_targets[name] = RepackTarget{tensor, info};
+
+        loaded[name] = LoadedTensor{(const char *)tensor->data, tensor->ne[1], tensor->ne[2] * tensor->ne[3], tensor->nb[1]};
+    }
+
+    bool ModelLoader::slice_tensor(TensorInfo &info, const ggml_tensor *tensor, int64_t &pieces, size_t &piece_size) const
+    {
+        int split = -1;
+        for (int i = 0; (i < 4) && (split < 0); i++)
+        {
+            if ((info.ne[i] != tensor->ne[i]) && (info.ne[i] == tensor->ne[i] * tp_size))
+                split = i;
+        }
+        if (split < 0) return false;
+
+        CHATLLM_CHECK(info.bf16 || (split > 0) || (tensor->ne[0] % ggml_blck_size(info.type) == 0))
+            << "a slice of " << tensor->ne[0] << " columns is not a multiple of blocks of " << ggml_type_name(info.type);
+
+        // the stored tensor is `pieces` times [..., ne[split], ...], each divided into `tp_size` equal parts
+        size_t inner = info.bf16 ? sizeof(uint16_t) * info.ne[0] : ggml_row_size(info.type, info.ne[0]);
+        for (int i = 1; i <= split; i++)
+            inner *= info.ne[i];
+        pieces = 1;
+        for (int i = split + 1; i < 4; i++)
+            pieces *= info.ne[i];
+
+        piece_size = inner / tp_size;
+        info.offset += tp_rank * piece_size;
+        info.ne[split] /= tp_size;
+        return true;
+    }
+
+    void ModelLoader::copy_pieces(const TensorInfo &info, int64_t pieces, size_t piece_size, size_t stride, ggml_tensor *tensor)
+    {
+        char *dst = new char[pieces * piece_size];
+        converted.emplace_back(dst);
+
+        const char *src = tensor_data(info);
+        for (int64_t i = 0; i < pieces; i++)
+            memcpy(dst + i * piece_size, src + i * stride, piece_size);
+
+        tensor->data = dst;
+    }
+
+    void ModelLoader::convert_tensor(const std::string &name, const TensorInfo &info, ggml_tensor *tensor)
+    {
+        CHATLLM_CHECK(!ggml_quantize_requires_imatrix(tensor->type)) << "tensor " << name << " can't be converted to " << ggml_type_name(tensor->type);
+
+        const int64_t n_per_row = tensor->ne[0];
+        const int64_t rows = ggml_nelements(tensor) / n_per_row;
+        const size_t row_size = ggml_row_size(tensor->type, n_per_row);
+        const char *src = tensor_data(info);
+
+        char *dst = new char[ggml_nbytes(tensor)];
+        converted.emplace_back(dst);
+
+        std::vector<float> row(n_per_row);
+        for (int64_t i = 0; i < rows; i++)
+        {
+            if (info.bf16)
+            {
+                const uint16_t *p = (const uint16_t *)src + i * n_per_row;
+                for (int64_t j = 0; j < n_per_row; j++)
+                {
+                    uint32_t u = (uint32_t)p[j] << 16;
+                    memcpy(&row[j], &u, sizeof(u));
+                }
+            }
+            else if (info.type == GGML_TYPE_F16)
+                ggml_fp16_to_fp32_row((const ggml_fp16_t *)src + i * n_per_row, row.data(), (int)n_per_row);
+            else
+                memcpy(row.data(), (const float *)src + i * n_per_row, n_per_row * sizeof(float));
+
+            char *out = dst + i * row_size;
+            if (tensor->type == GGML_TYPE_F32)
+                memcpy(out, row.data(), row_size);
+            else if (tensor->type == GGML_TYPE_F16)
+                ggml_fp32_to_fp16_row(row.data(), (ggml_fp16_t *)out, (int)n_per_row);
+            else
+                ggml_quantize_chunk(tensor->type, row.data(), out, 0, 1, (int)n_per_row, nullptr);
+        }
+
+        tensor->data = dst;
+    }
+
+    void ModelLoader::advise_tensors(MappedFile::Advice advice)
+    {
+        for (auto &kv : tensor_dict)
+        {
+            const TensorInfo &t = kv.second;
+            tensor_file(t)->advise(t.offset, stored_size(t), advice);
+        }
+    }
+
+    void ModelLoader::prefault_tensors(int num_threads)
+    {
+        for (auto file : get_mapped_files())
+        {
+            int64_t start = (int64_t)file->size;
+            for (auto &kv : tensor_dict)
+            {
+                if (tensor_file(kv.second) == file)
+                    start = std::min(start, kv.second.offset);
+            }
+            file->prefault(start, file->size - start, num_threads);
+        }
+    }
+
+    // page i of the range goes to nodes[i % nodes.size()], pages are faulted in first
+    static size_t move_pages_to_nodes(const char *data, size_t length, const std::vector<int> &nodes)
+    {
+#if defined(__linux__) && defined(SYS_move_pages)
+        const uintptr_t page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+        const uintptr_t begin = (uintptr_t)data & ~(page_size - 1);
+        const uintptr_t end   = (uintptr_t)data + length;
+        const size_t batch = 1024;
+
+        std::vector<void *> pages;
+        std::vector<int> targets;
+        std::vector<int> status;
+        size_t moved = 0;
+        size_t index = 0;
+        for (uintptr_t p = begin; p < end; )
+        {
+            pages.clear();
+            targets.clear();
+            for (; (p < end) && (pages.size() < batch); p += page_size, index++)
+            {
+                volatile char c = *(const char *)p;
+                (void)c;
+                pages.push_back((void *)p);
+                targets.push_back(nodes[index % nodes.size()]);
+            }
+            status.resize(pages.size());
+            if (syscall(SYS_move_pages, 0, (unsigned long)pages.size(), pages.data(), targets.data(), status.data(), 0) < 0)
+                return moved;
+            moved += pages.size() * page_size;
+        }
+        return moved;
+#else
+        (void)data; (void)length; (void)nodes;
+        return 0;
+#endif
+    }
+
+    size_t ModelLoader::place_tensors(const std::vector<int> &nodes, bool interleave)
+    {
+        if (nodes.size() < 1) return 0;
+
+        const uintptr_t page_size = (uintptr_t)get_page_size();
+        size_t placed = 0;
+        for (auto &kv : loaded)
+        {
+            const LoadedTensor &t = kv.second;
+            const size_t matrix_size = t.rows * t.row_size;
+
+            if (interleave || (t.rows < (int64_t)nodes.size()))
+            {
+                placed += move_pages_to_nodes(t.data, matrix_size * t.matrices, nodes);
+                continue;
+            }
+
+            // inner block edges are rounded up to pages, so that a page shared by two blocks is moved only once
+            const uintptr_t end = (uintptr_t)t.data + matrix_size * t.matrices;
+            auto edge = [&](int64_t m, size_t k) -> uintptr_t
+            {
+                const uintptr_t p = (uintptr_t)(t.data + m * matrix_size + t.rows * k / nodes.size() * t.row_size);
+                if ((m == 0) && (k == 0)) return p;
+                return std::min((p + page_size - 1) & ~(page_size - 1), end);
+            };
+
+            for (int64_t m = 0; m < t.matrices; m++)
+            {
+                for (size_t k = 0; k < nodes.size(); k++)
+                {
+                    const uintptr_t b0 = edge(m, k);
+                    const uintptr_t b1 = edge(m, k + 1);
+                    if (b1 > b0)
+                        placed += move_pages_to_nodes((const char *)b0, b1 - b0, {nodes[k]});
+                }
+            }
+        }
+        return placed;
+    }
+
+    const std::vector<ggml_type> &ModelLoader::weight_types(void)
+    {
+        static const std::vector<ggml_type> types =
+        {
+            GGML_TYPE_F32, GGML_TYPE_F16,
+            GGML_TYPE_Q4_0, GGML_TYPE_Q4_1, GGML_TYPE_Q5_0, GGML_TYPE_Q5_1, GGML_TYPE_Q8_0,
+            GGML_TYPE_Q2_K, GGML_TYPE_Q3_K, GGML_TYPE_Q4_K, GGML_TYPE_Q5_K, GGML_TYPE_Q6_K,
+            GGML_TYPE_IQ2_XXS, GGML_TYPE_IQ2_XS, GGML_TYPE_IQ2_S, GGML_TYPE_IQ3_XXS, GGML_TYPE_IQ3_S,
+            GGML_TYPE_IQ1_S, GGML_TYPE_IQ4_NL, GGML_TYPE_IQ4_XS,
+        };
+        return types;
+    }
+
+    uint32_t ModelLoader::checksum(const void *data, size_t size, uint32_t crc)
+    {
+        static const std::array<uint32_t, 256> table = []()
+        {
+            std::array<uint32_t, 256> t;
+            for (uint32_t i = 0; i < 256; i++)
+            {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++)
+                    c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                t[i] = c;
+            }
+            return t;
+        }();
+
+        const uint8_t *p = (const uint8_t *)data;
+        crc = ~crc;
+        for (size_t i = 0; i < size; i++)
+            crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+        return ~crc;
+    }
+
+    bool RepackedTensor::is_supported(ggml_type type, int ndim, const int64_t *ne)
+    {
+        if ((type != GGML_TYPE_Q4_0) && (type != GGML_TYPE_Q8_0)) return false;
+        return (ndim == 2) && (ne[0] % ggml_blck_size(type) == 0) && (ne[1] % ROWS_PER_GROUP == 0);
+    }
+
+    // blocks of Q4_0 & Q8_0 are a fp16 scale followed by quants
+    static void repack_rows(const char *src, char *dst, ggml_type type, int64_t rows, int64_t row_size)
+    {
+        const int G = RepackedTensor::ROWS_PER_GROUP;
+        const size_t block_size = ggml_type_size(type);
+        const size_t scale_size = sizeof(ggml_fp16_t);
+        const size_t quant_size = block_size - scale_size;
+        const int64_t nb = row_size / block_size;
+
+        for (int64_t g = 0; g < rows / G; g++)
+        {
+            const char *group = src + g * G * row_size;
+            char *p = dst + g * G * row_size;
+            for (int64_t b = 0; b < nb; b++)
+            {
+                for (int r = 0; r < G; r++, p += scale_size)
+                    memcpy(p, group + r * row_size + b * block_size, scale_size);
+                for (int r = 0; r < G; r++, p += quant_size)
+                    memcpy(p, group + r * row_size + b * block_size + scale_size, quant_size);
+            }
+        }
+    }
+
+    static std::vector<std::string> sorted_names(const std::unordered_map<std::string, ModelLoader::TensorInfo> &dict)
+    {
+        std::vector<std::string> names;
+        for (auto &kv : dict)
+            names.push_back(kv.first);
+        std::sort(names.begin(), names.end());
+        return names;
+    }
+
+    void ModelLoader::repack_tensors(int num_threads, const std::string &cache_path)
+    {
+#ifndef GGML_USE_CLBLAST
+        if ((repacked.size() > 0) || (repack_targets.size() < 1)) return;
+
+        std::vector<std::string> names;
+        for (auto &kv : repack_targets)
+            names.push_back(kv.first);
+        std::sort(names.begin(), names.end());
+
+        const uint32_t digest = repack_digest(names);
+        if ((cache_path.size() < 1) || !load_repack_cache(cache_path, digest))
+        {
+            std::vector<TensorInfo> infos;
+            std::vector<int64_t> offsets;
+            int64_t total = 0;
+            for (auto &name : names)
+            {
+                const TensorInfo &t = repack_targets.at(name).info;
+                infos.push_back(t);
+                offsets.push_back(total);
+                total = align_to(total + ggml_row_size(t.type, t.ne[0]) * t.ne[1], CONTAINER_V2_ALIGN);
+            }
+
+            repack_arena.reset(new char[total + CONTAINER_V2_ALIGN]);
+            char *base = (char *)align_to((int64_t)repack_arena.get(), CONTAINER_V2_ALIGN);
+
+            std::atomic<size_t> next(0);
+            auto worker = [&]()
+            {
+                for (size_t i = next++; i < names.size(); i = next++)
+                {
+                    const TensorInfo &t = infos[i];
+                    repack_rows(tensor_data(t), base + offsets[i], t.type, t.ne[1], ggml_row_size(t.type, t.ne[0]));
+                }
+            };
+
+            std::vector<std::thread> threads;
+            for (int i = 1; i < num_threads; i++)
+                threads.emplace_back(worker);
+            worker();
+            for (auto &t : threads)
+                t.join();
+
+            for (size_t i = 0; i < names.size(); i++)
+            {
+                const TensorInfo &t = infos[i];
+                const int64_t row_size = ggml_row_size(t.type, t.ne[0]);
+                repacked[names[i]] = RepackedTensor{t.type, t.ne[1], row_size, base + offsets[i]};
+            }
+
+            if (cache_path.size() > 0)
+                save_repack_cache(cache_path, digest);
+        }
+
+        for (auto &name : names)
+        {
+            const RepackTarget &target = repack_targets.at(name);
+            auto r = repacked.find(name);
+            if ((r == repacked.end()) || (r->second.type != target.tensor->type) || (r->second.rows != target.tensor->ne[1]))
+                continue;
+
+            target.tensor->extra = &r->second;
+            loaded[name].data = (const char *)r->second.data;
+
+            // the GEMV kernel reads the arena only, pages of the original copy can be dropped
+            tensor_file(target.info)->advise(target.info.offset, r->second.row_size * r->second.rows, MappedFile::Advice::DontNeed);
+        }
+#endif
+    }
+
+    uint32_t ModelLoader::repack_digest(const std::vector<std::string> &names) const
+    {
+        const int version = 3;
+        const int rows_per_group = RepackedTensor::ROWS_PER_GROUP;
+        uint32_t crc = checksum(&version, sizeof(version));
+        crc = checksum(&rows_per_group, sizeof(rows_per_group), crc);
+        crc = checksum(&size, sizeof(size), crc);
+
+        // the weights repacked, and slices of them taken by this rank
+        for (auto &name : names)
+        {
+            const TensorInfo &t = repack_targets.at(name).info;
+            crc = checksum(name.data(), name.size(), crc);
+            crc = checksum(t.ne, sizeof(t.ne), crc);
+            crc = checksum(&t.offset, sizeof(t.offset), crc);
+        }
+
+        // contents are identified by checksums of tensors (container v2), or else by the files holding them
+        const std::vector<MappedFile *> files = get_mapped_files();
+        std::vector<bool> by_file(files.size(), false);
+        auto has_checksums = [this, &files](int shard)
+        {
+            return shard == 0 ? container >= 2 : memcmp(files[shard]->data, "ggm2", 4) == 0;
+        };
+        for (auto &name : sorted_names(tensor_dict))
+        {
+            const TensorInfo &t = tensor_dict.at(name);
+            crc = checksum(name.data(), name.size(), crc);
+            crc = checksum(&t.type, sizeof(t.type), crc);
+            crc = checksum(t.ne, sizeof(t.ne), crc);
+            crc = checksum(&t.offset, sizeof(t.offset), crc);
+            crc = checksum(&t.shard, sizeof(t.shard), crc);
+            if (has_checksums(t.shard))
+                crc = checksum(&t.checksum, sizeof(t.checksum), crc);
+            else
+                by_file[t.shard] = true;
+        }
+
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            if (!by_file[i]) continue;
+            crc = checksum(&files[i]->size, sizeof(files[i]->size), crc);
+            crc = checksum(&files[i]->mtime, sizeof(files[i]->mtime), crc);
+            crc = checksum(&files[i]->inode, sizeof(files[i]->inode), crc);
+        }
+        return crc;
+    }
+
+    // layout: "ggrp" | int rows_per_group | uint32 digest | int64 n | entries | data (aligned)
+    //   entry: [int name_len][name][int type][int64 rows][int64 row_size][int64 offset]
+    bool ModelLoader::load_repack_cache(const std::string &path, uint32_t digest)
+    {
+        if (!std::ifstream(path, std::ios::binary).good()) return false;
+
+        std::unique_ptr<ModelLoader> cache;
+        try
+        {
+            cache.reset(new ModelLoader(path));
+        }
+        catch (std::exception &e)
+        {
+            return false;
+        }
+
+        if (cache->size < 20) return false;
+        if (cache->read_string(4) != "ggrp") return false;
+        if (cache->read_basic<int>() != RepackedTensor::ROWS_PER_GROUP) return false;
+        if (cache->read_basic<uint32_t>() != digest) return false;
+
+        std::unordered_map<std::string, RepackedTensor> entries;
+        const int64_t n = cache->read_basic<int64_t>();
+        for (int64_t i = 0; i < n; i++)
+        {
+            if (cache->tell() + 4 > (int64_t)cache->size) return false;
+            const int name_len = cache->read_basic<int>();
+            if ((name_len <= 0) || (cache->tell() + name_len + 28 > (int64_t)cache->size)) return false;
+
+            std::string name = cache->read_string(name_len);
+            RepackedTensor t;
+            t.type = (ggml_type)cache->read_basic<int>();
+            t.rows = cache->read_basic<int64_t>();
+            t.row_size = cache->read_basic<int64_t>();
+            const int64_t offset = cache->read_basic<int64_t>();
+            if ((offset < 0) || (offset + t.rows * t.row_size > (int64_t)cache->size)) return false;
+
+            t.data = cache->data + offset;
+            entries.emplace(std::move(name), t);
+        }
+
+        repacked = std::move(entries);
+        repack_file = std::move(cache->mapped_file);
+        return true;
+    }
+
+    void ModelLoader::save_repack_cache(const std::string &path, uint32_t digest) const
+    {
+        std::vector<std::string> names;
+        for (auto &kv : repacked)
+            names.push_back(kv.first);
+        std::sort(names.begin(), names.end());
+
+        int64_t offset = 4 + sizeof(int) + sizeof(uint32_t) + sizeof(int64_t);
+        for (auto &name : names)
+            offset += sizeof(int) + name.size() + sizeof(int) + 3 * sizeof(int64_t);
+
+        const std::string tmp = path + ".tmp";
+        std::ofstream f(tmp, std::ios::binary);
+
+        auto write = [&f](const void *p, size_t n) { f.write((const char *)p, n); };
+        auto write_int = [&write](int v) { write(&v, sizeof(v)); };
+        auto write_int64 = [&write](int64_t v) { write(&v, sizeof(v)); };
+
+        const int rows_per_group = RepackedTensor::ROWS_PER_GROUP;
+        write("ggrp", 4);
+        write_int(rows_per_group);
+        write(&digest, sizeof(digest));
+        write_int64((int64_t)names.size());
+
+        std::vector<int64_t> offsets;
+        for (auto &name : names)
+        {
+            const RepackedTensor &t = repacked.at(name);
+            offset = align_to(offset, CONTAINER_V2_ALIGN);
+            offsets.push_back(offset);
+
+            write_int((int)name.size());
+            write(name.data(), name.size());
+            write_int(t.type);
+            write_int64(t.rows);
+            write_int64(t.row_size);
+            write_int64(offset);
+            offset += t.rows * t.row_size;
+        }
+
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            const RepackedTensor &t = repacked.at(names[i]);
+            const std::vector<char> padding(offsets[i] - (int64_t)f.tellp(), 0);
+            write(padding.data(), padding.size());
+            write(t.data, t.rows * t.row_size);
+        }
+
+        f.close();
+        if (f.good())
+        {
+            std::remove(path.c_str());
+            if (std::rename(tmp.c_str(), path.c_str()) == 0)
+                return;
+        }
+
+        std::remove(tmp.c_str());
+        std::cerr << "warning: failed to save repacked weights to " << path << std::endl;
+    }
+
+    WeightStreamer::WeightStreamer(const std::vector<MappedFile *> &files, int prefetch_layers)
+        : files(files), prefetch_layers(std::max(1, prefetch_layers)), last_boundary(nullptr), last_n_nodes(0)
+    {
+    }
+
+    ggml_tensor *WeightStreamer::layer_boundary(ForwardContext *ctx, int index, ggml_tensor *hidden_states)
+    {
+        // weights of a layer are found when the first graph is built
+        if ((index > 0) && ((int)layers.size() == index - 1))
+            collect_layer(ctx, hidden_states);
+
+        while ((int)hooks.size() <= index)
+            hooks.push_back(Hook{this, (int)hooks.size()});
+
+        // everything before the boundary goes into the graph now, so nodes added later belong to the next layer
+        last_boundary = ggml_map_custom1_inplace(ctx->gctx.get(), hidden_states, on_boundary, 1, &hooks[index]);
+        ggml_build_forward_expand(ctx->gf, last_boundary);
+        last_n_nodes  = ctx->gf->n_nodes;
+        extra_weights.clear();
+        return last_boundary;
+    }
+
+    void WeightStreamer::add_weights(std::initializer_list<const std::vector<ggml_tensor *> *> weights)
+    {
+        for (auto list : weights)
+            extra_weights.insert(extra_weights.end(), list->begin(), list->end());
+    }
+
+    // tensors mapped from the file, reachable from the output of the layer (or nodes added into the graph
+    // while building the layer, such as KV cache updates) without passing the previous boundary
+    void WeightStreamer::collect_layer(ForwardContext *ctx, ggml_tensor *output)
+    {
+        std::vector<ggml_tensor *> stack{output};
+        for (int i = last_n_nodes; i < ctx->gf->n_nodes; i++)
+            stack.push_back(ctx->gf->nodes[i]);
+        stack.insert(stack.end(), extra_weights.begin(), extra_weights.end());
+
+        std::set<ggml_tensor *> visited;
+        std::vector<Range> ranges;
+        while (stack.size() > 0)
+        {
+            ggml_tensor *t = stack.back();
+            stack.pop_back();
+            if ((t == last_boundary) || !visited.insert(t).second) continue;
+
+            const char *p = (const char *)t->data;
+            for (auto file : files)
+            {
+                if ((p >= file->data) && (p < file->data + file->size))
+                    ranges.push_back(Range{file, (size_t)(p - file->data), ggml_nbytes(t)});
+            }
+
+            // not `view_src`, which may skip over the boundary
+            for (int j = 0; j < GGML_MAX_SRC; j++)
+                if (t->src[j]) stack.push_back(t->src[j]);
+        }
+
+        std::sort(ranges.begin(), ranges.end(), [](const Range &a, const Range &b)
+        {
+            return a.file != b.file ? a.file < b.file : a.offset < b.offset;
+        });
+
+        std::vector<Range> merged;
+        for (auto &r : ranges)
+        {
+            if ((merged.size() > 0) && (r.file == merged.back().file) && (r.offset <= merged.back().offset + merged.back().size))
+                merged.back().size = std::max(merged.back().size, r.offset + r.size - merged.back().offset);
+            else
+                merged.push_back(r);
+        }
+
+        layers.push_back(std::move(merged));
+    }
+
+    void WeightStreamer::advise_layer(int index, MappedFile::Advice advice)
+    {
+        if ((index < 0) || (index >= (int)layers.size())) return;
+        for (auto &r : layers[index])
+            r.file->advise(r.offset, r.size, advice);
+    }
+
+    void WeightStreamer::on_boundary(ggml_tensor *dst, const ggml_tensor *a, int ith, int nth, void *userdata)
+    {
+        const Hook *hook = (const Hook *)userdata;
+        WeightStreamer *streamer = hook->streamer;
+
+        streamer->advise_layer(hook->index - 1, MappedFile::Advice::DontNeed);
+
+        int from = hook->index == 0 ? 0 : hook->index + streamer->prefetch_layers;
+        for (int i = from; i <= hook->index + streamer->prefetch_layers; i++)
+            streamer->advise_layer(i, MappedFile::Advice::WillNeed);
+
+        // after the last layer, get the first ones ready for the next evaluation
+        if (hook->index == (int)streamer->layers.size())
+        {
+            for (int i = 0; i < streamer->prefetch_layers; i++)
+                streamer->advise_layer(i, MappedFile::Advice::WillNeed);
+        }
+    }
+
+    static long current_pid(void)
+    {
+#if defined(_WIN32)
+        return (long)GetCurrentProcessId();
+#else
+        return (long)getpid();
+#endif
+    }
+
+    // the background thread applying hot sets picked by `count`
+    struct ExpertStats::Pinner
+    {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::unique_ptr<std::thread> thread;
+        long pid = 0;
+        bool stopping = false;
+        std::set<Layer *> pending;
+    };
+
+    ExpertStats::ExpertStats(const std::vector<MappedFile *> &files, float pin_ratio)
+        : files(files), pin_ratio(std::min(pin_ratio, 1.0f)), pinner(new Pinner())
+    {
+    }
+
+    ExpertStats::~ExpertStats()
+    {
+        if (!pinner->thread) return;
+
+        // the thread of the parent is not there after fork()
+        if (pinner->pid != current_pid())
+        {
+            (void)pinner->thread.release();
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(pinner->mutex);
+            pinner->stopping = true;
+        }
+        pinner->cv.notify_one();
+        pinner->thread->join();
+    }
+
+    ggml_tensor *ExpertStats::hook(ForwardContext *ctx, int layer, ggml_tensor *selected,
+                                   std::initializer_list<const std::vector<ggml_tensor *> *> weights)
+    {
+        auto it = layers.find(layer);
+        if (it == layers.end())
+        {
+            Layer l;
+            l.owner = this;
+            for (auto w : weights)
+            {
+                if (l.weights.size() < w->size())
+                    l.weights.resize(w->size());
+                for (size_t i = 0; i < w->size(); i++)
+                    l.weights[i].push_back(w->at(i));
+            }
+            l.counts.resize(l.weights.size(), 0);
+            l.pinned.resize(l.weights.size(), false);
+            for (auto &w : l.weights)
+                l.locked.emplace_back(w.size(), false);
+            it = layers.emplace(layer, std::move(l)).first;
+        }
+
+        return ggml_map_custom1_inplace(ctx->gctx.get(), selected, count, 1, &it->second);
+    }
+
+    void ExpertStats::count(ggml_tensor *dst, const ggml_tensor *a, int ith, int nth, void *userdata)
+    {
+        Layer *layer = (Layer *)userdata;
+        const int64_t n = (int64_t)layer->counts.size();
+
+        for (int64_t t = 0; t < a->ne[1]; t++)
+        {
+            for (int64_t k = 0; k < a->ne[0]; k++)
+            {
+                const int32_t e = *(const int32_t *)((const char *)a->data + t * a->nb[1] + k * a->nb[0]);
+                if ((e >= 0) && (e < n))
+                    layer->counts[e]++;
+            }
+        }
+        layer->tokens += a->ne[1];
+
+        ExpertStats *owner = layer->owner;
+        if ((owner->pin_ratio > 0) && (layer->tokens - layer->tokens_at_update >= PIN_INTERVAL))
+            owner->pick_hot(*layer);
+    }
+
+    MappedFile *ExpertStats::find_file(const ggml_tensor *tensor, size_t &offset) const
+    {
+        const char *p = (const char *)tensor->data;
+        for (auto file : files)
+        {
+            if ((p >= file->data) && (p + ggml_nbytes(tensor) <= file->data + file->size))
+            {
+                offset = p - file->data;
+                return file;
+            }
+        }
+        return nullptr;
+    }
+
+    // only picks the experts, locking is left to `pin_loop`
+    void ExpertStats::pick_hot(Layer &layer)
+    {
+        layer.tokens_at_update = layer.tokens;
+
+        const int n = (int)layer.counts.size();
+        std::vector<int> order(n);
+        for (int i = 0; i < n; i++) order[i] = i;
+        std::sort(order.begin(), order.end(), [&layer](int a, int b) { return layer.counts[a] > layer.counts[b]; });
+
+        int64_t total = 0;
+        for (auto c : layer.counts) total += c;
+
+        std::vector<bool> hot(n, false);
+        int64_t covered = 0;
+        for (int i = 0; (i < n) && (covered < total * pin_ratio); i++)
+        {
+            hot[order[i]] = true;
+            covered += layer.counts[order[i]];
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(pinner->mutex);
+            layer.hot = std::move(hot);
+            pinner->pending.insert(&layer);
+
+            if (!pinner->thread || (pinner->pid != current_pid()))
+            {
+                (void)pinner->thread.release();
+                pinner->pid = current_pid();
+                pinner->thread.reset(new std::thread(&ExpertStats::pin_loop, this));
+            }
+        }
+        pinner->cv.notify_one();
+    }
+
+    void ExpertStats::pin_loop(void)
+    {
+        std::unique_lock<std::mutex> lock(pinner->mutex);
+        while (true)
+        {
+            pinner->cv.wait(lock, [this] { return pinner->stopping || (pinner->pending.size() > 0); });
+            if (pinner->stopping) break;
+
+            Layer *layer = *pinner->pending.begin();
+            pinner->pending.erase(pinner->pending.begin());
+            const std::vector<bool> hot = layer->hot;
+
+            lock.unlock();
+            update_pins(*layer, hot);
+            lock.lock();
+        }
+    }
+
+    void ExpertStats::update_pins(Layer &layer, const std::vector<bool> &hot)
+    {
+        for (size_t e = 0; e < hot.size(); e++)
+        {
+            std::vector<bool> &locked = layer.locked[e];
+            bool all = true;
+            for (size_t i = 0; i < layer.weights[e].size(); i++)
+            {
+                const ggml_tensor *t = layer.weights[e][i];
+                size_t offset = 0;
+                MappedFile *file = find_file(t, offset);
+                if (nullptr == file) continue;
+
+                if (hot[e] && !locked[i])
+                    locked[i] = file->lock(offset, ggml_nbytes(t));
+                else if (!hot[e] && locked[i])
+                {
+                    file->unlock(offset, ggml_nbytes(t));
+                    file->advise(offset, ggml_nbytes(t), MappedFile::Advice::DontNeed);
+                    locked[i] = false;
+                }
+                all = all && (locked[i] || !hot[e]);
+            }
+
+            // e.g. RLIMIT_MEMLOCK reached: undo partial locks, and try again at the next update
+            if (hot[e] && !all)
+            {
+                for (size_t i = 0; i < layer.weights[e].size(); i++)
+                {
+                    size_t offset = 0;
+                    MappedFile *file = find_file(layer.weights[e][i], offset);
+                    if (!file || !locked[i]) continue;
+                    file->unlock(offset, ggml_nbytes(layer.weights[e][i]));
+                    locked[i] = false;
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(pinner->mutex);
+            layer.pinned[e] = hot[e] && all;
+        }
+    }
+
+    size_t ExpertStats::get_pinned_bytes(void) const
+    {
+        std::lock_guard<std::mutex> lock(pinner->mutex);
+        size_t r = 0;
+        for (auto &kv : layers)
+        {
+            const Layer &layer = kv.second;
+            for (size_t e = 0; e < layer.weights.size(); e++)
+            {
+                if (!layer.pinned[e]) continue;
+                for (auto t : layer.weights[e])
+                {
+                    size_t offset = 0;
+                    if (find_file(t, offset)) r += ggml_nbytes(t);
+                }
+            }
+        }
+        return r;
+    }
+
+    std::vector<std::string> ExpertStats::summary(int top_n) const
+    {
+        std::lock_guard<std::mutex> lock(pinner->mutex);
+        std::vector<std::string> r;
+        for (auto &kv : layers)
+        {
+            const Layer &layer = kv.second;
+            const int n = (int)layer.counts.size();
+
+            std::vector<int> order(n);
+            for (int i = 0; i < n; i++) order[i] = i;
+            std::sort(order.begin(), order.end(), [&layer](int a, int b) { return layer.counts[a] > layer.counts[b]; });
+
+            int64_t total = 0;
+            for (auto c : layer.counts) total += c;
+
+            int n90 = 0;
+            for (int64_t covered = 0; (n90 < n) && (covered < total * 0.9); n90++)
+                covered += layer.counts[order[n90]];
+
+            std::ostringstream oss;
+            oss << "layer " << std::setw(3) << kv.first << ": " << layer.tokens << " tokens, "
+                << n90 << "/" << n << " experts for 90%, top:";
+            for (int i = 0; (i < top_n) && (i < n); i++)
+            {
+                oss << " #" << order[i] << " " << std::fixed << std::setprecision(1)
+                    << (total > 0 ? layer.counts[order[i]] * 100.0 / total : 0.0) << "%";
+                if (layer.pinned[order[i]]) oss << "*";
+            }
+            r.push_back(oss.str());
+        }
+        return r;
+    }
+
+    ComputePool::ComputePool(const std::vector<int> &cpus, const std::vector<NumaNode> &nodes, int spin_us)
+        : cpus(cpus), nodes(nodes), spin_us(spin_us), pool(nullptr), n_threads(0), pid(0)
+    {
+    }
+
+    ComputePool::~ComputePool()
+    {
+        if (pool && (pid == current_pid()))
+            ggml_threadpool_free(pool);
+    }
+
+    void ComputePool::partition(int index, int count)
+    {
+        if (count <= 1) return;
+
+        auto slice = [index, count](const std::vector<int> &all)
+        {
+            const size_t from = all.size() * index / count;
+            const size_t to   = all.size() * (index + 1) / count;
+            if (from < to)
+                return std::vector<int>(all.begin() + from, all.begin() + to);
+            // fewer CPUs than processes
+            return std::vector<int>{all[index % all.size()]};
+        };
+
+        if (cpus.size() > 0)
+            cpus = slice(cpus);
+        for (auto &node : nodes)
+        {
+            if (node.cpus.size() > 0)
+                node.cpus = slice(node.cpus);
+        }
+
+        // re-created with the new CPUs
+        if (pool && (pid == current_pid()))
+            ggml_threadpool_free(pool);
+        pool = nullptr;
+        this->n_threads = 0;
+    }
+
+    ggml_threadpool *ComputePool::get(int n_threads)
+    {
+        // workers of the parent are not there after fork(), so the pool is dropped without joining them
+        if (pool && (pid != current_pid()))
+            pool = nullptr;
+
+        if (pool && (n_threads <= this->n_threads))
+            return pool;
+
+        if (pool)
+            ggml_threadpool_free(pool);
+
+        std::vector<int> pinned;
+        if (nodes.size() > 1)
+        {
+            const int n_nodes = (int)nodes.size();
+            for (int i = 0; i < n_threads; i++)
+            {
+                const int k = i * n_nodes / n_threads;
+                const int first = (k * n_threads + n_nodes - 1) / n_nodes;
+                const std::vector<int> &node_cpus = nodes[k].cpus;
+                pinned.push_back(node_cpus[(i - first) % node_cpus.size()]);
+            }
+        }
+        else
+        {
+            for (int i = 0; (i < n_threads) && (cpus.size() > 0); i++)
+                pinned.push_back(cpus[i % cpus.size()]);
+        }
+
+        ggml_threadpool_params params;
+        params.n_threads = n_threads;
+        params.cpus      = pinned.size() > 0 ? pinned.data() : nullptr;
+        params.spin_us   = spin_us;
+
+        pool = ggml_threadpool_new(params);
+        this->n_threads = n_threads;
+        pid = current_pid();
+        return pool;
+    }
+
+    std::vector<int> ComputePool::physical_cores(void)
+    {
+        std::vector<int> r;
+#if defined(__linux__)
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+            return r;
+
+        std::set<std::string> seen;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (!CPU_ISSET(cpu, &allowed)) continue;
+
+            std::string siblings;
+            const std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+            for (auto name : {"core_cpus_list", "thread_siblings_list"})
+            {
+                std::ifstream f(dir + name);
+                if (std::getline(f, siblings)) break;
+            }
+            if (siblings.size() < 1)
+                return std::vector<int>();
+
+            if (seen.insert(siblings).second)
+                r.push_back(cpu);
+        }
+#endif
+        return r;
+    }
+
+    static std::vector<int> parse_cpu_list(const std::string &spec)
+    {
+        std::vector<int> r;
+        std::istringstream iss(spec);
+        std::string item;
+        while (std::getline(iss, item, ','))
+        {
+            size_t pos = item.find('-');
+            int first = std::stoi(item.substr(0, pos));
+            int last  = pos != std::string::npos ? std::stoi(item.substr(pos + 1)) : first;
+            CHATLLM_CHECK((first >= 0) && (first <= last)) << "invalid CPU list: " << spec;
+            for (int i = first; i <= last; i++)
+                r.push_back(i);
+        }
+        return r;
+    }
+
+    std::vector<int> ComputePool::parse_affinity(const std::string &spec)
+    {
+        if ((spec.size() < 1) || (spec == "none"))
+            return std::vector<int>();
+
+        if (spec == "cores")
+        {
+            auto r = physical_cores();
+            if (r.size() < 1)
+                std::cerr << "warning: physical cores unknown, threads are not pinned" << std::endl;
+            return r;
+        }
+
+        return parse_cpu_list(spec);
+    }
+
+    std::vector<ComputePool::NumaNode> ComputePool::numa_nodes(void)
+    {
+        std::vector<NumaNode> r;
+#if defined(__linux__)
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+            return r;
+
+        const std::vector<int> cores = physical_cores();
+        const std::set<int> core_set(cores.begin(), cores.end());
+
+        for (int id = 0; ; id++)
+        {
+            std::ifstream f("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+            std::string list;
+            if (!f.is_open()) break;
+            if (!std::getline(f, list) || (list.size() < 1)) continue;
+
+            NumaNode node{id, {}};
+            std::vector<int> siblings;
+            for (int cpu : parse_cpu_list(list))
+            {
+                if ((cpu >= CPU_SETSIZE) || !CPU_ISSET(cpu, &allowed)) continue;
+                if (core_set.count(cpu) > 0)
+                    node.cpus.push_back(cpu);
+                else
+                    siblings.push_back(cpu);
+            }
+            node.cpus.insert(node.cpus.end(), siblings.begin(), siblings.end());
+            if (node.cpus.size() > 0)
+                r.push_back(node);
+        }
+#endif
+        return r;
+    }
+
+    static std::string host_name(void)
+    {
+        char name[256] = {0};
+#if defined(_WIN32)
+        DWORD size = sizeof(name);
+        GetComputerNameA(name, &size);
+#else
+        gethostname(name, sizeof(name) - 1);
+#endif
+        return std::string(name) + "/" + std::to_string(std::thread::hardware_concurrency());
+    }
+
+    static const char *phase_names[ThreadTuner::Phase::NUM] = {"prefill", "decode"};
+
+    ThreadTuner::ThreadTuner(const std::string &cache_path, const std::string &placement)
+        : cache_path(cache_path), host(host_name() + "/" + placement), following(false)
+    {
+    }
+
+    void ThreadTuner::follow(void)
+    {
+        following = true;
+        for (auto &s : states)
+            s = State();
+    }
+
+    // a line for each tuned phase: host max_threads phase threads
+    bool ThreadTuner::load(Phase phase)
+    {
+        State &s = states[phase];
+        std::ifstream f(cache_path);
+        std::string h, p;
+        int m, n;
+        while (f >> h >> m >> p >> n)
+        {
+            if ((h == host) && (m == s.max_threads) && (p == phase_names[phase]) && (n > 0) && (n <= s.max_threads))
+                s.best = n;
+        }
+        last_load = std::chrono::steady_clock::now();
+        return s.best > 0;
+    }
+
+    void ThreadTuner::restart(Phase phase, int max_threads)
+    {
+        State &s = states[phase];
+        s = State();
+        s.max_threads = max_threads;
+
+        if (load(phase) || following) return;
+
+        for (int n = max_threads; n >= 1; n = n * 3 / 4)
+            s.candidates.push_back(n);
+    }
+
+    int ThreadTuner::pick(Phase phase, int max_threads)
+    {
+        State &s = states[phase];
+        if (s.max_threads != max_threads)
+            restart(phase, max_threads);
 
-        for (int i = 0; i < n_dims; i++) {
-            result->ne[i] = ne[i];
+        if (following && (s.best <= 0))
+        {
+            // not too often, this is called for each graph
+            if (std::chrono::steady_clock::now() - last_load > std::chrono::seconds(10))
+                load(phase);
+            return s.best > 0 ? s.best : max_threads;
         }
+        return s.best > 0 ? s.best : s.candidates[s.rates.size()];
+    }
 
-        result->nb[0] = ggml_type_size(type);
-        result->nb[1] = result->nb[0]*(result->ne[0]/ggml_blck_size(type));
-        for (int i = 2; i < GGML_MAX_DIMS; i++) {
-            result->nb[i] = result->nb[i - 1]*result->ne[i - 1];
-        }
+    void ThreadTuner::record(Phase phase, int n_threads, int tokens, double ms)
+    {
+        State &s = states[phase];
+        if ((s.best > 0) || (s.rates.size() >= s.candidates.size()) || (s.candidates[s.rates.size()] != n_threads))
+            return;
 
-        return result;
+        if (s.samples++ < 0) return;
+        s.tokens += tokens;
+        s.ms     += ms;
+        if (s.samples < SAMPLES[phase]) return;
+
+        s.rates.push_back(s.tokens / std::max(s.ms, 1e-3));
+        s.samples = 0;
+        s.tokens  = 0;
+        s.ms      = 0;
+
+        // fewer threads keep losing once memory bandwidth (or compute) is no longer saturated
+        const size_t n = s.rates.size();
+        const size_t best = std::max_element(s.rates.begin(), s.rates.end()) - s.rates.begin();
+        const bool dropping = (n >= best + 3) && (s.rates[n - 1] < s.rates[best] * 0.9) && (s.rates[n - 2] < s.rates[best] * 0.9);
+        if (dropping || (n >= s.candidates.size()))
+        {
+            s.best = s.candidates[best];
+            save();
+        }
     }
 
-    void ModelLoader::load_all_tensors(void)
+    void ThreadTuner::save(void) const
     {
-        tensor_dict.clear(); //return;
-        struct ggml_tensor t;
+        if (cache_path.size() < 1) return;
 
-        while (tell() < (int64_t)size)
+        std::vector<std::string> lines;
         {
-            std::string weight_name;
+            std::ifstream f(cache_path);
+            std::string line;
+            while (std::getline(f, line))
+            {
+                std::istringstream iss(line);
+                std::string h, p;
+                int m;
+                if (!(iss >> h >> m >> p)) continue;
+
+                bool replaced = false;
+                for (int i = 0; i < Phase::NUM; i++)
+                    replaced |= (states[i].best > 0) && (h == host) && (m == states[i].max_threads) && (p == phase_names[i]);
+                if (!replaced)
+                    lines.push_back(line);
+            }
+        }
 
-            // read and check tensor name
+        // readers (e.g. followers) see either the old file or the new one
+        const std::string tmp = cache_path + ".tmp" + std::to_string(current_pid());
+        {
+            std::ofstream f(tmp, std::ios::trunc);
+            for (auto &line : lines)
+                f << line << std::endl;
+            for (int i = 0; i < Phase::NUM; i++)
             {
-                int name_size = read_basic<int>();
-                weight_name = read_string(name_size);
+                if (states[i].best > 0)
+                    f << host << " " << states[i].max_threads << " " << phase_names[i] << " " << states[i].best << std::endl;
             }
+            if (!f.good())
+            {
+                f.close();
+                std::remove(tmp.c_str());
+                return;
+            }
+        }
+
+        if (std::rename(tmp.c_str(), cache_path.c_str()) != 0)
+        {
+            // e.g. Windows does not replace an existing file
+            std::remove(cache_path.c_str());
+            if (std::rename(tmp.c_str(), cache_path.c_str()) != 0)
+                std::remove(tmp.c_str());
+        }
+    }
 
-            tensor_dict.emplace(weight_name, tell());
+    thread_local int InitContext::tensor_parallel_size = 1;
 
-            int64_t ne[4] = {1,1,1,1};
+#if !defined(_WIN32)
+    // a file mapped by all ranks: a barrier, then a slot of `SLOT_FLOATS` for each rank.
+    // each rank copies its data into its slot, and sums all slots (in rank order) once all are there.
+    class ShmTransport : public TensorParallel::Transport
+    {
+    public:
+        static constexpr int64_t SLOT_FLOATS = 1 << 20;
+        static constexpr int TIMEOUT_S = 120;
 
-            // read and check tensor shape
-            int ndim = read_basic<int>();
-            for (int i = ndim - 1; i >= 0; i--)
+        ShmTransport(const std::string &name, int rank, int size)
+            : path(name.find('/') != std::string::npos ? name : SHM_DIR + name), rank(rank), size(size), sense(0)
+        {
+            const size_t total = sizeof(Header) + sizeof(float) * SLOT_FLOATS * size;
+            int fd = -1;
+            if (rank == 0)
+            {
+                unlink(path.c_str());
+                fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+                CHATLLM_CHECK(fd >= 0) << "failed to create " << path << ": " << strerror(errno);
+                CHATLLM_CHECK(ftruncate(fd, total) == 0) << "ftruncate: " << strerror(errno);
+                map(fd, total);
+                header->owner.store(getpid());
+            }
+            else
             {
-                int dim_size = read_basic<int>();
-                ne[i] = dim_size;
+                // a file left by an earlier run has a dead owner, wait for rank 0 to replace it
+                auto t0 = std::chrono::steady_clock::now();
+                while (true)
+                {
+                    fd = open(path.c_str(), O_RDWR);
+                    struct stat st;
+                    if ((fd >= 0) && (fstat(fd, &st) == 0) && ((size_t)st.st_size == total))
+                    {
+                        map(fd, total);
+                        const int owner = header->owner.load();
+                        if ((owner > 0) && (kill(owner, 0) == 0))
+                            break;
+                        munmap(header, total);
+                        header = nullptr;
+                    }
+                    if (fd >= 0) close(fd);
+                    CHATLLM_CHECK(std::chrono::steady_clock::now() - t0 < std::chrono::seconds(TIMEOUT_S))
+                        << "rank 0 did not create " << path;
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                }
             }
+            close(fd);
 
-            // read and check tensor dtype
-            ggml_type dtype = (ggml_type)read_basic<int>();
-            ggml_init_tensor(&t, dtype, ndim, ne);
+            header->joined.fetch_add(1);
+            while (header->joined.load() < size)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        ~ShmTransport()
+        {
+            munmap(header, mapped_size);
+            if (rank == 0)
+                unlink(path.c_str());
+        }
 
-            // map tensor data
+        void all_reduce(float *data, int64_t n) override
+        {
+            for (int64_t offset = 0; offset < n; offset += SLOT_FLOATS)
             {
-                constexpr int64_t MEM_ALIGNED = 16;
-                const int64_t data_offset = (tell() + (MEM_ALIGNED - 1)) & ~(MEM_ALIGNED - 1);
-                seek(data_offset + ggml_nbytes(&t), SEEK_SET);
+                const int64_t m = std::min(SLOT_FLOATS, n - offset);
+                memcpy(slot(rank), data + offset, m * sizeof(float));
+                barrier();
+
+                float *out = data + offset;
+                memcpy(out, slot(0), m * sizeof(float));
+                for (int r = 1; r < size; r++)
+                {
+                    const float *p = slot(r);
+                    for (int64_t i = 0; i < m; i++)
+                        out[i] += p[i];
+                }
+
+                // slots are not overwritten before all ranks have read them
+                barrier();
             }
         }
-    }
 
-    void ModelLoader::read_tensor(const std::string &name, ggml_tensor *tensor)
-    {
-        if (tensor_dict.size() > 0)
+    private:
+        struct Header
         {
-            auto search = tensor_dict.find(name);
-            CHATLLM_CHECK(search != tensor_dict.end()) << "tensor not exist: " << name;
-            seek(search->second, SEEK_SET);
+            std::atomic<int> owner;
+            std::atomic<int> joined;
+            std::atomic<int> arrived;
+            std::atomic<int> sense;
+            char padding[64 - 4 * sizeof(std::atomic<int>)];
+        };
+
+#if defined(__linux__)
+        static constexpr const char *SHM_DIR = "/dev/shm/";
+#else
+        static constexpr const char *SHM_DIR = "/tmp/";
+#endif
+
+        void map(int fd, size_t total)
+        {
+            void *p = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            CHATLLM_CHECK(p != MAP_FAILED) << "mmap: " << strerror(errno);
+            header = (Header *)p;
+            mapped_size = total;
         }
-        else
+
+        float *slot(int r)
         {
-            // read and check tensor name
-            int name_size = read_basic<int>();
-            CHATLLM_CHECK(name_size == (int)name.size())
-                << "tensor " << name << " name size mismatch: expect " << name.size() << " but got " << name_size
-                << "(part of name: " << read_string(name.size()) << ")";
-            std::string weight_name = read_string(name_size);
-            CHATLLM_CHECK(weight_name == name) << "tensor name mismatch: expect " << name << " but got " << weight_name;
+            return (float *)(header + 1) + r * SLOT_FLOATS;
         }
 
-        ggml_set_name(tensor, name.c_str());
+        // sense-reversing barrier
+        void barrier(void)
+        {
+            sense = 1 - sense;
+            if (header->arrived.fetch_add(1) == size - 1)
+            {
+                header->arrived.store(0);
+                header->sense.store(sense);
+            }
+            else
+            {
+                for (int spin = 0; header->sense.load() != sense; spin++)
+                {
+                    if (spin > 10000) std::this_thread::yield();
+                }
+            }
+        }
+
+        const std::string path;
+        const int rank;
+        const int size;
+        int sense;
+        Header *header = nullptr;
+        size_t mapped_size = 0;
+    };
 
-        // read and check tensor shape
+    // rank 0 listens, receives data of other ranks, sums them in rank order and sends the sums back
+    class TcpTransport : public TensorParallel::Transport
+    {
+    public:
+        static constexpr int TIMEOUT_S = 120;
+
+        TcpTransport(const std::string &address, int rank, int size)
+            : rank(rank), size(size), socks(size, -1)
         {
-            int ndim = read_basic<int>();
-            int n_dims = ggml_n_dims(tensor);
+            const size_t pos = address.rfind(':');
+            CHATLLM_CHECK(pos != std::string::npos) << "expect HOST:PORT, but got " << address;
+            const std::string host = address.substr(0, pos);
+            const std::string port = address.substr(pos + 1);
+
+            addrinfo hints;
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_INET;
+            hints.ai_socktype = SOCK_STREAM;
+            addrinfo *ai = nullptr;
+            CHATLLM_CHECK(getaddrinfo(host.c_str(), port.c_str(), &hints, &ai) == 0) << "can't resolve " << address;
+
+            if (rank == 0)
+            {
+                int fd = socket(AF_INET, SOCK_STREAM, 0);
+                int on = 1;
+                setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+                CHATLLM_CHECK(bind(fd, ai->ai_addr, ai->ai_addrlen) == 0) << "bind " << address << ": " << strerror(errno);
+                CHATLLM_CHECK(listen(fd, size) == 0) << "listen: " << strerror(errno);
+                for (int i = 1; i < size; i++)
+                {
+                    int s = accept(fd, nullptr, nullptr);
+                    CHATLLM_CHECK(s >= 0) << "accept: " << strerror(errno);
+                    int r = -1;
+                    recv_all(s, &r, sizeof(r));
+                    CHATLLM_CHECK((r > 0) && (r < size) && (socks[r] < 0)) << "unexpected rank " << r;
+                    socks[r] = s;
+                }
+                close(fd);
+            }
+            else
+            {
+                auto t0 = std::chrono::steady_clock::now();
+                while (true)
+                {
+                    int s = socket(AF_INET, SOCK_STREAM, 0);
+                    if (connect(s, ai->ai_addr, ai->ai_addrlen) == 0)
+                    {
+                        socks[0] = s;
+                        break;
+                    }
+                    close(s);
+                    CHATLLM_CHECK(std::chrono::steady_clock::now() - t0 < std::chrono::seconds(TIMEOUT_S))
+                        << "can't connect to rank 0 at " << address;
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                }
+                send_all(socks[0], &rank, sizeof(rank));
+            }
+            freeaddrinfo(ai);
 
-            // a quick fix
-            if ((n_dims == 1) && (ndim == 2) && (tensor->ne[1] == 1))
-                n_dims = 2;
+            for (int s : socks)
+            {
+                int on = 1;
+                if (s >= 0) setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            }
+        }
+
+        ~TcpTransport()
+        {
+            for (int s : socks)
+                if (s >= 0) close(s);
+        }
+
+        void all_reduce(float *data, int64_t n) override
+        {
+            if (rank != 0)
+            {
+                send_all(socks[0], data, n * sizeof(float));
+                recv_all(socks[0], data, n * sizeof(float));
+                return;
+            }
 
-            CHATLLM_CHECK(ndim == n_dims)
-                << "tensor " << name << " ndim mismatch: expect " << n_dims << " but got " << ndim;
-            for (int i = ndim - 1; i >= 0; i--)
+            buffer.resize(n);
+            for (int r = 1; r < size; r++)
             {
-                int dim_size = read_basic<int>();
-                CHATLLM_CHECK(dim_size == tensor->ne[i]) << "tensor " << name << " shape mismatch at dim " << i
-                                                         << ": expect " << tensor->ne[i] << " but got " << dim_size;
+                recv_all(socks[r], buffer.data(), n * sizeof(float));
+                for (int64_t i = 0; i < n; i++)
+                    data[i] += buffer[i];
             }
+            for (int r = 1; r < size; r++)
+                send_all(socks[r], data, n * sizeof(float));
         }
 
-        // read and check tensor dtype
+    private:
+        static void send_all(int s, const void *data, size_t len)
         {
-            ggml_type dtype = (ggml_type)read_basic<int>();
-            CHATLLM_CHECK(dtype == tensor->type)
-                << "tensor " << name << " dtype mismatch: expect " << tensor->type << " but got " << dtype;
+            const char *p = (const char *)data;
+            while (len > 0)
+            {
+                ssize_t k = send(s, p, len, 0);
+                CHATLLM_CHECK(k > 0) << "tensor parallel: send: " << strerror(errno);
+                p += k;
+                len -= k;
+            }
         }
 
-        // map tensor data
+        static void recv_all(int s, void *data, size_t len)
         {
-            constexpr int64_t MEM_ALIGNED = 16;
-            const int64_t data_offset = (tell() + (MEM_ALIGNED - 1)) & ~(MEM_ALIGNED - 1);
-            tensor->data = const_cast<char *>(data) + data_offset;
-            seek(data_offset + ggml_nbytes(tensor), SEEK_SET);
+            char *p = (char *)data;
+            while (len > 0)
+            {
+                ssize_t k = recv(s, p, len, 0);
+                CHATLLM_CHECK(k > 0) << "tensor parallel: peer closed";
+                p += k;
+                len -= k;
+            }
+        }
+
+        const int rank;
+        const int size;
+        std::vector<int> socks;
+        std::vector<float> buffer;
+    };
+#endif
+
+    TensorParallel::TensorParallel(int rank, int size, const std::string &transport)
+        : rank(rank), size(size)
+    {
+        CHATLLM_CHECK((size > 1) && (rank >= 0) && (rank < size)) << "invalid tensor parallel rank " << rank << " of " << size;
+
+#if defined(_WIN32)
+        CHATLLM_THROW << "tensor parallelism is not supported on this platform";
+#else
+        if (transport.rfind("shm:", 0) == 0)
+            this->transport.reset(new ShmTransport(transport.substr(4), rank, size));
+        else if (transport.rfind("tcp:", 0) == 0)
+            this->transport.reset(new TcpTransport(transport.substr(4), rank, size));
+        else
+            CHATLLM_THROW << "unknown tensor parallel transport: " << transport;
+#endif
+    }
+
+    ggml_tensor *TensorParallel::all_reduce(ForwardContext *ctx, ggml_tensor *t)
+    {
+        if (!ggml_is_contiguous(t))
+            t = ggml_cont(ctx->gctx.get(), t);
+        return ggml_map_custom1_inplace(ctx->gctx.get(), t, all_reduce_op, 1, this);
+    }
+
+    void TensorParallel::all_reduce_op(ggml_tensor *dst, const ggml_tensor *a, int ith, int nth, void *userdata)
+    {
+        TensorParallel *tp = (TensorParallel *)userdata;
+        tp->transport->all_reduce((float *)dst->data, ggml_nelements(dst));
+    }
+
+    void TensorParallel::broadcast_values(int *values, int64_t n)
+    {
+        // 16-bit halves are exact in float
+        std::vector<float> halves(2 * n, 0.0f);
+        for (int64_t i = 0; (rank == 0) && (i < n); i++)
+        {
+            halves[2 * i    ] = (float)(((uint32_t)values[i] >> 16) & 0xffff);
+            halves[2 * i + 1] = (float)( (uint32_t)values[i]        & 0xffff);
+        }
+        transport->all_reduce(halves.data(), 2 * n);
+        for (int64_t i = 0; i < n; i++)
+            values[i] = (int)(((uint32_t)halves[2 * i] << 16) | (uint32_t)halves[2 * i + 1]);
+    }
+
+    int TensorParallel::broadcast(int value)
+    {
+        broadcast_values(&value, 1);
+        return value;
+    }
+
+    std::vector<int> TensorParallel::broadcast(const std::vector<int> &values)
+    {
+        std::vector<int> r(values);
+        r.resize(broadcast((int)values.size()));
+        if (r.size() > 0)
+            broadcast_values(r.data(), (int64_t)r.size());
+        return r;
+    }
+
+    std::string TensorParallel::default_transport(const std::string &model_path, int size)
+    {
+        std::string abs_path = model_path;
+#if !defined(_WIN32)
+        char *resolved = realpath(model_path.c_str(), nullptr);
+        if (resolved)
+        {
+            abs_path = resolved;
+            free(resolved);
         }
+#endif
+        std::ostringstream oss;
+        oss << "shm:chatllm-" << std::hex << std::hash<std::string>()(abs_path) << std::dec << "-" << size;
+        return oss.str();
     }
 
     ModelObject::ModelObject(const std::string &path)
@@ -659,14 +2811,101 @@ namespace chatllm
     }
 
     ModelObject::ModelObject(const std::string &path, const extra_args &args)
-        : loader(nullptr), loaded(path.size() > 0)
+        : loader(nullptr), loaded(path.size() > 0), load_ms(0.0), resident_before_load(-1.0f)
     {
         ModelFactory::Result result = {nullptr, nullptr};
         if (path.size() > 0)
         {
-            loader = std::unique_ptr<ModelLoader>(new ModelLoader(path));
-            if (!ModelFactory::load(*loader, result, args))
-                CHATLLM_THROW << "ModelFactory::load() failed";
+            auto t0 = std::chrono::steady_clock::now();
+            StartupProfiler::Scope phase(args.profiler, "model_object");
+
+            {
+                StartupProfiler::Scope step(args.profiler, "map_file");
+                loader = std::unique_ptr<ModelLoader>(new ModelLoader(path));
+            }
+            MappedFile *file = loader->get_mapped_file();
+            resident_before_load = file->resident_ratio();
+
+            loader->tp_rank = args.tp_rank;
+            loader->tp_size = args.tp_size;
+
+            {
+                StartupProfiler::Scope step(args.profiler, "factory");
+                if (!ModelFactory::load(*loader, result, args))
+                    CHATLLM_THROW << "ModelFactory::load() failed";
+            }
+
+            if (args.tp_size > 1)
+            {
+                StartupProfiler::Scope step(args.profiler, "tensor_parallel");
+                const std::string transport = args.tp_transport.size() > 0 ? args.tp_transport
+                                                                            : TensorParallel::default_transport(path, args.tp_size);
+                tensor_parallel.reset(new TensorParallel(args.tp_rank, args.tp_size, transport));
+            }
+
+            StartupProfiler::Scope residency(args.profiler, "residency");
+            const std::vector<MappedFile *> files = loader->get_mapped_files();
+            if (args.hugepage)
+            {
+                for (auto f : files)
+                    f->advise(0, f->size, MappedFile::Advice::HugePage);
+            }
+            if (args.mmap_advice != MappedFile::Advice::Normal)
+                loader->advise_tensors(args.mmap_advice);
+            if (args.prefault_threads > 0)
+                loader->prefault_tensors(args.prefault_threads);
+            std::vector<ComputePool::NumaNode> nodes;
+            if (args.numa != "none")
+            {
+                CHATLLM_CHECK((args.numa == "distribute") || (args.numa == "interleave")) << "unknown NUMA mode: " << args.numa;
+                nodes = ComputePool::numa_nodes();
+                if (nodes.size() > 1)
+                {
+                    std::vector<int> ids;
+                    for (auto &n : nodes) ids.push_back(n.id);
+                    if (loader->place_tensors(ids, args.numa == "interleave") < 1)
+                        std::cerr << "warning: failed to move weights to NUMA nodes (" << strerror(errno) << ")" << std::endl;
+                }
+                else
+                {
+                    std::cerr << "warning: a single NUMA node, --numa is ignored" << std::endl;
+                    nodes.clear();
+                }
+            }
+            if (args.mlock)
+            {
+                for (auto f : files)
+                {
+                    if (f->lock()) continue;
+                    std::cerr << "warning: failed to lock model in memory (" << strerror(errno) << "), check `ulimit -l`" << std::endl;
+                    break;
+                }
+            }
+            if (args.stream_layers > 0)
+            {
+                weight_streamer.reset(new WeightStreamer(files, args.stream_layers));
+                result.model->set_weight_streamer(weight_streamer.get());
+            }
+            if (args.expert_stats || (args.pin_hot_experts > 0))
+            {
+                // nothing to pin when the whole model is locked
+                expert_stats.reset(new ExpertStats(files, args.mlock ? 0.0f : args.pin_hot_experts));
+                result.model->set_expert_stats(expert_stats.get());
+            }
+            compute_pool.reset(new ComputePool(ComputePool::parse_affinity(args.thread_affinity), nodes, args.thread_spin_us));
+            result.model->set_compute_pool(compute_pool.get());
+            thread_tuner.reset(new ThreadTuner(args.thread_tune_cache, args.thread_affinity + "," + args.numa));
+            result.model->set_thread_tuner(thread_tuner.get());
+            if (tensor_parallel)
+                result.model->set_tensor_parallel(tensor_parallel.get());
+
+            if (args.profiler)
+            {
+                args.profiler->set_value("file_size", (double)file->size);
+                args.profiler->set_value("resident_before_load", resident_before_load);
+            }
+
+            load_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
         }
 
         tokenizer = std::move(result.tokenizer);
@@ -684,7 +2923,37 @@ namespace chatllm
     AbstractModel *ModelObject::fork_model(const extra_args &args)
     {
         if (!loaded) return nullptr;
-        return ModelFactory::load_model_again(*loader, args);
+        AbstractModel *forked = ModelFactory::load_model_again(*loader, args);
+        if (weight_streamer)
+            forked->set_weight_streamer(weight_streamer.get());
+        if (expert_stats)
+            forked->set_expert_stats(expert_stats.get());
+        if (compute_pool)
+            forked->set_compute_pool(compute_pool.get());
+        if (thread_tuner)
+            forked->set_thread_tuner(thread_tuner.get());
+        if (tensor_parallel)
+            forked->set_tensor_parallel(tensor_parallel.get());
+        return forked;
+    }
+
+    TokenizerObject::TokenizerObject(const std::string &path)
+        : TokenizerObject(path, ModelObject::extra_args())
+    {
+    }
+
+    TokenizerObject::TokenizerObject(const std::string &path, const ModelObject::extra_args &args)
+        : loader(new ModelLoader(path))
+    {
+        tokenizer = std::unique_ptr<BaseTokenizer>(ModelFactory::load_tokenizer(*loader, args));
+        CHATLLM_CHECK(tokenizer.get() != nullptr) << "ModelFactory::load_tokenizer() failed";
+    }
+
+    int TokenizerObject::count_tokens(const std::string &text) const
+    {
+        std::vector<int> ids;
+        tokenizer->encode(text, ids);
+        return (int)ids.size();
     }
 
     // ===== pipeline =====
@@ -871,6 +3140,8 @@ namespace chatllm
     void Pipeline::restart(void)
     {
         initializing = true;
+        if (modelobj.loaded)
+            tokenizer->reset_history_ledger();
     }
 
     void Pipeline::rewind(int n_past)
@@ -976,6 +3247,8 @@ namespace chatllm
     {
         if (!modelobj.loaded) return;
         tokenizer->set_additional_args(args);
+        // encoders may read them
+        tokenizer->reset_history_ledger();
     }
 
     void Pipeline::before_chat(std::vector<std::string> &history, const GenerationConfig &gen_config, BaseStreamer *streamer)
@@ -1368,4 +3641,162 @@ final:
         return r;
     }
 
+    StartupProfiler::Scope::Scope(StartupProfiler *profiler, const char *name)
+        : profiler(profiler)
+    {
+        if (profiler) profiler->begin(name);
+    }
+
+    StartupProfiler::Scope::~Scope()
+    {
+        if (profiler) profiler->end();
+    }
+
+    StartupProfiler::StartupProfiler()
+        : t0(std::chrono::steady_clock::now())
+    {
+    }
+
+    StartupProfiler::Sample StartupProfiler::sample(void) const
+    {
+        Sample r = {std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count(), 0, 0, 0};
+#if defined(RUSAGE_SELF)
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) == 0)
+        {
+            r.minor_faults = usage.ru_minflt;
+            r.major_faults = usage.ru_majflt;
+        }
+#endif
+#if defined(__linux__)
+        std::ifstream f("/proc/self/statm");
+        int64_t pages = 0;
+        if (f >> pages >> pages)
+            r.rss = pages * sysconf(_SC_PAGESIZE);
+#endif
+        return r;
+    }
+
+    void StartupProfiler::begin(const std::string &name)
+    {
+        std::string full = stack.size() > 0 ? phases[stack.back()].name + "/" + name : name;
+        stack.push_back(phases.size());
+        phases.push_back(Phase{full, sample(), {}});
+    }
+
+    void StartupProfiler::end(void)
+    {
+        CHATLLM_CHECK(stack.size() > 0) << "unbalanced startup phases";
+        Phase &phase = phases[stack.back()];
+        stack.pop_back();
+
+        const Sample now = sample();
+        phase.delta = Sample{now.ms - phase.start.ms,
+                             now.minor_faults - phase.start.minor_faults,
+                             now.major_faults - phase.start.major_faults,
+                             now.rss - phase.start.rss};
+    }
+
+    void StartupProfiler::set_value(const std::string &name, double value)
+    {
+        for (auto &kv : values)
+        {
+            if (kv.first != name) continue;
+            kv.second = value;
+            return;
+        }
+        values.emplace_back(name, value);
+    }
+
+    std::string StartupProfiler::to_json(void) const
+    {
+        std::ostringstream oss;
+        oss << std::fixed << std::setprecision(3);
+        oss << "{\n  \"phases\": [";
+        for (size_t i = 0; i < phases.size(); i++)
+        {
+            const Phase &p = phases[i];
+            oss << (i > 0 ? ",\n" : "\n")
+                << "    {\"name\": \"" << p.name << "\", "
+                << "\"start_ms\": " << p.start.ms << ", "
+                << "\"ms\": " << p.delta.ms << ", "
+                << "\"minor_faults\": " << p.delta.minor_faults << ", "
+                << "\"major_faults\": " << p.delta.major_faults << ", "
+                << "\"rss_bytes\": " << p.delta.rss << "}";
+        }
+        oss << "\n  ],\n  \"values\": {";
+        for (size_t i = 0; i < values.size(); i++)
+            oss << (i > 0 ? ",\n" : "\n") << "    \"" << values[i].first << "\": " << values[i].second;
+        oss << "\n  }\n}\n";
+        return oss.str();
+    }
+
+    ggml_tensor *ImatrixCollector::hook(ForwardContext *ctx, ggml_tensor *weight, ggml_tensor *input)
+    {
+        const char *name = ggml_get_name(weight);
+        if ((name[0] == '\0') || (input->type != GGML_TYPE_F32) || (weight->ne[0] != input->ne[0]))
+            return input;
+
+        Stats &s = stats[name];
+        if (s.sums.size() == 0)
+            s.sums.resize(input->ne[0], 0.0);
+        CHATLLM_CHECK((int64_t)s.sums.size() == input->ne[0]) << "imatrix of " << name << ": column number changed";
+
+        return ggml_map_custom1_inplace(ctx->gctx.get(), input, collect, GGML_N_TASKS_MAX, &s);
+    }
+
+    void ImatrixCollector::collect(ggml_tensor *dst, const ggml_tensor *a, int ith, int nth, void *userdata)
+    {
+        Stats *s = (Stats *)userdata;
+        const int64_t ne0 = a->ne[0];
+        const int64_t col0 = ne0 * ith / nth;
+        const int64_t col1 = ne0 * (ith + 1) / nth;
+
+        for (int64_t i3 = 0; i3 < a->ne[3]; i3++)
+        {
+            for (int64_t i2 = 0; i2 < a->ne[2]; i2++)
+            {
+                for (int64_t i1 = 0; i1 < a->ne[1]; i1++)
+                {
+                    const char *row = (const char *)a->data + i1 * a->nb[1] + i2 * a->nb[2] + i3 * a->nb[3];
+                    for (int64_t i0 = col0; i0 < col1; i0++)
+                    {
+                        const float x = *(const float *)(row + i0 * a->nb[0]);
+                        s->sums[i0] += x * x;
+                    }
+                }
+            }
+        }
+
+        if (ith == 0)
+            s->n_rows += a->ne[1] * a->ne[2] * a->ne[3];
+    }
+
+    void ImatrixCollector::save(const std::string &fn) const
+    {
+        FILE *f = fopen(fn.c_str(), "wb");
+        CHATLLM_CHECK(f != nullptr) << "failed to open " << fn << " for writing";
+
+        auto write_int = [f](int v) { fwrite(&v, sizeof(v), 1, f); };
+
+        write_int((int)stats.size());
+        for (auto &kv : stats)
+        {
+            write_int((int)kv.first.size());
+            fwrite(kv.first.data(), 1, kv.first.size(), f);
+            write_int((int)std::min(kv.second.n_rows, (int64_t)INT32_MAX));
+            write_int((int)kv.second.sums.size());
+
+            // keep values / n_call as the mean even if n_rows is clamped
+            const double scale = kv.second.n_rows > INT32_MAX ? (double)INT32_MAX / kv.second.n_rows : 1.0;
+            for (auto v : kv.second.sums)
+            {
+                float x = (float)(v * scale);
+                fwrite(&x, sizeof(x), 1, f);
+            }
+        }
+
+        fclose(f);
+    }
+
 } // namespace chatllm
@@ -4,6 +4,7 @@
 #include <memory>
 #include <sstream>
 #include <unordered_map>
+#include <deque>
 #include <map>
 #include <set>
 #include <vector>
@@ -88,6 +89,8 @@ namespace chatllm
 
         virtual void set_skip_sys_prompt(bool skip);
 
+        void reset_history_ledger(void);
+
         int bos_token_id;
         int eos_token_id;
         int pad_token_id;
@@ -96,6 +99,9 @@ namespace chatllm
     protected:
         virtual int get_history_start(const std::vector<std::string> &history, int max_length) const;
 
+        // keeps token counts and encoded rounds of `history`, only new or changed messages are encoded
+        void sync_history_ledger(const std::vector<std::string> &history);
+
         virtual std::string preprocess(const std::string &text) const;
         virtual std::string postprocess(const std::string &text) const;
 
@@ -111,6 +117,24 @@ namespace chatllm
         BaseHistoryEncoder *qa_encoder;
         bool auto_add_bos;
         std::set<int> terminate_ids;
+
+        struct HistoryLedger
+        {
+            std::vector<size_t> msg_hashes;
+            // prefix_tokens[i]: number of tokens in messages [0, i)
+            std::vector<size_t> prefix_tokens{0};
+
+            // ids of round i (messages 2i and 2i + 1) appended by `encoder` as round `round_idx`,
+            // which also depend on the system prompt (`context`)
+            struct Round
+            {
+                const BaseHistoryEncoder *encoder = nullptr;
+                int round_idx = -1;
+                size_t context = 0;
+                std::vector<int> ids;
+            };
+            std::vector<Round> rounds;
+        } ledger;
     };
 
     class BaseHistoryEncoder
@@ -180,13 +204,67 @@ namespace chatllm
     {
         GGMLContext gctx;
         ggml_type dtype;
+        int tp_size = tensor_parallel_size;     // ranks sharing heads of `BaseAttention` and features of `BaseMLP`
+
+        // models create their `InitContext`s when constructed: `tp_size` of those created within its scope
+        class TensorParallelScope
+        {
+        public:
+            TensorParallelScope(int size) : prev(tensor_parallel_size) { tensor_parallel_size = size; }
+            ~TensorParallelScope() { tensor_parallel_size = prev; }
+        private:
+            const int prev;
+        };
+
+        static thread_local int tensor_parallel_size;
     };
 
+    class ImatrixCollector;
+    class WeightStreamer;
+    class ExpertStats;
+    class TensorParallel;
+    class Block;
+
     struct ForwardContext
     {
         GGMLContext gctx;
         ggml_cgraph *gf;
-        ggml_scratch scratch;
+        ImatrixCollector *imatrix = nullptr;
+        WeightStreamer *weight_streamer = nullptr;
+        ExpertStats *expert_stats = nullptr;
+        TensorParallel *tensor_parallel = nullptr;
+
+        // the graph is built to reserve the compute buffer only, and is never computed
+        bool reserving = false;
+
+        // the latest norm (`RMSNorm` or `LayerNorm`), its input and output, so that products taking
+        // the output can have it quantized by the norm directly. see `quantized_input` in layers.cpp
+        Block *last_norm = nullptr;
+        ggml_tensor *last_norm_input = nullptr;
+        ggml_tensor *last_norm_output = nullptr;
+    };
+
+    // collects the importance matrix (mean of squared activations of each input column) of linear weights,
+    // which is used by `quantize --imatrix`
+    class ImatrixCollector
+    {
+    public:
+        struct Stats
+        {
+            std::vector<double> sums;
+            int64_t n_rows = 0;
+        };
+
+        ggml_tensor *hook(ForwardContext *ctx, ggml_tensor *weight, ggml_tensor *input);
+
+        void save(const std::string &fn) const;
+
+        size_t size(void) const { return stats.size(); }
+
+    private:
+        static void collect(ggml_tensor *dst, const ggml_tensor *a, int ith, int nth, void *userdata);
+
+        std::map<std::string, Stats> stats;
     };
 
     class ChunkInterceptor;
@@ -261,12 +339,247 @@ namespace chatllm
     class MappedFile
     {
     public:
+        enum Advice
+        {
+            Normal,
+            Random,
+            Sequential,
+            WillNeed,
+            DontNeed,
+            HugePage,
+        };
+
         MappedFile(const std::string &path);
         ~MappedFile();
 
+        // hints are best-effort, failures are ignored
+        void advise(size_t offset, size_t length, Advice advice);
+
+        // touch every page of the range, `num_threads` threads touch disjoint sub-ranges
+        void prefault(size_t offset, size_t length, int num_threads);
+
+        bool lock(void);
+
+        // lock pages covering the range, or unlock pages lying entirely within the range
+        bool lock(size_t offset, size_t length);
+        void unlock(size_t offset, size_t length);
+
+        // ratio of pages in page cache, or -1 if unknown
+        float resident_ratio(void) const;
+
     public:
         char *data;
         size_t size;
+        bool locked;
+        int64_t mtime;      // modification time and inode number of the file, 0 if unknown
+        uint64_t inode;
+    };
+
+    // counts how often each expert of MoE layers is selected, see `BaseSparseMLP`.
+    // with `pin_ratio` > 0, each layer keeps its most selected experts, which receive `pin_ratio` of its
+    // selections, locked in memory, and releases the pages of the others, so that they are paged in on demand.
+    // only weights mapped from `files` are locked or released. the hot set is picked while counting, and is
+    // applied by a background thread, so that paging in newly hot experts does not stall the graph.
+    class ExpertStats
+    {
+    public:
+        struct Layer
+        {
+            ExpertStats *owner;
+            std::vector<int64_t> counts;
+            std::vector<std::vector<ggml_tensor *>> weights;    // weights of each expert
+            std::vector<std::vector<bool>> locked;              // lock state of each of `weights`
+            std::vector<bool> pinned;                           // all weights of the expert are locked
+            std::vector<bool> hot;                              // picked by `count`, to be applied
+            int64_t tokens = 0;
+            int64_t tokens_at_update = 0;
+        };
+
+        // hot experts are re-evaluated after this number of tokens of a layer
+        static constexpr int64_t PIN_INTERVAL = 256;
+
+        ExpertStats(const std::vector<MappedFile *> &files, float pin_ratio);
+        ~ExpertStats();
+
+        // `weights`: lists (gate, up, ...) of weights indexed by expert
+        ggml_tensor *hook(ForwardContext *ctx, int layer, ggml_tensor *selected,
+                          std::initializer_list<const std::vector<ggml_tensor *> *> weights);
+
+        const std::map<int, Layer> &get_layers(void) const { return layers; }
+
+        size_t get_pinned_bytes(void) const;
+
+        // a line for each layer: tokens, number of experts receiving 90% of selections, and the top experts
+        std::vector<std::string> summary(int top_n = 4) const;
+
+    private:
+        struct Pinner;
+
+        static void count(ggml_tensor *dst, const ggml_tensor *a, int ith, int nth, void *userdata);
+
+        void pick_hot(Layer &layer);
+        void update_pins(Layer &layer, const std::vector<bool> &hot);
+        void pin_loop(void);
+        MappedFile *find_file(const ggml_tensor *tensor, size_t &offset) const;
+
+        const std::vector<MappedFile *> files;
+        const float pin_ratio;
+        std::map<int, Layer> layers;
+        std::unique_ptr<Pinner> pinner;
+    };
+
+    // persistent (and optionally pinned) worker threads of `ggml_graph_compute`, created on first use.
+    // thread i is pinned to cpus[i % cpus.size()], the thread running the model being thread 0.
+    // with NUMA `nodes`, threads are split into consecutive groups, one per node, instead: as matrix rows
+    // are split among threads in the same order, each group reads the rows placed on its node
+    // (see `ModelLoader::place_tensors`).
+    class ComputePool
+    {
+    public:
+        struct NumaNode
+        {
+            int id;
+            std::vector<int> cpus;  // CPUs this process may run on, first logical CPU of each core first
+        };
+
+        ComputePool(const std::vector<int> &cpus, const std::vector<NumaNode> &nodes, int spin_us);
+        ~ComputePool();
+
+        // a pool of at least `n_threads` threads, re-created when larger or in a forked process
+        ggml_threadpool *get(int n_threads);
+
+        // keep to the `index`-th of `count` disjoint slices of the CPUs (of each node), so that `count`
+        // processes forked from this one don't run on the same CPUs
+        void partition(int index, int count);
+
+        // first logical CPU of each physical core this process may run on, empty if unknown
+        static std::vector<int> physical_cores(void);
+
+        // `none`, `cores` (one thread per physical core), or a list of CPUs like `0-7,16`
+        static std::vector<int> parse_affinity(const std::string &spec);
+
+        // nodes having CPUs this process may run on, empty if unknown
+        static std::vector<NumaNode> numa_nodes(void);
+
+    private:
+        std::vector<int> cpus;
+        std::vector<NumaNode> nodes;
+        const int spin_us;
+        ggml_threadpool *pool;
+        int n_threads;
+        long pid;
+    };
+
+    // picks the number of threads of prefill and decode graphs, which saturate at different core counts.
+    // the first graphs of a phase are run with candidate counts, from `max_threads` down, `SAMPLES` graphs each,
+    // until throughput keeps dropping; the fastest count is then used, and saved in `cache_path` for this host.
+    class ThreadTuner
+    {
+    public:
+        enum Phase
+        {
+            Prefill = 0,
+            Decode,
+            NUM
+        };
+
+        static constexpr int SAMPLES[NUM] = {1, 4};
+
+        // `placement`: how threads are placed on CPUs (e.g. affinity and NUMA mode), counts tuned under
+        // another placement are not reused
+        ThreadTuner(const std::string &cache_path, const std::string &placement);
+
+        int pick(Phase phase, int max_threads);
+        void record(Phase phase, int n_threads, int tokens, double ms);
+
+        // don't measure, but use counts tuned by another process (e.g. another server worker) once they are
+        // in the cache, and `max_threads` until then
+        void follow(void);
+
+        // 0 until tuned
+        int get_best(Phase phase) const { return states[phase].best; }
+
+    private:
+        struct State
+        {
+            int max_threads = 0;
+            std::vector<int> candidates;
+            std::vector<double> rates;      // tokens per ms of each finished candidate
+            int samples = -1;               // of the current candidate, the first graph of a phase is not counted
+            double tokens = 0;
+            double ms = 0;
+            int best = 0;
+        };
+
+        void restart(Phase phase, int max_threads);
+        bool load(Phase phase);
+        void save(void) const;
+
+        const std::string cache_path;
+        const std::string host;
+        State states[NUM];
+        bool following;
+        std::chrono::steady_clock::time_point last_load;
+    };
+
+    // tensor parallelism across processes, on a host or several hosts: each rank holds a slice of the heads
+    // of `BaseAttention` and of the intermediate features of `BaseMLP` (and experts), i.e. q/k/v, gate & up
+    // projections are split by output features and o & down projections by input features, whose partial
+    // outputs are summed across ranks. all ranks are run with the same arguments and get identical results.
+    class TensorParallel
+    {
+    public:
+        // sums buffers element-wise across ranks
+        class Transport
+        {
+        public:
+            virtual ~Transport() {}
+            virtual void all_reduce(float *data, int64_t n) = 0;
+        };
+
+        // `transport`: shm:NAME (processes of a host) or tcp:HOST:PORT (rank 0 listens)
+        TensorParallel(int rank, int size, const std::string &transport);
+
+        // `t` summed across ranks, in place
+        ggml_tensor *all_reduce(ForwardContext *ctx, ggml_tensor *t);
+
+        // `value(s)` of rank 0
+        int broadcast(int value);
+        std::vector<int> broadcast(const std::vector<int> &values);
+
+        static bool is_supported(int model_type);
+
+        // shm transport shared by the ranks of the model at `model_path` only, so that groups of other models
+        // on this host don't collide
+        static std::string default_transport(const std::string &model_path, int size);
+
+    public:
+        const int rank;
+        const int size;
+
+    private:
+        static void all_reduce_op(ggml_tensor *dst, const ggml_tensor *a, int ith, int nth, void *userdata);
+        void broadcast_values(int *values, int64_t n);
+
+        std::unique_ptr<Transport> transport;
+    };
+
+    // weights rearranged for the CPU GEMV kernel, see `ModelLoader::repack_tensors`.
+    // the tensor keeps its original data, this is attached to `ggml_tensor::extra`.
+    struct RepackedTensor
+    {
+        // every group of rows is stored block by block: scales of all rows first, then their quants
+        static constexpr int ROWS_PER_GROUP = 4;
+
+        // set in `ggml_tensor::flags` of weights read by `Linear::forward` only, the ones worth repacking
+        static constexpr int32_t LINEAR_WEIGHT = 1 << 16;
+
+        static bool is_supported(ggml_type type, int ndim, const int64_t *ne);
+
+        ggml_type type;
+        int64_t rows;
+        int64_t row_size;
+        const void *data;
     };
 
     class ModelLoader
@@ -294,18 +607,99 @@ namespace chatllm
         void read_tensor(const std::string &name, ggml_tensor *tensor);
         void load_all_tensors(void);
 
+        // index tensors of another file: a chatllm file (container v2), safetensors or GGUF.
+        // tensors of a shard take precedence over those indexed before.
+        void add_shard(const std::string &path);
+
+        // container v2: tensor directory following the file header
+        void load_tensor_directory(void);
+
+        static uint32_t checksum(const void *data, size_t size, uint32_t crc = 0);
+
+        // types that `quantize` can store a weight as
+        static const std::vector<ggml_type> &weight_types(void);
+
+        // set in `ggml_tensor::flags` of weights read by matrix multiplications or row lookups only (`Linear`,
+        // experts, `Embedding`). these adopt the type stored in the file if it is one of `weight_types`.
+        static constexpr int32_t ANY_WEIGHT_TYPE = 1 << 17;
+
+        // page residency of tensor data
+        void advise_tensors(MappedFile::Advice advice);
+        void prefault_tensors(int num_threads);
+
+        // move pages of loaded tensors to NUMA nodes: rows of each matrix are split into `nodes.size()`
+        // consecutive blocks placed on nodes in order, or, with `interleave`, pages are spread round-robin.
+        // returns the number of bytes placed.
+        size_t place_tensors(const std::vector<int> &nodes, bool interleave);
+
+        MappedFile *get_mapped_file(void) const { return mapped_file.get(); }
+        std::vector<MappedFile *> get_mapped_files(void) const;
+
+        // repack supported `RepackedTensor::LINEAR_WEIGHT`s read so far with `num_threads` threads into an
+        // aligned arena. the result is cached in `cache_path` (if not empty) and reused on next load.
+        void repack_tensors(int num_threads, const std::string &cache_path);
+
+        struct TensorInfo
+        {
+            ggml_type type;
+            int ndim;
+            int64_t ne[4];
+            int64_t offset;         // offset of data in file
+            uint32_t checksum;      // crc32 of data, v2 only
+            int shard = 0;          // 0: the model file, i: `add_shard` #i
+            bool bf16 = false;      // data is bfloat16 (safetensors), converted to the dtype of the model when loading
+        };
+
+        const char *tensor_data(const TensorInfo &info) const;
+        MappedFile *tensor_file(const TensorInfo &info) const;
+
+        static constexpr int CONTAINER_V2_ALIGN = 64;
+
     private:
+        void read_tensor_info(TensorInfo &info);
+        void index_safetensors(MappedFile *file, int shard);
+        void index_gguf(MappedFile *file, int shard);
+        void convert_tensor(const std::string &name, const TensorInfo &info, ggml_tensor *tensor);
+
+        // this rank's slice of a stored tensor larger than `tensor`, see `TensorParallel`
+        bool slice_tensor(TensorInfo &info, const ggml_tensor *tensor, int64_t &pieces, size_t &piece_size) const;
+        void copy_pieces(const TensorInfo &info, int64_t pieces, size_t piece_size, size_t stride, ggml_tensor *tensor);
+        uint32_t repack_digest(const std::vector<std::string> &names) const;
+        bool load_repack_cache(const std::string &path, uint32_t digest);
+        void save_repack_cache(const std::string &path, uint32_t digest) const;
         ModelLoader(MappedFile *mapped_file)
             : mapped_file(std::unique_ptr<MappedFile>(mapped_file)),
               data(mapped_file->data), size(mapped_file->size), ptr(mapped_file->data),
               offset_config(0),
               offset_tokenizer(0),
               offset_tensors(0),
-              model_type(-1), version(-1)
+              model_type(-1), version(-1), container(1)
         {
         }
 
         std::unique_ptr<MappedFile> mapped_file;
+        std::vector<std::unique_ptr<MappedFile>> shards;
+        std::vector<std::unique_ptr<char[]>> converted;    // tensors whose dtype differs from the model
+        std::unique_ptr<MappedFile> repack_file;
+        std::unique_ptr<char[]> repack_arena;
+        std::unordered_map<std::string, RepackedTensor> repacked;
+
+        // mapped as they are in files, to be repacked
+        struct RepackTarget
+        {
+            ggml_tensor *tensor;
+            TensorInfo info;
+        };
+        std::unordered_map<std::string, RepackTarget> repack_targets;
+
+        struct LoadedTensor
+        {
+            const char *data;   // data read by kernels: mapped, converted or repacked
+            int64_t rows;       // rows of each matrix
+            int64_t matrices;
+            size_t row_size;
+        };
+        std::unordered_map<std::string, LoadedTensor> loaded;
 
     public:
         const char *const data;
@@ -316,7 +710,51 @@ namespace chatllm
         size_t offset_tensors;
         int model_type;
         int version;
-        std::map<std::string, int64_t> tensor_dict;
+        int container;
+        int tp_rank = 0;            // tensors sliced for this rank of `TensorParallel`
+        int tp_size = 1;
+        std::unordered_map<std::string, TensorInfo> tensor_dict;
+    };
+
+    // runs models larger than RAM with bounded resident memory: while layer i is being computed,
+    // weights of the following layers are prefetched, and those of layer i - 1 are released.
+    class WeightStreamer
+    {
+    public:
+        WeightStreamer(const std::vector<MappedFile *> &files, int prefetch_layers);
+
+        // called by models before layer `index` is built (and with the number of layers after the last one),
+        // returns `hidden_states` passed through a hook issuing the hints when computed
+        ggml_tensor *layer_boundary(ForwardContext *ctx, int index, ggml_tensor *hidden_states);
+
+        // weights of the layer being built that are read by custom ops but are not sources in the graph
+        void add_weights(std::initializer_list<const std::vector<ggml_tensor *> *> weights);
+
+    private:
+        struct Range
+        {
+            MappedFile *file;
+            size_t offset;
+            size_t size;
+        };
+
+        struct Hook
+        {
+            WeightStreamer *streamer;
+            int index;
+        };
+
+        void collect_layer(ForwardContext *ctx, ggml_tensor *output);
+        void advise_layer(int index, MappedFile::Advice advice);
+        static void on_boundary(ggml_tensor *dst, const ggml_tensor *a, int ith, int nth, void *userdata);
+
+        const std::vector<MappedFile *> files;
+        const int prefetch_layers;
+        std::vector<std::vector<Range>> layers;    // file ranges of weights of each layer
+        std::vector<ggml_tensor *> extra_weights;
+        std::deque<Hook> hooks;
+        ggml_tensor *last_boundary;
+        int last_n_nodes;
     };
 
     // ===== generation =====
@@ -330,6 +768,8 @@ namespace chatllm
         float top_p;
         float temperature;
         int num_threads;
+        int num_threads_prefill = 0;    // 0: `num_threads`, -1: picked by `ThreadTuner`
+        int num_threads_decode = 0;
         float presence_penalty;
         float tfs_z;
         std::string sampling;
@@ -377,6 +817,53 @@ namespace chatllm
         std::chrono::time_point<Clock> m_beg { Clock::now() };
     };
 
+    // wall time, page faults and RSS growth of startup phases, reported as JSON by `--startup_report`.
+    // phases nest: a phase begun within another one is named "outer/inner".
+    class StartupProfiler
+    {
+    public:
+        class Scope
+        {
+        public:
+            Scope(StartupProfiler *profiler, const char *name);
+            ~Scope();
+
+        private:
+            StartupProfiler *profiler;
+        };
+
+        StartupProfiler();
+
+        void begin(const std::string &name);
+        void end(void);
+        void set_value(const std::string &name, double value);
+
+        std::string to_json(void) const;
+
+    private:
+        struct Sample
+        {
+            double  ms;
+            int64_t minor_faults;
+            int64_t major_faults;
+            int64_t rss;
+        };
+
+        struct Phase
+        {
+            std::string name;
+            Sample start;
+            Sample delta;
+        };
+
+        Sample sample(void) const;
+
+        const std::chrono::time_point<std::chrono::steady_clock> t0;
+        std::vector<Phase> phases;
+        std::vector<size_t> stack;
+        std::vector<std::pair<std::string, double>> values;
+    };
+
     class AbstractModel
     {
     public:
@@ -427,6 +914,18 @@ namespace chatllm
         virtual int64_t get_param_num(bool effective_only) const = 0;
 
         virtual ChunkInterceptor *get_interceptor(void) { return nullptr; }
+
+        virtual void set_imatrix_collector(ImatrixCollector *collector) {}
+
+        virtual void set_weight_streamer(WeightStreamer *streamer) {}
+
+        virtual void set_expert_stats(ExpertStats *stats) {}
+
+        virtual void set_compute_pool(ComputePool *pool) {}
+
+        virtual void set_thread_tuner(ThreadTuner *tuner) {}
+
+        virtual void set_tensor_parallel(TensorParallel *tp) {}
     };
 
     class ModelProxy : public AbstractModel
@@ -490,6 +989,18 @@ namespace chatllm
 
         ChunkInterceptor *get_interceptor(void) override { return model->get_interceptor(); }
 
+        void set_imatrix_collector(ImatrixCollector *collector) override { model->set_imatrix_collector(collector); }
+
+        void set_weight_streamer(WeightStreamer *streamer) override { model->set_weight_streamer(streamer); }
+
+        void set_expert_stats(ExpertStats *stats) override { model->set_expert_stats(stats); }
+
+        void set_compute_pool(ComputePool *pool) override { model->set_compute_pool(pool); }
+
+        void set_thread_tuner(ThreadTuner *tuner) override { model->set_thread_tuner(tuner); }
+
+        void set_tensor_parallel(TensorParallel *tp) override { model->set_tensor_parallel(tp); }
+
     protected:
         AbstractModel *model;
         void set_proxy_model(AbstractModel *model) { this->model = model; }
@@ -609,6 +1120,24 @@ namespace chatllm
         {
             int   max_length;
             std::string layer_spec;
+            int   prefault_threads = 0;     // prefault tensor data with N threads after loading, 0 to disable
+            MappedFile::Advice mmap_advice = MappedFile::Advice::Normal;
+            bool  hugepage = false;
+            bool  mlock = false;
+            int   repack_threads = 0;       // repack weights for the CPU GEMV kernel with N threads, 0 to disable
+            std::string repack_cache;       // file caching repacked weights, empty to disable
+            std::vector<std::string> shards;    // files providing (or overriding) tensors, see `ModelLoader::add_shard`
+            int   stream_layers = 0;        // stream weights layer by layer, prefetching N layers ahead, 0 to disable
+            bool  expert_stats = false;     // count selections of MoE experts
+            float pin_hot_experts = 0.0f;   // lock hot experts receiving this ratio of selections, see `ExpertStats`
+            std::string thread_affinity = "none";   // see `ComputePool::parse_affinity`
+            int   thread_spin_us = 100;     // idle compute threads busy-wait this long before sleeping
+            std::string numa = "none";      // none, distribute (rows of weights and threads split among nodes) or interleave
+            std::string thread_tune_cache;  // file keeping thread counts picked by `ThreadTuner`, empty to disable saving
+            int   tp_rank = 0;              // rank of this process in `TensorParallel`
+            int   tp_size = 1;              // number of ranks, 1 to disable
+            std::string tp_transport;       // empty: shm named after the model file, see `TensorParallel::default_transport`
+            StartupProfiler *profiler = nullptr;
             extra_args(int max_length, const std::string &layer_spec) : max_length(max_length), layer_spec(layer_spec) {}
             extra_args() : extra_args(-1, "") {}
         };
@@ -624,7 +1153,28 @@ namespace chatllm
         std::unique_ptr<BaseTokenizer> tokenizer;
         std::unique_ptr<AbstractModel> model;
         std::unique_ptr<ModelLoader> loader;
+        std::unique_ptr<WeightStreamer> weight_streamer;
+        std::unique_ptr<ExpertStats> expert_stats;
+        std::unique_ptr<ComputePool> compute_pool;
+        std::unique_ptr<ThreadTuner> thread_tuner;
+        std::unique_ptr<TensorParallel> tensor_parallel;
         const bool loaded;
+        double load_ms;
+        float resident_before_load;
+    };
+
+    // only config & tokenizer are loaded, for token counting, etc.
+    class TokenizerObject
+    {
+    public:
+        TokenizerObject(const std::string &path);
+        TokenizerObject(const std::string &path, const ModelObject::extra_args &args);
+
+        int count_tokens(const std::string &text) const;
+
+    public:
+        std::unique_ptr<ModelLoader> loader;
+        std::unique_ptr<BaseTokenizer> tokenizer;
     };
 
     class ModelFactory
@@ -640,6 +1190,9 @@ namespace chatllm
 
         static AbstractModel *load_model_again(ModelLoader &loader, const ModelObject::extra_args &args);
 
+        // load config & tokenizer only, tensors are not indexed
+        static BaseTokenizer *load_tokenizer(ModelLoader &loader, const ModelObject::extra_args &args);
+
         static std::string load_info(ModelLoader &loader);
 
     private:
@@ -676,6 +1229,7 @@ namespace chatllm
         virtual std::string get_additional_description(void) const;
 
         bool is_loaded(void) const { return modelobj.loaded; }
+        const ModelObject &get_model_object(void) const { return modelobj; }
 
         virtual void restart(void);
         virtual void rewind(int n_past);
@@ -284,6 +284,7 @@ class LoRAState:
         return tensor
 
 g_lora: LoRAState = None
+g_skip_weights: bool = False
 
 def load_all_model_files(model_files) -> Dict:
     global g_lora
@@ -297,6 +298,10 @@ def load_all_model_files(model_files) -> Dict:
         yield r
 
 def dump_state_dict(f, weight_names, model_files, ggml_type, config, state_dict_pp, loader_fun = None):
+    # weights are to be loaded from the original checkpoint as shards (`--shard`)
+    if g_skip_weights:
+        return
+
     tensor_info = []
     converted_names = []
 
@@ -3266,6 +3271,7 @@ def load_some_model(path: Path) -> List[Path]:
 
 def main():
     global g_lora
+    global g_skip_weights
 
     parser = argparse.ArgumentParser("chatllm-convert")
     parser.add_argument("-i", "--model_name_or_path", type=str)
@@ -3275,6 +3281,7 @@ def main():
     parser.add_argument("-t", "--type", type=str, default="q8_0", choices=["f32", "f16", "q8_0", "q4_0", "q4_1"])
     parser.add_argument("--vocab_dir", type=str, default='')
     parser.add_argument("--experts", type=str, default='')
+    parser.add_argument("--skip_weights", action='store_true', help="save config & tokenizer only, weights are loaded with `--shard`")
     args = parser.parse_args()
 
     arch = args.arch.lower()
@@ -3282,6 +3289,8 @@ def main():
     if args.lora_model_name_or_path is not None:
         g_lora = LoRAState(Path(args.lora_model_name_or_path), False)
 
+    g_skip_weights = args.skip_weights
+
     ggml_type = GGMLType[args.type.upper()]
 
     skip_def_vocab_model = False
@@ -79,239 +79,118 @@ static void ggml_compute_forward_mat_scale(struct ggml_tensor * dst , const stru
     }
 }
 
-static void ggml_compute_forward_ntk_dynamic_rope_f32(struct ggml_tensor * dst , const struct ggml_tensor * a, const struct ggml_tensor * b, int ith, int nth, void * userdata)
+// y = x * c + partner(x) * s, see `RoPETable`
+static void table_rope_row_scalar(const float *x, float *y, const float *c, const float *s, int n_dims, bool neox)
 {
-    QWenSelfAttention *data = reinterpret_cast<QWenSelfAttention *>(userdata);
-
-    const struct ggml_tensor *src0 = a;
-    const struct ggml_tensor *src1 = b;
-
-    GGML_TENSOR_UNARY_OP_LOCALS
-
-    int n_dims = data->rope_dim;
-
-    const int nr = (int)ggml_nrows(dst);
-
-    GGML_ASSERT(n_dims <= ne0);
-    GGML_ASSERT(n_dims % 2 == 0);
-
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
-
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
-
-    // row index used to determine which thread to use
-    int ir = 0;
-
-    const int32_t * pos = (const int32_t *) src1->data;
-
-    for (int64_t i3 = 0; i3 < ne3; i3++) {
-        for (int64_t i2 = 0; i2 < ne2; i2++) {
-            const auto p = pos[i2];
-            for (int64_t i1 = 0; i1 < ne1; i1++) {
-                if (ir++ < ir0) continue;
-                if (ir   > ir1) break;
-
-                const float ntk_alpha = qwen_get_ntk_alpha(p, data->seq_length);
-                const float base = data->freq_base * powf(ntk_alpha, (float)n_dims / ((float)n_dims - 2.0f));
-                const float inv_freq_scale = powf(base, -2.0f / (float)n_dims);
-                float inv_freq = 1.0f;
-
-                for (int64_t ic = 0; ic < ne0; ic += 2, inv_freq *= inv_freq_scale) {
-                    if (ic < n_dims) {
-                        const int64_t ib = 0;
-
-                        float theta = (float)p * inv_freq;
-                        float cos_theta = cosf(theta);
-                        float sin_theta = sinf(theta);
-
-                        const int64_t i0 = ib*n_dims + ic/2;
-
-                        const float * const src = (float *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
-                              float * dst_data  = (float *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
-
-                        const float x0 = src[0];
-                        const float x1 = src[n_dims/2];
-
-                        dst_data[0]        = x0*cos_theta - x1*sin_theta;
-                        dst_data[n_dims/2] = x0*sin_theta + x1*cos_theta;
-                    } else {
-                        const int64_t i0 = ic;
-
-                        const float * const src = (float *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
-                              float * dst_data  = (float *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
-
-                        dst_data[0] = src[0];
-                        dst_data[1] = src[1];
-                    }
-                }
-            }
+    if (neox) {
+        const int h = n_dims / 2;
+        for (int i = 0; i < h; i++) {
+            const float x0 = x[i];
+            const float x1 = x[i + h];
+            y[i]     = x0 * c[i]     + x1 * s[i];
+            y[i + h] = x1 * c[i + h] + x0 * s[i + h];
+        }
+    } else {
+        for (int i = 0; i < n_dims; i += 2) {
+            const float x0 = x[i];
+            const float x1 = x[i + 1];
+            y[i]     = x0 * c[i]     + x1 * s[i];
+            y[i + 1] = x1 * c[i + 1] + x0 * s[i + 1];
         }
     }
 }
 
-static void ggml_compute_forward_ntk_dynamic_rope_f16(struct ggml_tensor * dst , const struct ggml_tensor * a, const struct ggml_tensor * b, int ith, int nth, void * userdata)
-{
-    QWenSelfAttention *data = reinterpret_cast<QWenSelfAttention *>(userdata);
-
-    const struct ggml_tensor *src0 = a;
-    const struct ggml_tensor *src1 = b;
-
-    GGML_TENSOR_UNARY_OP_LOCALS
-
-    int n_dims = data->rope_dim;
-
-    const int nr = (int)ggml_nrows(dst);
-
-    GGML_ASSERT(n_dims <= ne0);
-    GGML_ASSERT(n_dims % 2 == 0);
-
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
-
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
-
-    // row index used to determine which thread to use
-    int ir = 0;
-
-    const int32_t * pos = (const int32_t *) src1->data;
-
-    for (int64_t i3 = 0; i3 < ne3; i3++) {
-        for (int64_t i2 = 0; i2 < ne2; i2++) {
-            const auto p = pos[i2];
-            for (int64_t i1 = 0; i1 < ne1; i1++) {
-                if (ir++ < ir0) continue;
-                if (ir   > ir1) break;
-
-                const float ntk_alpha = qwen_get_ntk_alpha(p, data->seq_length);
-                const float base = data->freq_base * powf(ntk_alpha, (float)n_dims / ((float)n_dims - 2.0f));
-                const float inv_freq_scale = powf(base, -2.0f / (float)n_dims);
-                float inv_freq = 1.0f;
-
-                for (int64_t ic = 0; ic < ne0; ic += 2, inv_freq *= inv_freq_scale) {
-                    if (ic < n_dims) {
-                        const int64_t ib = 0;
-
-                        float theta = (float)p * inv_freq;
-                        float cos_theta = cosf(theta);
-                        float sin_theta = sinf(theta);
-
-                        const int64_t i0 = ib*n_dims + ic/2;
-
-                        const ggml_fp16_t * const src = (ggml_fp16_t *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
-                        ggml_fp16_t * dst_data  = (ggml_fp16_t *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
-
-                        const float x0 = ggml_fp16_to_fp32(src[0]);
-                        const float x1 = ggml_fp16_to_fp32(src[1]);
-
-                        dst_data[0] = ggml_fp32_to_fp16(x0*cos_theta - x1*sin_theta);
-                        dst_data[1] = ggml_fp32_to_fp16(x0*sin_theta + x1*cos_theta);
-                    } else {
-                        const int64_t i0 = ic;
-
-                        const ggml_fp16_t * const src = (ggml_fp16_t *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
-                              ggml_fp16_t * dst_data  = (ggml_fp16_t *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CHATLLM_ROPE_AVX2
 
-                        dst_data[0] = src[0];
-                        dst_data[1] = src[1];
-                    }
-                }
-            }
+__attribute__((target("avx2,fma")))
+static void table_rope_row_avx2(const float *x, float *y, const float *c, const float *s, int n_dims, bool neox)
+{
+    if (neox) {
+        const int h = n_dims / 2;
+        int i = 0;
+        for (; i + 8 <= h; i += 8) {
+            const __m256 x0 = _mm256_loadu_ps(x + i);
+            const __m256 x1 = _mm256_loadu_ps(x + i + h);
+            _mm256_storeu_ps(y + i,     _mm256_fmadd_ps(x0, _mm256_loadu_ps(c + i),     _mm256_mul_ps(x1, _mm256_loadu_ps(s + i))));
+            _mm256_storeu_ps(y + i + h, _mm256_fmadd_ps(x1, _mm256_loadu_ps(c + i + h), _mm256_mul_ps(x0, _mm256_loadu_ps(s + i + h))));
+        }
+        for (; i < h; i++) {
+            const float x0 = x[i];
+            const float x1 = x[i + h];
+            y[i]     = x0 * c[i]     + x1 * s[i];
+            y[i + h] = x1 * c[i + h] + x0 * s[i + h];
         }
+    } else {
+        int i = 0;
+        for (; i + 8 <= n_dims; i += 8) {
+            const __m256 v = _mm256_loadu_ps(x + i);
+            const __m256 swapped = _mm256_permute_ps(v, 0xB1);
+            _mm256_storeu_ps(y + i, _mm256_fmadd_ps(v, _mm256_loadu_ps(c + i), _mm256_mul_ps(swapped, _mm256_loadu_ps(s + i))));
+        }
+        table_rope_row_scalar(x + i, y + i, c + i, s + i, n_dims - i, false);
     }
 }
+#endif
 
-static void ggml_compute_forward_ntk_dynamic_rope(struct ggml_tensor * dst , const struct ggml_tensor * a, const struct ggml_tensor * b, int ith, int nth, void * userdata)
-{
-    switch (a->type)
-    {
-    case GGML_TYPE_F16:
-        ggml_compute_forward_ntk_dynamic_rope_f16(dst, a, b, ith, nth, userdata);
-        break;
-    case GGML_TYPE_F32:
-        ggml_compute_forward_ntk_dynamic_rope_f32(dst, a, b, ith, nth, userdata);
-        break;
-    default:
-        GGML_ASSERT(false);
-        break;
-    }
-}
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define CHATLLM_ROPE_NEON
 
-static void ggml_compute_forward_ntk_mix_rope_f32(struct ggml_tensor * dst , const struct ggml_tensor * a, const struct ggml_tensor * b, int ith, int nth, void * userdata)
+static void table_rope_row_neon(const float *x, float *y, const float *c, const float *s, int n_dims, bool neox)
 {
-    BlueLMSelfAttention *data = reinterpret_cast<BlueLMSelfAttention *>(userdata);
-
-    const struct ggml_tensor *src0 = a;
-    const struct ggml_tensor *src1 = b;
-
-    GGML_TENSOR_UNARY_OP_LOCALS
-
-    int n_dims = data->rope_dim;
-
-    const int nr = (int)ggml_nrows(dst);
-
-    GGML_ASSERT(n_dims <= ne0);
-    GGML_ASSERT(n_dims % 2 == 0);
-
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
-
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
-
-    // row index used to determine which thread to use
-    int ir = 0;
-
-    const int32_t * pos = (const int32_t *) src1->data;
-
-    for (int64_t i3 = 0; i3 < ne3; i3++) {
-        for (int64_t i2 = 0; i2 < ne2; i2++) {
-            const float p = (float)pos[i2];
-            for (int64_t i1 = 0; i1 < ne1; i1++) {
-                if (ir++ < ir0) continue;
-                if (ir   > ir1) break;
-
-                for (int64_t i0 = 0; i0 < ne0; i0 += 2) {
-
-                    float theta = p * data->inv_freq[i0 / 2];
-
-                    float cos_theta = cosf(theta);
-                    float sin_theta = sinf(theta);
-
-                    const float * const src = (float *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
-                        float * dst_data  = (float *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
-
-                    const float x0 = src[0];
-                    const float x1 = src[1];
-
-                    dst_data[0] = x0*cos_theta - x1*sin_theta;
-                    dst_data[1] = x0*sin_theta + x1*cos_theta;
-                }
-            }
+    if (neox) {
+        const int h = n_dims / 2;
+        int i = 0;
+        for (; i + 4 <= h; i += 4) {
+            const float32x4_t x0 = vld1q_f32(x + i);
+            const float32x4_t x1 = vld1q_f32(x + i + h);
+            vst1q_f32(y + i,     vfmaq_f32(vmulq_f32(x1, vld1q_f32(s + i)),     x0, vld1q_f32(c + i)));
+            vst1q_f32(y + i + h, vfmaq_f32(vmulq_f32(x0, vld1q_f32(s + i + h)), x1, vld1q_f32(c + i + h)));
+        }
+        for (; i < h; i++) {
+            const float x0 = x[i];
+            const float x1 = x[i + h];
+            y[i]     = x0 * c[i]     + x1 * s[i];
+            y[i + h] = x1 * c[i + h] + x0 * s[i + h];
+        }
+    } else {
+        int i = 0;
+        for (; i + 4 <= n_dims; i += 4) {
+            const float32x4_t v = vld1q_f32(x + i);
+            vst1q_f32(y + i, vfmaq_f32(vmulq_f32(vrev64q_f32(v), vld1q_f32(s + i)), v, vld1q_f32(c + i)));
         }
+        table_rope_row_scalar(x + i, y + i, c + i, s + i, n_dims - i, false);
     }
 }
+#endif
 
-static void ggml_compute_forward_ntk_mix_rope_f16(struct ggml_tensor * dst , const struct ggml_tensor * a, const struct ggml_tensor * b, int ith, int nth, void * userdata)
+// rotates rows of `a` at positions `b` with a `RoPETable` (userdata), dims beyond `n_dims` are copied
+static void ggml_compute_forward_table_rope(struct ggml_tensor * dst , const struct ggml_tensor * a, const struct ggml_tensor * b, int ith, int nth, void * userdata)
 {
-    BlueLMSelfAttention *data = reinterpret_cast<BlueLMSelfAttention *>(userdata);
+    const RoPETable *table = reinterpret_cast<const RoPETable *>(userdata);
 
     const struct ggml_tensor *src0 = a;
     const struct ggml_tensor *src1 = b;
 
     GGML_TENSOR_UNARY_OP_LOCALS
 
-    int n_dims = data->rope_dim;
+    const int n_dims = table->n_dims;
 
     const int nr = (int)ggml_nrows(dst);
 
     GGML_ASSERT(n_dims <= ne0);
     GGML_ASSERT(n_dims % 2 == 0);
+    GGML_ASSERT((src0->type == GGML_TYPE_F32) || (src0->type == GGML_TYPE_F16));
+    GGML_ASSERT((nb00 == ggml_type_size(src0->type)) && (nb0 == ggml_type_size(dst->type)));
+
+#if defined(CHATLLM_ROPE_AVX2)
+    static const bool has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    auto rotate = has_avx2 ? table_rope_row_avx2 : table_rope_row_scalar;
+#elif defined(CHATLLM_ROPE_NEON)
+    auto rotate = table_rope_row_neon;
+#else
+    auto rotate = table_rope_row_scalar;
+#endif
 
     // rows per thread
     const int dr = (nr + nth - 1)/nth;
@@ -325,50 +204,38 @@ static void ggml_compute_forward_ntk_mix_rope_f16(struct ggml_tensor * dst , con
 
     const int32_t * pos = (const int32_t *) src1->data;
 
+    thread_local std::vector<float> xs;
+    thread_local std::vector<float> ys;
+    if (src0->type == GGML_TYPE_F16) {
+        xs.resize(ne0);
+        ys.resize(ne0);
+    }
+
     for (int64_t i3 = 0; i3 < ne3; i3++) {
         for (int64_t i2 = 0; i2 < ne2; i2++) {
-            const float p = (float)pos[i2];
+            const float *c = table->cos_row(pos[i2]);
+            const float *s = table->sin_row(pos[i2]);
             for (int64_t i1 = 0; i1 < ne1; i1++) {
                 if (ir++ < ir0) continue;
                 if (ir   > ir1) break;
 
-                for (int64_t i0 = 0; i0 < ne0; i0 += 2) {
-
-                    float theta = p * data->inv_freq[i0 / 2];
-
-                    float cos_theta = cosf(theta);
-                    float sin_theta = sinf(theta);
-
-                    const ggml_fp16_t * const src = (ggml_fp16_t *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
-                        ggml_fp16_t * dst_data  = (ggml_fp16_t *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
-
-                    const float x0 = ggml_fp16_to_fp32(src[0]);
-                    const float x1 = ggml_fp16_to_fp32(src[1]);
-
-                    dst_data[0] = ggml_fp32_to_fp16(x0*cos_theta - x1*sin_theta);
-                    dst_data[1] = ggml_fp32_to_fp16(x0*sin_theta + x1*cos_theta);
+                const char *src = (const char *)src0->data + i3*nb03 + i2*nb02 + i1*nb01;
+                      char *dst_data = (char *)dst->data + i3*nb3 + i2*nb2 + i1*nb1;
+
+                if (src0->type == GGML_TYPE_F32) {
+                    rotate((const float *)src, (float *)dst_data, c, s, n_dims, table->neox);
+                    memcpy((float *)dst_data + n_dims, (const float *)src + n_dims, (ne0 - n_dims) * sizeof(float));
+                } else {
+                    ggml_fp16_to_fp32_row((const ggml_fp16_t *)src, xs.data(), (int)ne0);
+                    rotate(xs.data(), ys.data(), c, s, n_dims, table->neox);
+                    memcpy(ys.data() + n_dims, xs.data() + n_dims, (ne0 - n_dims) * sizeof(float));
+                    ggml_fp32_to_fp16_row(ys.data(), (ggml_fp16_t *)dst_data, (int)ne0);
                 }
             }
         }
     }
 }
 
-static void ggml_compute_forward_ntk_mix_rope(struct ggml_tensor * dst , const struct ggml_tensor * a, const struct ggml_tensor * b, int ith, int nth, void * userdata)
-{
-    switch (a->type)
-    {
-    case GGML_TYPE_F16:
-        ggml_compute_forward_ntk_mix_rope_f16(dst, a, b, ith, nth, userdata);
-        break;
-    case GGML_TYPE_F32:
-        ggml_compute_forward_ntk_mix_rope_f32(dst, a, b, ith, nth, userdata);
-        break;
-    default:
-        GGML_ASSERT(false);
-        break;
-    }
-}
-
 static void build_ntk_mixed_inv_freq(int dim, std::vector<float> &inv_freq,
     int max_position_embeddings = 2048, float base = 10000.0, float k = 16, float b = 0.3)
 {
@@ -469,132 +336,498 @@ void ggml_compute_forward_sigmoid(struct ggml_tensor * dst , const struct ggml_t
     }
 }
 
-static void ggml_compute_forward_su_rope_f16(struct ggml_tensor * dst , const struct ggml_tensor * a, const struct ggml_tensor * b, int ith, int nth, void * userdata)
+// activations are quantized to blocks of 32 int8 with a float scale, one block is shared by a whole group of rows
+struct repacked_q8_block
 {
-    Phi3SUSelfAttention *data = reinterpret_cast<Phi3SUSelfAttention *>(userdata);
-
-    const struct ggml_tensor *src0 = a;
-    const struct ggml_tensor *src1 = b;
-
-    GGML_TENSOR_UNARY_OP_LOCALS
-
-    int n_dims = data->rope_dim;
+    float d;
+    int8_t qs[32];
+};
 
-    const int nr = (int)ggml_nrows(dst);
+static void repacked_quantize_row(const float *x, repacked_q8_block *y, int64_t k)
+{
+    for (int64_t i = 0; i < k / 32; i++, x += 32) {
+        float amax = 0.0f;
+        for (int j = 0; j < 32; j++)
+            amax = MAX(amax, fabsf(x[j]));
+
+        const float d  = amax / 127.0f;
+        const float id = d != 0.0f ? 1.0f / d : 0.0f;
+        y[i].d = d;
+        for (int j = 0; j < 32; j++)
+            y[i].qs[j] = (int8_t)roundf(x[j] * id);
+    }
+}
 
-    GGML_ASSERT(n_dims <= ne0);
-    GGML_ASSERT(n_dims % 2 == 0);
+static void repacked_dot_scalar(ggml_type type, const uint8_t *w, const repacked_q8_block *y, int64_t nb, float *s)
+{
+    const int G = RepackedTensor::ROWS_PER_GROUP;
+    const int quant_size = (int)ggml_type_size(type) - (int)sizeof(ggml_fp16_t);
+
+    for (int r = 0; r < G; r++) s[r] = 0.0f;
+
+    for (int64_t b = 0; b < nb; b++) {
+        const ggml_fp16_t *d = (const ggml_fp16_t *)w;
+        const uint8_t *qs = w + G * sizeof(ggml_fp16_t);
+        for (int r = 0; r < G; r++, qs += quant_size) {
+            int sum = 0;
+            if (type == GGML_TYPE_Q4_0) {
+                for (int j = 0; j < 16; j++)
+                    sum += ((qs[j] & 0x0F) - 8) * y[b].qs[j] + ((qs[j] >> 4) - 8) * y[b].qs[j + 16];
+            } else {
+                for (int j = 0; j < 32; j++)
+                    sum += (int8_t)qs[j] * y[b].qs[j];
+            }
+            s[r] += ggml_fp16_to_fp32(d[r]) * y[b].d * sum;
+        }
+        w += G * ggml_type_size(type);
+    }
+}
 
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CHATLLM_REPACKED_AVX2
 
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
+__attribute__((target("avx2,fma,f16c")))
+static inline float repacked_hsum(__m256 x) {
+    __m128 r = _mm_add_ps(_mm256_extractf128_ps(x, 1), _mm256_castps256_ps128(x));
+    r = _mm_add_ps(r, _mm_movehl_ps(r, r));
+    r = _mm_add_ss(r, _mm_movehdup_ps(r));
+    return _mm_cvtss_f32(r);
+}
 
-    // row index used to determine which thread to use
-    int ir = 0;
+__attribute__((target("avx2,fma,f16c")))
+static void repacked_dot_avx2(ggml_type type, const uint8_t *w, const repacked_q8_block *y, int64_t nb, float *s)
+{
+    const int G = RepackedTensor::ROWS_PER_GROUP;
+    static_assert(RepackedTensor::ROWS_PER_GROUP == 4, "scales are loaded as 4 x fp16");
+
+    const bool is_q4 = type == GGML_TYPE_Q4_0;
+    const int quant_size = is_q4 ? 16 : 32;
+    const __m256i m4   = _mm256_set1_epi8(0x0F);
+    const __m256i m8   = _mm256_set1_epi8(8);
+    const __m256i ones = _mm256_set1_epi16(1);
+
+    __m256 acc[G];
+    for (int r = 0; r < G; r++) acc[r] = _mm256_setzero_ps();
+
+    for (int64_t b = 0; b < nb; b++) {
+        const __m256i qy = _mm256_loadu_si256((const __m256i *)y[b].qs);
+        const __m128 d = _mm_mul_ps(_mm_cvtph_ps(_mm_loadl_epi64((const __m128i *)w)), _mm_set1_ps(y[b].d));
+        float dr[G];
+        _mm_storeu_ps(dr, d);
+
+        const uint8_t *qs = w + G * sizeof(ggml_fp16_t);
+        for (int r = 0; r < G; r++, qs += quant_size) {
+            __m256i qx;
+            if (is_q4) {
+                const __m128i t = _mm_loadu_si128((const __m128i *)qs);
+                qx = _mm256_and_si256(_mm256_set_m128i(_mm_srli_epi16(t, 4), t), m4);
+                qx = _mm256_sub_epi8(qx, m8);
+            } else {
+                qx = _mm256_loadu_si256((const __m256i *)qs);
+            }
 
-    const int32_t * pos = (const int32_t *) src1->data;
+            const __m256i ax = _mm256_sign_epi8(qx, qx);
+            const __m256i sy = _mm256_sign_epi8(qy, qx);
+            const __m256i dot = _mm256_madd_epi16(ones, _mm256_maddubs_epi16(ax, sy));
+            acc[r] = _mm256_fmadd_ps(_mm256_set1_ps(dr[r]), _mm256_cvtepi32_ps(dot), acc[r]);
+        }
+        w += G * (sizeof(ggml_fp16_t) + quant_size);
+    }
 
-    for (int64_t i3 = 0; i3 < ne3; i3++) {
-        for (int64_t i2 = 0; i2 < ne2; i2++) {
-            const float p = (float)pos[i2];
-            const float *inv_freq = data->get_inv_freq(pos[i2]);
-            for (int64_t i1 = 0; i1 < ne1; i1++) {
-                if (ir++ < ir0) continue;
-                if (ir   > ir1) break;
+    for (int r = 0; r < G; r++) s[r] = repacked_hsum(acc[r]);
+}
+#endif
 
-                for (int64_t i0 = 0; i0 < ne0; i0 += 2) {
+// dst = weight (repacked, passed as `userdata`) x b, `a` only gives the shape of dst
+static void ggml_compute_forward_repacked_mul_mat(struct ggml_tensor * dst , const struct ggml_tensor * a, const struct ggml_tensor * b, int ith, int nth, void * userdata)
+{
+    const RepackedTensor *w = (const RepackedTensor *)userdata;
+    const int G = RepackedTensor::ROWS_PER_GROUP;
 
-                    float theta = p * inv_freq[i0 / 2];
+    GGML_ASSERT(b->type == GGML_TYPE_F32);
+    GGML_ASSERT(dst->type == GGML_TYPE_F32);
 
-                    float cos_theta = cosf(theta) * data->scaling_factor;
-                    float sin_theta = sinf(theta) * data->scaling_factor;
+    const int64_t k = b->ne[0];
+    const int64_t nb = k / 32;
+    const int64_t nr = ggml_nrows(b);
+    const int64_t ng = w->rows / G;
+
+    // groups per thread
+    const int64_t dg = (ng + nth - 1) / nth;
+    const int64_t g0 = dg * ith;
+    const int64_t g1 = MIN(g0 + dg, ng);
+    if (g0 >= g1) return;
+
+    // each thread quantizes the activations itself, which is cheap compared to its share of the product
+    thread_local std::vector<repacked_q8_block> qy;
+    qy.resize(nb * nr);
+    for (int64_t i = 0; i < nr; i++)
+        repacked_quantize_row((const float *)((const char *)b->data + i * b->nb[1]), qy.data() + i * nb, k);
+
+#ifdef CHATLLM_REPACKED_AVX2
+    static const bool has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c");
+    auto dot = has_avx2 ? repacked_dot_avx2 : repacked_dot_scalar;
+#else
+    auto dot = repacked_dot_scalar;
+#endif
 
-                    const ggml_fp16_t * const src = (ggml_fp16_t *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
-                          ggml_fp16_t * dst_data  = (ggml_fp16_t *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
+    const size_t group_size = G * w->row_size;
+    for (int64_t g = g0; g < g1; g++) {
+        const uint8_t *group = (const uint8_t *)w->data + g * group_size;
+        for (int64_t i = 0; i < nr; i++)
+            dot(w->type, group, qy.data() + i * nb, nb, (float *)((char *)dst->data + i * dst->nb[1]) + g * G);
+    }
+}
 
-                    const float x0 = ggml_fp16_to_fp32(src[0]);
-                    const float x1 = ggml_fp16_to_fp32(src[1]);
+static inline float gated_act(ActFunc act, float x)
+{
+    switch (act) {
+        case ActFunc::GELU:
+            return 0.5f * x * (1.0f + tanhf(0.7978845608f * x * (1.0f + 0.044715f * x * x)));
+        case ActFunc::SILU:
+            return x / (1.0f + expf(-x));
+        case ActFunc::Tanh:
+            return tanhf(x);
+        case ActFunc::RELU:
+            return x > 0 ? x : 0.0f;
+        case ActFunc::RELU2:
+            return x > 0 ? x * x : 0.0f;
+        default:
+            GGML_ASSERT(false);
+            return 0.0f;
+    }
+}
 
-                    dst_data[0] = ggml_fp32_to_fp16(x0*cos_theta - x1*sin_theta);
-                    dst_data[1] = ggml_fp32_to_fp16(x0*sin_theta + x1*cos_theta);
-                }
+// dst = norm(b) * weight (+ bias), written as rows of `dst->type` (see `RMSNorm::forward_quantized`).
+// the arithmetic follows ggml_rms_norm/ggml_norm followed by ggml_mul/ggml_add.
+static void norm_quantize(struct ggml_tensor * dst, const struct ggml_tensor * b, int ith, int nth,
+                          bool rms, float eps, const ggml_tensor *weight, const ggml_tensor *bias)
+{
+    const int64_t k = b->ne[0];
+    const int64_t n = ggml_nrows(b);
+    const ggml_from_float_t from_float = ggml_internal_get_type_traits(dst->type).from_float;
+
+    GGML_ASSERT(b->type == GGML_TYPE_F32 && ggml_is_contiguous(b) && ggml_is_contiguous(dst));
+    GGML_ASSERT(weight->type == GGML_TYPE_F32 && (!bias || bias->type == GGML_TYPE_F32));
+    GGML_ASSERT(from_float);
+
+    const float *w  = (const float *)weight->data;
+    const float *bs = bias ? (const float *)bias->data : nullptr;
+
+    thread_local std::vector<float> y;
+    y.resize(k);
+    for (int64_t i = ith; i < n; i += nth) {
+        const float *x = (const float *)((const char *)b->data + i * b->nb[1]);
+
+        float scale;
+        if (rms) {
+            double sum = 0.0;
+            for (int64_t j = 0; j < k; j++)
+                sum += (double)(x[j] * x[j]);
+            const float mean = sum / k;
+            memcpy(y.data(), x, k * sizeof(float));
+            scale = 1.0f / sqrtf(mean + eps);
+        } else {
+            double sum = 0.0;
+            for (int64_t j = 0; j < k; j++)
+                sum += (double)x[j];
+            const float mean = sum / k;
+            double sum2 = 0.0;
+            for (int64_t j = 0; j < k; j++) {
+                const float v = x[j] - mean;
+                y[j] = v;
+                sum2 += (double)(v * v);
             }
+            const float variance = sum2 / k;
+            scale = 1.0f / sqrtf(variance + eps);
+        }
+
+        for (int64_t j = 0; j < k; j++)
+            y[j] = (y[j] * scale) * w[j];
+        if (bs) {
+            for (int64_t j = 0; j < k; j++)
+                y[j] = y[j] + bs[j];
         }
+
+        from_float(y.data(), (char *)dst->data + i * dst->nb[1], (int)k);
     }
 }
 
-static void ggml_compute_forward_su_rope_f32(struct ggml_tensor * dst , const struct ggml_tensor * a, const struct ggml_tensor * b, int ith, int nth, void * userdata)
+static void ggml_compute_forward_rms_norm_quantize(struct ggml_tensor * dst , const struct ggml_tensor * a, const struct ggml_tensor * b, int ith, int nth, void * userdata)
 {
-    Phi3SUSelfAttention *data = reinterpret_cast<Phi3SUSelfAttention *>(userdata);
-
-    const struct ggml_tensor *src0 = a;
-    const struct ggml_tensor *src1 = b;
+    const RMSNorm *norm = (const RMSNorm *)userdata;
+    norm_quantize(dst, b, ith, nth, true, norm->eps, norm->weight, nullptr);
+}
 
-    GGML_TENSOR_UNARY_OP_LOCALS
+static void ggml_compute_forward_layer_norm_quantize(struct ggml_tensor * dst , const struct ggml_tensor * a, const struct ggml_tensor * b, int ith, int nth, void * userdata)
+{
+    const LayerNorm *norm = (const LayerNorm *)userdata;
+    norm_quantize(dst, b, ith, nth, false, norm->eps, norm->weight, norm->bias);
+}
 
-    int n_dims = data->rope_dim;
+// rows of b as the `vec_dot_type` of weights: those of b itself when it is already of that type (written by
+// `norm_quantize`), otherwise converted from F32 into `buf`
+static const char *convert_rows(const ggml_tensor *b, ggml_type vec_dot_type, std::vector<char> &buf, size_t &row_size)
+{
+    const int64_t k = b->ne[0];
+    const int64_t n = ggml_nrows(b);
+    const ggml_from_float_t from_float = ggml_internal_get_type_traits(vec_dot_type).from_float;
+    row_size = ggml_row_size(vec_dot_type, k);
+
+    GGML_ASSERT(ggml_is_contiguous(b));
+    if (b->type == vec_dot_type)
+        return (const char *)b->data;
+    GGML_ASSERT(b->type == GGML_TYPE_F32);
+
+    buf.resize(n * row_size);
+    for (int64_t i = 0; i < n; i++) {
+        const float *x = (const float *)((const char *)b->data + i * b->nb[1]);
+        if (from_float)
+            from_float(x, buf.data() + i * row_size, (int)k);
+        else
+            memcpy(buf.data() + i * row_size, x, row_size);
+    }
+    return buf.data();
+}
 
-    const int nr = (int)ggml_nrows(dst);
+// dst = act(gate x b) * (up x b), where gate, up and act come from the `BaseMLP` passed as `userdata`.
+// `a` only gives the shape of dst. Rows of both weights are visited together, and b is converted once for both.
+static void ggml_compute_forward_gated_mul_mat(struct ggml_tensor * dst , const struct ggml_tensor * a, const struct ggml_tensor * b, int ith, int nth, void * userdata)
+{
+    const BaseMLP *mlp = (const BaseMLP *)userdata;
+    const ggml_tensor *gate = mlp->gate_proj.weight;
+    const ggml_tensor *up   = mlp->up_proj.weight;
+    const int64_t nr = dst->ne[0];
+    const int64_t k  = b->ne[0];
+    const int64_t n  = ggml_nrows(b);
 
-    GGML_ASSERT(n_dims <= ne0);
-    GGML_ASSERT(n_dims % 2 == 0);
+    GGML_ASSERT(dst->type == GGML_TYPE_F32 && ggml_is_contiguous(dst));
+    GGML_ASSERT((gate->type == up->type) && (gate->ne[0] == k) && (up->ne[0] == k) && (gate->ne[1] == nr) && (up->ne[1] == nr));
 
     // rows per thread
-    const int dr = (nr + nth - 1)/nth;
+    const int64_t dr  = (nr + nth - 1) / nth;
+    const int64_t ir0 = dr * ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+    if (ir0 >= ir1) return;
+
+    const ggml_type_traits_t traits = ggml_internal_get_type_traits(gate->type);
+    thread_local std::vector<char> qb;
+    size_t row_size = 0;
+    const char *qy = convert_rows(b, traits.vec_dot_type, qb, row_size);
+
+    const int64_t BLOCK = 16;
+    for (int64_t r0 = ir0; r0 < ir1; r0 += BLOCK) {
+        const int64_t r1 = MIN(r0 + BLOCK, ir1);
+        for (int64_t i = 0; i < n; i++) {
+            const char *y = qy + i * row_size;
+            float *out = (float *)((char *)dst->data + i * dst->nb[1]);
+            for (int64_t r = r0; r < r1; r++) {
+                float g, u;
+                traits.vec_dot((int)k, &g, 0, (const char *)gate->data + r * gate->nb[1], 0, y, 0, 1);
+                traits.vec_dot((int)k, &u, 0, (const char *)up->data   + r * up->nb[1],   0, y, 0, 1);
+                out[r] = gated_act(mlp->act, g) * u;
+            }
+        }
+    }
+}
 
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
+// dst = [q_proj x b | k_proj x b | v_proj x b] (biases added), projections of the `BaseAttention` passed as `userdata`.
+// `a` only gives the shape of dst. Results are stored one after another ([rows, n] each), so that views of them are
+// contiguous. b is converted once for all three.
+// Rows of each projection are split across threads on their own, the way `ModelLoader::place_tensors` splits them
+// across NUMA nodes, so that threads running on a node read the rows placed there.
+static void ggml_compute_forward_qkv_mul_mat(struct ggml_tensor * dst , const struct ggml_tensor * a, const struct ggml_tensor * b, int ith, int nth, void * userdata)
+{
+    const BaseAttention *attn = (const BaseAttention *)userdata;
+    const Linear *projs[] = {&attn->q_proj, &attn->k_proj, &attn->v_proj};
+    const int64_t k = b->ne[0];
+    const int64_t n = ggml_nrows(b);
+    const enum ggml_type type = attn->q_proj.weight->type;
+
+    GGML_ASSERT(dst->type == GGML_TYPE_F32 && ggml_is_contiguous(dst));
+
+    int64_t nr = 0;
+    int64_t own = 0;
+    for (auto p : projs) {
+        GGML_ASSERT((p->weight->type == type) && (p->weight->ne[0] == k));
+        GGML_ASSERT(!p->bias || (p->bias->type == GGML_TYPE_F32));
+        nr  += p->weight->ne[1];
+        own += p->weight->ne[1] * (ith + 1) / nth - p->weight->ne[1] * ith / nth;
+    }
+    GGML_ASSERT(ggml_nelements(dst) == nr * n);
+    if (own < 1) return;
+
+    const ggml_type_traits_t traits = ggml_internal_get_type_traits(type);
+    thread_local std::vector<char> qb;
+    size_t row_size = 0;
+    const char *qy = convert_rows(b, traits.vec_dot_type, qb, row_size);
+
+    const int64_t BLOCK = 16;
+    int64_t base = 0;
+    for (auto p : projs) {
+        const ggml_tensor *w = p->weight;
+        const int64_t rows = w->ne[1];
+        const int64_t r_begin = rows *  ith      / nth;
+        const int64_t r_end   = rows * (ith + 1) / nth;
+        const float *bias = p->bias ? (const float *)p->bias->data : nullptr;
+        float *out = (float *)dst->data + base * n;
+
+        for (int64_t r0 = r_begin; r0 < r_end; r0 += BLOCK) {
+            const int64_t r1 = MIN(r0 + BLOCK, r_end);
+            for (int64_t i = 0; i < n; i++) {
+                const char *y = qy + i * row_size;
+                for (int64_t r = r0; r < r1; r++) {
+                    float v;
+                    traits.vec_dot((int)k, &v, 0, (const char *)w->data + r * w->nb[1], 0, y, 0, 1);
+                    out[i * rows + r] = bias ? v + bias[r] : v;
+                }
+            }
+        }
+        base += rows;
+    }
+}
 
-    // row index used to determine which thread to use
-    int ir = 0;
+// dst = as[ids] x b, and `ids` ([num_experts_per_tok, n_tokens]) routes tokens to experts.
+// With `ups`, dst = act(as[ids] x b) * (ups[ids] x b), and b is converted once for both.
+// Layouts are given by the caller, as they can't be told from shapes when num_experts_per_tok == 1:
+//      summed:   dst is [rows, n_tokens], results of all slots of a token are summed up,
+//                otherwise [rows, num_experts_per_tok, n_tokens], a result for each routed slot;
+//      per_slot: b is [cols, num_experts_per_tok, n_tokens], otherwise [cols, n_tokens] shared by all slots of a token.
+// Slots routed to the same expert are gathered, so that each expert's weights are streamed once.
+static void moe_mul_mat_compute(struct ggml_tensor * dst , const struct ggml_tensor * ids, const struct ggml_tensor * b, int ith, int nth,
+                        const std::vector<ggml_tensor *> &as, const std::vector<ggml_tensor *> *ups, ActFunc act,
+                        bool summed, bool per_slot)
+{
+    const int64_t n_as     = (int64_t)as.size();
+    const int64_t n_used   = ids->ne[0];
+    const int64_t n_tokens = ids->ne[1];
+    const int64_t nr       = dst->ne[0];
+    const int64_t k        = b->ne[0];
+
+    const enum ggml_type type = as[0]->type;
+    const ggml_type_traits_t traits = ggml_internal_get_type_traits(type);
+    const ggml_from_float_t from_float = ggml_internal_get_type_traits(traits.vec_dot_type).from_float;
+    const size_t row_size = ggml_row_size(traits.vec_dot_type, k);
+
+    // b may also be rows of `vec_dot_type` written by `norm_quantize`
+    const bool converted = (b->type != GGML_TYPE_F32) && (b->type == traits.vec_dot_type);
+
+    GGML_ASSERT(ids->type == GGML_TYPE_I32);
+    GGML_ASSERT((b->type == GGML_TYPE_F32 && b->nb[0] == sizeof(float)) || (converted && !per_slot && ggml_is_contiguous(b)));
+    GGML_ASSERT(dst->type == GGML_TYPE_F32 && dst->nb[0] == sizeof(float));
+    GGML_ASSERT(ggml_nrows(dst) == (summed ? n_tokens : n_used * n_tokens));
+    GGML_ASSERT(ggml_nrows(b) == (per_slot ? n_used * n_tokens : n_tokens));
+    GGML_ASSERT(!(summed && ups));
 
-    const int32_t * pos = (const int32_t *) src1->data;
+    // rows per thread
+    const int64_t dr  = (nr + nth - 1) / nth;
+    const int64_t ir0 = dr * ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+    if (ir0 >= ir1) return;
+
+    // group slots by expert (counting sort)
+    thread_local std::vector<int64_t> offsets;
+    thread_local std::vector<int64_t> slots;
+    offsets.assign(n_as + 1, 0);
+    slots.resize(n_used * n_tokens);
+    for (int64_t i = 0; i < n_used * n_tokens; i++) {
+        const int32_t e = *(const int32_t *)((const char *)ids->data + (i / n_used) * ids->nb[1] + (i % n_used) * ids->nb[0]);
+        GGML_ASSERT(e >= 0 && e < n_as);
+        offsets[e + 1]++;
+    }
+    for (int64_t e = 0; e < n_as; e++)
+        offsets[e + 1] += offsets[e];
+    for (int64_t i = 0; i < n_used * n_tokens; i++) {
+        const int32_t e = *(const int32_t *)((const char *)ids->data + (i / n_used) * ids->nb[1] + (i % n_used) * ids->nb[0]);
+        slots[offsets[e]++] = i;
+    }
+    for (int64_t e = n_as; e > 0; e--)
+        offsets[e] = offsets[e - 1];
+    offsets[0] = 0;
+
+    // each thread converts the activations itself, which is cheap compared to its share of the products
+    const int64_t nb_rows = per_slot ? n_used * n_tokens : n_tokens;
+    thread_local std::vector<char> qb;
+    qb.resize(converted ? 0 : nb_rows * row_size);
+    for (int64_t i = 0; !converted && (i < nb_rows); i++) {
+        const float *x = per_slot ? (const float *)((const char *)b->data + (i / n_used) * b->nb[2] + (i % n_used) * b->nb[1])
+                                  : (const float *)((const char *)b->data + i * b->nb[1]);
+        if (from_float)
+            from_float(x, qb.data() + i * row_size, (int)k);
+        else
+            memcpy(qb.data() + i * row_size, x, row_size);
+    }
+    const char *qy = converted ? (const char *)b->data : qb.data();
 
-    for (int64_t i3 = 0; i3 < ne3; i3++) {
-        for (int64_t i2 = 0; i2 < ne2; i2++) {
-            const float p = (float)pos[i2];
-            const float *inv_freq = data->get_inv_freq(pos[i2]);
-            for (int64_t i1 = 0; i1 < ne1; i1++) {
-                if (ir++ < ir0) continue;
-                if (ir   > ir1) break;
+    if (summed) {
+        for (int64_t t = 0; t < n_tokens; t++)
+            memset((float *)((char *)dst->data + t * dst->nb[1]) + ir0, 0, (ir1 - ir0) * sizeof(float));
+    }
 
-                for (int64_t i0 = 0; i0 < ne0; i0 += 2) {
+    // weight rows are visited in blocks, which stay in cache while all gathered slots go through them
+    const int64_t BLOCK = 16;
+    for (int64_t e = 0; e < n_as; e++) {
+        if (offsets[e] == offsets[e + 1]) continue;
+
+        const ggml_tensor *w = as[e];
+        const ggml_tensor *w_up = ups ? (*ups)[e] : nullptr;
+        GGML_ASSERT((w->type == type) && (w->ne[0] == k) && (w->ne[1] == nr));
+        GGML_ASSERT(!w_up || ((w_up->type == type) && (w_up->ne[0] == k) && (w_up->ne[1] == nr)));
+
+        for (int64_t r0 = ir0; r0 < ir1; r0 += BLOCK) {
+            const int64_t r1 = MIN(r0 + BLOCK, ir1);
+            for (int64_t j = offsets[e]; j < offsets[e + 1]; j++) {
+                const int64_t i = slots[j];
+                const int64_t t = i / n_used;
+                const char  *y = qy + (per_slot ? i : t) * row_size;
+                float *out = summed ? (float *)((char *)dst->data + t * dst->nb[1])
+                                    : (float *)((char *)dst->data + t * dst->nb[2] + (i % n_used) * dst->nb[1]);
+                for (int64_t r = r0; r < r1; r++) {
+                    float v;
+                    traits.vec_dot((int)k, &v, 0, (const char *)w->data + r * w->nb[1], 0, y, 0, 1);
+                    if (w_up) {
+                        float u;
+                        traits.vec_dot((int)k, &u, 0, (const char *)w_up->data + r * w_up->nb[1], 0, y, 0, 1);
+                        v = gated_act(act, v) * u;
+                    }
+                    if (summed)
+                        out[r] += v;
+                    else
+                        out[r] = v;
+                }
+            }
+        }
+    }
+}
 
-                    float theta = p * inv_freq[i0 / 2];
+// expert weights are passed as `userdata`: a result for each slot summed up (down projections), see `moe_mul_mat_compute`
+static void ggml_compute_forward_moe_mul_mat(struct ggml_tensor * dst , const struct ggml_tensor * a, const struct ggml_tensor * ids, const struct ggml_tensor * b, int ith, int nth, void * userdata)
+{
+    moe_mul_mat_compute(dst, ids, b, ith, nth, *(const std::vector<ggml_tensor *> *)userdata, nullptr, ActFunc::GELU, true, true);
+}
 
-                    float cos_theta = cosf(theta) * data->scaling_factor;
-                    float sin_theta = sinf(theta) * data->scaling_factor;
+// gate and up projections of experts of the `BaseSparseMLP` passed as `userdata`: the input of each token is
+// shared by its slots, and a result is kept for each slot. see `moe_mul_mat_compute`
+static void ggml_compute_forward_moe_gated_mul_mat(struct ggml_tensor * dst , const struct ggml_tensor * a, const struct ggml_tensor * ids, const struct ggml_tensor * b, int ith, int nth, void * userdata)
+{
+    const BaseSparseMLP *mlp = (const BaseSparseMLP *)userdata;
+    moe_mul_mat_compute(dst, ids, b, ith, nth, mlp->expert_gates, &mlp->expert_ups, mlp->act, false, false);
+}
 
-                    const float * const src = (float *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
-                          float * dst_data  = (float *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
+static void ggml_compute_forward_fill_neg_inf(struct ggml_tensor * dst , const struct ggml_tensor * src0, int ith, int nth, void * userdata) {
+    GGML_ASSERT(dst->type == GGML_TYPE_F32);
 
-                    const float x0 = src[0];
-                    const float x1 = src[1];
+    GGML_TENSOR_UNARY_OP_LOCALS
 
-                    dst_data[0] = x0*cos_theta - x1*sin_theta;
-                    dst_data[1] = x0*sin_theta + x1*cos_theta;
+    for (int64_t i03 = 0; i03 < ne03; i03++) {
+        for (int64_t i02 = 0; i02 < ne02; i02++) {
+            for (int64_t i01 = ith; i01 < ne01; i01 += nth) {
+                for (int64_t i00 = 0; i00 < ne00; i00++) {
+                    float * y = (float *) ((char *) dst->data + i00*nb0 + i01*nb1 + i02*nb2 + i03*nb3);
+                    *y = -INFINITY;
                 }
             }
         }
     }
 }
 
-static void ggml_compute_forward_su_rope(struct ggml_tensor * dst , const struct ggml_tensor * a, const struct ggml_tensor * b, int ith, int nth, void * userdata)
-{
-    switch (a->type)
-    {
-    case GGML_TYPE_F16:
-        ggml_compute_forward_su_rope_f16(dst, a, b, ith, nth, userdata);
-        break;
-    case GGML_TYPE_F32:
-        ggml_compute_forward_su_rope_f32(dst, a, b, ith, nth, userdata);
-        break;
-    default:
-        GGML_ASSERT(false);
-        break;
-    }
-}
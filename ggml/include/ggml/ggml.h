@@ -596,6 +596,9 @@ extern "C" {
     // If it returns true, the computation is aborted
     typedef bool (*ggml_abort_callback)(void * data);
 
+    // persistent worker threads for ggml_graph_compute(), see ggml_threadpool_new()
+    struct ggml_threadpool;
+
     // the compute plan that needs to be prepared for ggml_graph_compute()
     // since https://github.com/ggerganov/ggml/issues/287
     struct ggml_cplan {
@@ -607,6 +610,15 @@ extern "C" {
         // abort ggml_graph_compute when true
         ggml_abort_callback abort_callback;
         void *              abort_callback_data;
+
+        // optional: workers to run the graph on, instead of threads created for each call
+        struct ggml_threadpool * threadpool;
+    };
+
+    struct ggml_threadpool_params {
+        int         n_threads;  // maximum number of threads, including the one calling ggml_graph_compute()
+        const int * cpus;       // optional: CPU to pin each thread to ([0]: the calling thread), -1 for none
+        int         spin_us;    // how long idle workers busy-wait for the next graph before sleeping
     };
 
     enum ggml_cgraph_eval_order {
@@ -1975,6 +1987,12 @@ extern "C" {
     // note: the drawback of this API is that you must have ensured that the context has enough memory for the work data
     GGML_API enum ggml_status  ggml_graph_compute_with_ctx(struct ggml_context * ctx, struct ggml_cgraph * cgraph, int n_threads);
 
+    // workers are created (and pinned) once, then wait for graphs of plans with `threadpool` set.
+    // the calling thread is thread 0: it is pinned to cpus[0] only while it computes a graph.
+    // a plan with more threads than the pool falls back to threads created for the call.
+    GGML_API struct ggml_threadpool * ggml_threadpool_new (struct ggml_threadpool_params params);
+    GGML_API void                     ggml_threadpool_free(struct ggml_threadpool * threadpool);
+
     GGML_API struct ggml_tensor * ggml_graph_get_tensor(struct ggml_cgraph * cgraph, const char * name);
 
     GGML_API void                 ggml_graph_export(const struct ggml_cgraph * cgraph, const char * fname);
@@ -18421,6 +18421,231 @@ struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threa
     return cplan;
 }
 
+// persistent workers: between graphs, they spin for `spin_us`, then sleep on a condition variable
+
+struct ggml_threadpool_worker {
+    struct ggml_threadpool * pool;
+    int ith;
+    ggml_thread_t thrd;
+};
+
+struct ggml_threadpool {
+    int   n_threads;
+    int   spin_us;
+    int * cpus;
+
+    struct ggml_threadpool_worker * threads;  // [n_threads], [0] is the calling thread
+    struct ggml_compute_state     * workers;  // [n_threads], states of the current graph
+
+    atomic_int generation;  // bumped for each graph
+    atomic_int n_compute;   // threads of the current graph
+    atomic_int n_running;   // workers that have not finished with the current graph yet
+    atomic_int stop;
+
+#if defined(_WIN32)
+    CRITICAL_SECTION   mutex;
+    CONDITION_VARIABLE cond;
+#else
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+#endif
+};
+
+static void ggml_threadpool_lock(struct ggml_threadpool * tp) {
+#if defined(_WIN32)
+    EnterCriticalSection(&tp->mutex);
+#else
+    pthread_mutex_lock(&tp->mutex);
+#endif
+}
+
+static void ggml_threadpool_unlock(struct ggml_threadpool * tp) {
+#if defined(_WIN32)
+    LeaveCriticalSection(&tp->mutex);
+#else
+    pthread_mutex_unlock(&tp->mutex);
+#endif
+}
+
+static void ggml_threadpool_wait(struct ggml_threadpool * tp) {
+#if defined(_WIN32)
+    SleepConditionVariableCS(&tp->cond, &tp->mutex, INFINITE);
+#else
+    pthread_cond_wait(&tp->cond, &tp->mutex);
+#endif
+}
+
+static void ggml_threadpool_wake_all(struct ggml_threadpool * tp) {
+    ggml_threadpool_lock(tp);
+#if defined(_WIN32)
+    WakeAllConditionVariable(&tp->cond);
+#else
+    pthread_cond_broadcast(&tp->cond);
+#endif
+    ggml_threadpool_unlock(tp);
+}
+
+static void ggml_thread_set_cpu(int cpu) {
+    if (cpu < 0) {
+        return;
+    }
+#if defined(__gnu_linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int rv = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rv) {
+        fprintf(stderr, "warning: pthread_setaffinity_np() failed: %s\n", strerror(rv));
+    }
+#elif defined(_WIN32)
+    if (cpu < 64) {
+        SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu);
+    }
+#else
+    UNUSED(cpu);
+#endif
+}
+
+// the calling thread is thread 0 of a pool: it is only pinned while it computes a graph, since it belongs to
+// the application, and threads it creates later would inherit the mask
+struct ggml_thread_affinity {
+#if defined(__gnu_linux__)
+    cpu_set_t set;
+#elif defined(_WIN32)
+    DWORD_PTR mask;
+#endif
+    bool saved;
+};
+
+static void ggml_thread_pin_calling(int cpu, struct ggml_thread_affinity * prev) {
+    prev->saved = false;
+    if (cpu < 0) {
+        return;
+    }
+#if defined(__gnu_linux__)
+    if (pthread_getaffinity_np(pthread_self(), sizeof(prev->set), &prev->set) != 0) {
+        return;
+    }
+    prev->saved = true;
+    ggml_thread_set_cpu(cpu);
+#elif defined(_WIN32)
+    if (cpu < 64) {
+        prev->mask  = SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu);
+        prev->saved = prev->mask != 0;
+    }
+#endif
+}
+
+static void ggml_thread_restore_affinity(const struct ggml_thread_affinity * prev) {
+    if (!prev->saved) {
+        return;
+    }
+#if defined(__gnu_linux__)
+    pthread_setaffinity_np(pthread_self(), sizeof(prev->set), &prev->set);
+#elif defined(_WIN32)
+    SetThreadAffinityMask(GetCurrentThread(), prev->mask);
+#endif
+}
+
+static thread_ret_t ggml_threadpool_thread(void * data) {
+    struct ggml_threadpool_worker * w = (struct ggml_threadpool_worker *) data;
+    struct ggml_threadpool * tp = w->pool;
+
+    ggml_thread_set_cpu(tp->cpus ? tp->cpus[w->ith] : -1);
+
+    int last = 0;
+    while (true) {
+        const int64_t t0 = ggml_time_us();
+        while ((atomic_load(&tp->generation) == last) && !atomic_load(&tp->stop)) {
+            if (ggml_time_us() - t0 < tp->spin_us) {
+                sched_yield();
+                continue;
+            }
+
+            ggml_threadpool_lock(tp);
+            while ((atomic_load(&tp->generation) == last) && !atomic_load(&tp->stop)) {
+                ggml_threadpool_wait(tp);
+            }
+            ggml_threadpool_unlock(tp);
+        }
+
+        if (atomic_load(&tp->stop)) {
+            break;
+        }
+
+        // every worker acknowledges every graph, so that none of them can lag behind into the next one
+        last = atomic_load(&tp->generation);
+        if (w->ith < atomic_load(&tp->n_compute)) {
+            ggml_graph_compute_thread(&tp->workers[w->ith]);
+        }
+        atomic_fetch_sub(&tp->n_running, 1);
+    }
+
+    return 0;
+}
+
+struct ggml_threadpool * ggml_threadpool_new(struct ggml_threadpool_params params) {
+    GGML_ASSERT(params.n_threads > 0);
+
+    struct ggml_threadpool * tp = (struct ggml_threadpool *) calloc(1, sizeof(struct ggml_threadpool));
+    tp->n_threads = params.n_threads;
+    tp->spin_us   = params.spin_us;
+    tp->threads   = (struct ggml_threadpool_worker *) calloc(params.n_threads, sizeof(struct ggml_threadpool_worker));
+    tp->workers   = (struct ggml_compute_state *)     calloc(params.n_threads, sizeof(struct ggml_compute_state));
+    if (params.cpus) {
+        tp->cpus = (int *) malloc(params.n_threads * sizeof(int));
+        memcpy(tp->cpus, params.cpus, params.n_threads * sizeof(int));
+    }
+
+    atomic_store(&tp->generation, 0);
+    atomic_store(&tp->n_compute,  0);
+    atomic_store(&tp->n_running,  0);
+    atomic_store(&tp->stop,       0);
+
+#if defined(_WIN32)
+    InitializeCriticalSection(&tp->mutex);
+    InitializeConditionVariable(&tp->cond);
+#else
+    pthread_mutex_init(&tp->mutex, NULL);
+    pthread_cond_init(&tp->cond, NULL);
+#endif
+
+    for (int j = 1; j < tp->n_threads; j++) {
+        tp->threads[j].pool = tp;
+        tp->threads[j].ith  = j;
+        const int rc = ggml_thread_create(&tp->threads[j].thrd, NULL, ggml_threadpool_thread, &tp->threads[j]);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    return tp;
+}
+
+void ggml_threadpool_free(struct ggml_threadpool * tp) {
+    if (!tp) {
+        return;
+    }
+
+    atomic_store(&tp->stop, 1);
+    ggml_threadpool_wake_all(tp);
+
+    for (int j = 1; j < tp->n_threads; j++) {
+        ggml_thread_join(tp->threads[j].thrd, NULL);
+    }
+
+#if defined(_WIN32)
+    DeleteCriticalSection(&tp->mutex);
+#else
+    pthread_mutex_destroy(&tp->mutex);
+    pthread_cond_destroy(&tp->cond);
+#endif
+
+    free(tp->cpus);
+    free(tp->workers);
+    free(tp->threads);
+    free(tp);
+}
+
 enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
     {
         GGML_ASSERT(cplan);
@@ -18456,9 +18681,14 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         /*.abort_callback          =*/ NULL,
         /*.abort_callback_data     =*/ NULL,
     };
-    struct ggml_compute_state * workers = alloca(sizeof(struct ggml_compute_state)*n_threads);
+    struct ggml_threadpool * tp = cplan->threadpool;
+    if (tp && (n_threads > tp->n_threads)) {
+        tp = NULL;
+    }
+
+    struct ggml_compute_state * workers = tp ? tp->workers : alloca(sizeof(struct ggml_compute_state)*n_threads);
 
-    // create thread pool
+    // create thread pool (or hand the graph to the persistent one)
     if (n_threads > 1) {
         for (int j = 1; j < n_threads; ++j) {
             workers[j] = (struct ggml_compute_state) {
@@ -18468,16 +18698,30 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
                 .ec = GGML_STATUS_SUCCESS,
             };
 
+            if (tp) {
+                continue;
+            }
+
             const int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
             GGML_ASSERT(rc == 0);
             UNUSED(rc);
         }
+
+        if (tp) {
+            atomic_store(&tp->n_compute, n_threads);
+            atomic_store(&tp->n_running, tp->n_threads - 1);
+            atomic_fetch_add(&tp->generation, 1);
+            ggml_threadpool_wake_all(tp);
+        }
     }
 
     workers[0].ith = 0;
     workers[0].shared = &state_shared;
     workers[0].ec = GGML_STATUS_SUCCESS;
 
+    struct ggml_thread_affinity prev_affinity;
+    ggml_thread_pin_calling(tp && tp->cpus ? tp->cpus[0] : -1, &prev_affinity);
+
     const int64_t perf_start_cycles  = ggml_perf_cycles();
     const int64_t perf_start_time_us = ggml_perf_time_us();
 
@@ -18487,12 +18731,22 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
 
     // don't leave affinity set on the main thread
     clear_numa_thread_affinity();
+    ggml_thread_restore_affinity(&prev_affinity);
 
     // join or kill thread pool
     if (n_threads > 1) {
+        if (tp) {
+            while (atomic_load(&tp->n_running) > 0) {
+                // workers are done with the last node, and about to leave
+                sched_yield();
+            }
+        }
+
         for (int j = 1; j < n_threads; j++) {
-            const int rc = ggml_thread_join(workers[j].thrd, NULL);
-            GGML_ASSERT(rc == 0);
+            if (!tp) {
+                const int rc = ggml_thread_join(workers[j].thrd, NULL);
+                GGML_ASSERT(rc == 0);
+            }
             if (workers[j].ec != GGML_STATUS_SUCCESS)
                 compute_status = workers[j].ec;
         }
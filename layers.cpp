@@ -12,6 +12,15 @@
 #include <regex>
 #include <string>
 #include <functional>
+#include <mutex>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #ifdef GGML_USE_CLBLAST
 #include "ggml-opencl.h"
@@ -76,11 +85,48 @@ namespace chatllm
         return output;
     }
 
+    // large batches are left to BLAS, instead of custom CPU kernels
+    static bool use_blas(const ggml_tensor *input)
+    {
+        return (input->ne[1] >= 32) && ggml_cpu_has_blas() && !ggml_cpu_has_gpublas();
+    }
+
+    // outputs of `Linear` may come from the repacked kernel (or a bias), which has no precision setting
+    static void mul_mat_set_prec(ggml_tensor *a, ggml_prec prec)
+    {
+        if (a->op == GGML_OP_MUL_MAT)
+            ggml_mul_mat_set_prec(a, prec);
+    }
+
+    // custom ops below take a tensor only for the shape of their output: it is never read, and having data
+    // keeps the allocator away from it. the data is not in any model file, so that `WeightStreamer` does
+    // not take it for a weight.
+    static ggml_tensor *shape_only(ggml_tensor *shape)
+    {
+        static float placeholder;
+        shape->data = &placeholder;
+        return shape;
+    }
+
     ggml_tensor *Linear::forward(ForwardContext *ctx, ggml_tensor *input)
     {
         // input: [seqlen, in_features]
-        ggml_tensor *output = ggml_mul_mat(ctx->gctx.get(), weight, input); // [seqlen, out_features]
-        ggml_mul_mat_set_prec(output, prec);
+        if (ctx->imatrix)
+            input = ctx->imatrix->hook(ctx, weight, input);
+
+        ggml_tensor *output = nullptr;
+
+        if (weight->extra && !use_blas(input) && (input->type == GGML_TYPE_F32) && ggml_is_contiguous(input))
+        {
+            ggml_tensor *shape = shape_only(ggml_new_tensor_4d(ctx->gctx.get(), GGML_TYPE_F32, weight->ne[1], input->ne[1], input->ne[2], input->ne[3]));
+            output = ggml_map_custom2(ctx->gctx.get(), shape, input, ggml_compute_forward_repacked_mul_mat, GGML_N_TASKS_MAX, weight->extra);
+        }
+        else
+        {
+            output = ggml_mul_mat(ctx->gctx.get(), weight, input); // [seqlen, out_features]
+            ggml_mul_mat_set_prec(output, prec);
+        }
+
         if (bias)
         {
             output = ggml_add_inplace(ctx->gctx.get(), output, bias);
@@ -88,23 +134,90 @@ namespace chatllm
         return output;
     }
 
+    ggml_tensor *row_parallel_forward(ForwardContext *ctx, Linear &linear, ggml_tensor *input)
+    {
+        if (!ctx->tensor_parallel)
+            return linear.forward(ctx, input);
+
+        ggml_tensor *bias = linear.bias;
+        linear.bias = nullptr;
+        ggml_tensor *output = linear.forward(ctx, input);
+        linear.bias = bias;
+
+        output = ctx->tensor_parallel->all_reduce(ctx, output);
+        if (bias)
+            output = ggml_add_inplace(ctx->gctx.get(), output, bias);
+        return output;
+    }
+
+    // not in place: `input` may still be read by `forward_quantized`
     ggml_tensor *LayerNorm::forward(ForwardContext *ctx, ggml_tensor *input)
     {
         // input: [seqlen, normalized_shape]
-        ggml_tensor *output = ggml_norm_inplace(ctx->gctx.get(), input, eps);
+        ggml_tensor *output = ggml_norm(ctx->gctx.get(), input, eps);
         output = ggml_mul_inplace(ctx->gctx.get(), output, weight);
         if (bias)
             output = ggml_add_inplace(ctx->gctx.get(), output, bias);
+
+        ctx->last_norm        = this;
+        ctx->last_norm_input  = input;
+        ctx->last_norm_output = output;
+        return output;
+    }
+
+    static ggml_tensor *norm_quantized(ForwardContext *ctx, ggml_tensor *input, ggml_type type, ggml_tensor *weight,
+                                       ggml_custom2_op_t fun, void *userdata)
+    {
+        ggml_tensor *shape = shape_only(ggml_new_tensor_4d(ggctx, type, input->ne[0], input->ne[1], input->ne[2], input->ne[3]));
+        ggml_tensor *output = ggml_map_custom2(ggctx, shape, input, fun, GGML_N_TASKS_MAX, userdata);
+
+        // read through `userdata`, but kept in the graph (see `WeightStreamer::collect_layer`)
+        output->src[2] = weight;
         return output;
     }
 
+    ggml_tensor *LayerNorm::forward_quantized(ForwardContext *ctx, ggml_tensor *input, ggml_type type)
+    {
+        return norm_quantized(ctx, input, type, weight, ggml_compute_forward_layer_norm_quantize, this);
+    }
+
     ggml_tensor *RMSNorm::forward(ForwardContext *ctx, ggml_tensor *input)
     {
-        ggml_tensor *output = ggml_rms_norm_inplace(ctx->gctx.get(), input, eps);
+        ggml_tensor *output = ggml_rms_norm(ctx->gctx.get(), input, eps);
         output = ggml_mul_inplace(ctx->gctx.get(), output, weight);
+
+        ctx->last_norm        = this;
+        ctx->last_norm_input  = input;
+        ctx->last_norm_output = output;
         return output;
     }
 
+    ggml_tensor *RMSNorm::forward_quantized(ForwardContext *ctx, ggml_tensor *input, ggml_type type)
+    {
+        return norm_quantized(ctx, input, type, weight, ggml_compute_forward_rms_norm_quantize, this);
+    }
+
+    // `input` as rows of `type` for a fused product kernel, when `input` is the output of the latest norm, which then
+    // writes them directly. otherwise, nullptr: the kernel converts F32 rows itself.
+    static ggml_tensor *quantized_input(ForwardContext *ctx, ggml_tensor *input, ggml_type type)
+    {
+        if ((ctx->last_norm_output != input) || (type == GGML_TYPE_F32) || !ggml_internal_get_type_traits(type).from_float)
+            return nullptr;
+        if ((input->ne[0] % ggml_blck_size(type)) != 0)
+            return nullptr;
+
+        if (auto norm = dynamic_cast<RMSNorm *>(ctx->last_norm))
+            return norm->forward_quantized(ctx, ctx->last_norm_input, type);
+        if (auto norm = dynamic_cast<LayerNorm *>(ctx->last_norm))
+            return norm->forward_quantized(ctx, ctx->last_norm_input, type);
+        return nullptr;
+    }
+
+    static ggml_type vec_dot_type(const ggml_tensor *weight)
+    {
+        return ggml_internal_get_type_traits(weight->type).vec_dot_type;
+    }
+
     ggml_tensor *RobertaPooler::forward(ForwardContext *ctx, ggml_tensor *hidden_states)
     {
         int hidden_size = (int)hidden_states->ne[0];
@@ -215,12 +328,10 @@ namespace chatllm
         if (n_past == 0)
         {
             // build attention mask for context input
-            ggml_tensor *inf = ggml_new_tensor_3d(ctx->gctx.get(), attn_scores->type, 1, qlen - 1, num_attention_heads);
-            ggml_set_f32(inf, -INFINITY);
             ggml_tensor *masked_attn_scores = ggml_view_3d(
                 ctx->gctx.get(), attn_scores, 1, qlen - 1, num_attention_heads, qlen * ggml_element_size(attn_scores),
                 qlen * qlen * ggml_element_size(attn_scores), (qlen - 1) * ggml_element_size(attn_scores));
-            ggml_build_forward_expand(ctx->gf, ggml_cpy(ctx->gctx.get(), inf, masked_attn_scores));
+            ggml_build_forward_expand(ctx->gf, ggml_map_custom1_inplace(ctx->gctx.get(), masked_attn_scores, ggml_compute_forward_fill_neg_inf, 1, nullptr));
         }
         attn_scores =
             ggml_scale_inplace(ctx->gctx.get(), attn_scores, 1.f / sqrtf((float)head_size));
@@ -313,16 +424,158 @@ namespace chatllm
         fc1.set_prec(prec);
     }
 
+    // whether projections of `input` by `linears` can be done by a fused kernel instead of `Linear::forward`
+    static bool can_fuse_linears(ForwardContext *ctx, ggml_tensor *input, std::initializer_list<const Linear *> linears)
+    {
+        if (ctx->imatrix || use_blas(input) || (input->type != GGML_TYPE_F32) || !ggml_is_contiguous(input))
+            return false;
+
+        const ggml_type type = (*linears.begin())->weight->type;
+        for (auto l : linears)
+        {
+            if (l->weight->extra || (l->weight->type != type) || (l->weight->ne[0] != input->ne[0]))
+                return false;
+            if (l->bias && (l->bias->type != GGML_TYPE_F32))
+                return false;
+        }
+        return true;
+    }
+
+    // gate and up projections in one pass, see `ggml_compute_forward_gated_mul_mat`
+    bool BaseMLP::can_fuse(ForwardContext *ctx, ggml_tensor *input) const
+    {
+        return !gate_proj.bias && !up_proj.bias && can_fuse_linears(ctx, input, {&gate_proj, &up_proj});
+    }
+
     ggml_tensor *BaseMLP::forward(ForwardContext *ctx, ggml_tensor *hidden_states)
     {
-        ggml_tensor *act = inplace_act(ctx->gctx.get(), this->act, gate_proj.forward(ctx, hidden_states));
-        ggml_tensor *proj = up_proj.forward(ctx, hidden_states);
+        ggml_tensor *output = nullptr;
+        if (can_fuse(ctx, hidden_states))
+        {
+            ggml_tensor *shape = shape_only(ggml_new_tensor_4d(ggctx, GGML_TYPE_F32, gate_proj.weight->ne[1],
+                                                               hidden_states->ne[1], hidden_states->ne[2], hidden_states->ne[3]));
 
-        ggml_tensor *output = ggml_mul_inplace(ctx->gctx.get(), act, proj);
-        output = down_proj.forward(ctx, output);
+            ggml_tensor *input = quantized_input(ctx, hidden_states, vec_dot_type(gate_proj.weight));
+            output = ggml_map_custom2(ggctx, shape, input ? input : hidden_states, ggml_compute_forward_gated_mul_mat, GGML_N_TASKS_MAX, this);
+
+            // not read by the op, but keeps the weights in the graph (see `WeightStreamer::collect_layer`)
+            output->src[2] = gate_proj.weight;
+            output->src[3] = up_proj.weight;
+        }
+        else
+        {
+            ggml_tensor *act = inplace_act(ctx->gctx.get(), this->act, gate_proj.forward(ctx, hidden_states));
+            ggml_tensor *proj = up_proj.forward(ctx, hidden_states);
+            output = ggml_mul_inplace(ctx->gctx.get(), act, proj);
+        }
+
+        output = row_parallel_forward(ctx, down_proj, output);
         return output;
     }
 
+    BaseSparseMLP::BaseSparseMLP(InitContext *ctx, int hidden_size, int intermediate_size, int num_local_experts, int num_experts_per_tok, ActFunc act)
+        : num_local_experts(num_local_experts),
+          num_experts_per_tok(num_experts_per_tok),
+          gate(ctx, hidden_size, num_local_experts, false),
+          norm_topk_prob(true),
+          act(act)
+    {
+        experts.reserve(num_local_experts);
+        for (int i = 0; i < num_local_experts; i++)
+        {
+            experts.emplace_back(ctx, hidden_size, intermediate_size, act);
+            expert_gates.push_back(experts[i].gate_proj.weight);
+            expert_downs.push_back(experts[i].down_proj.weight);
+            expert_ups.push_back(experts[i].up_proj.weight);
+        }
+
+        // experts are read by `moe_mul_mat_compute` from their original data, never by `Linear::forward`
+        for (auto w : {&expert_gates, &expert_downs, &expert_ups})
+        {
+            for (auto t : *w)
+                t->flags &= ~RepackedTensor::LINEAR_WEIGHT;
+        }
+    }
+
+    // `experts` x input, see `moe_mul_mat_compute`. `summed` must match the layout of `fun`
+    static ggml_tensor *moe_mul_mat(ForwardContext *ctx, const std::vector<ggml_tensor *> &experts, ggml_tensor *selected, ggml_tensor *input, bool summed,
+                                    ggml_custom3_op_t fun = ggml_compute_forward_moe_mul_mat, void *userdata = nullptr)
+    {
+        const int64_t rows     = experts[0]->ne[1];
+        const int64_t n_used   = selected->ne[0];
+        const int64_t n_tokens = selected->ne[1];
+
+        ggml_tensor *shape = shape_only(summed ? ggml_new_tensor_2d(ggctx, GGML_TYPE_F32, rows, n_tokens)
+                                               : ggml_new_tensor_3d(ggctx, GGML_TYPE_F32, rows, n_used, n_tokens));
+        return ggml_map_custom3(ggctx, shape, selected, input, fun, GGML_N_TASKS_MAX, userdata ? userdata : (void *)&experts);
+    }
+
+    ggml_tensor *BaseSparseMLP::forward(ForwardContext *ctx, ggml_tensor *hidden_states)
+    {
+        const int64_t n_tokens = hidden_states->ne[1];
+
+        ggml_tensor * logits = gate.forward(ctx, hidden_states); // [n_tokens, num_experts]
+
+        ggml_tensor * probs = ggml_soft_max(ggctx, logits); // [n_tokens, num_experts]
+
+        // select experts
+        ggml_tensor * selected_experts = ggml_top_k(ggctx, probs, num_experts_per_tok); // [n_tokens, num_experts_per_tok]
+
+        if (ctx->expert_stats)
+            selected_experts = ctx->expert_stats->hook(ctx, id, selected_experts, {&expert_gates, &expert_ups, &expert_downs});
+
+        // experts are passed to the ops as `userdata`, so they are not found in the graph
+        if (ctx->weight_streamer)
+            ctx->weight_streamer->add_weights({&expert_gates, &expert_ups, &expert_downs});
+
+        ggml_tensor * weights = ggml_get_rows(ggctx,
+                ggml_reshape_3d(ggctx, probs, 1, num_local_experts, n_tokens), selected_experts);
+
+        weights = ggml_reshape_2d(ggctx, weights, num_experts_per_tok, n_tokens); // [n_tokens, num_experts_per_tok]
+
+        if (norm_topk_prob)
+        {
+            ggml_tensor * weights_sum = ggml_sum_rows(ggctx, weights);
+
+            weights = ggml_div(ggctx, weights, weights_sum); // [n_tokens, num_experts_per_tok]
+        }
+
+        // compute expert outputs: act(gate) * up in one pass
+        ggml_tensor * input = quantized_input(ctx, hidden_states, vec_dot_type(expert_gates[0]));
+        ggml_tensor * intermediate = moe_mul_mat(ctx, expert_gates, selected_experts, input ? input : hidden_states, false,
+                                                 ggml_compute_forward_moe_gated_mul_mat, this); // [n_tokens, num_experts_per_tok, intermediate_size]
+
+        // weighting before the down projection leaves a plain sum over the slots
+        intermediate = ggml_mul_inplace(ggctx, intermediate, ggml_reshape_3d(ggctx, weights, 1, num_experts_per_tok, n_tokens));
+
+        ggml_tensor * moe_out = moe_mul_mat(ctx, expert_downs, selected_experts, intermediate, true); // [n_tokens, hidden_size]
+
+        // partial sums of the intermediate features of this rank
+        if (ctx->tensor_parallel)
+            moe_out = ctx->tensor_parallel->all_reduce(ctx, moe_out);
+
+        return moe_out;
+    }
+
+    void BaseSparseMLP::set_prec(ggml_prec prec)
+    {
+        gate.set_prec(prec);
+        for (auto &expert : experts)
+        {
+            // TODO: At present, `Expert.forward` is implemented in `forward`.
+            expert.set_prec(prec);
+        }
+    }
+
+    int64_t BaseSparseMLP::get_param_num(bool effective_only) const
+    {
+        int64_t r = 0;
+        r += gate.get_param_num(effective_only);
+        r += experts[0].get_param_num(effective_only) *
+                (effective_only ? num_experts_per_tok : experts.size());
+        return r;
+    }
+
     ggml_tensor *CoreAttention::calc_attn_scores(ForwardContext *ctx, int hidden_size, const int n_past, const int qlen,
         ggml_tensor *key_layer, ggml_tensor *query_layer, ggml_tensor *value_layer)
     {
@@ -514,17 +767,47 @@ namespace chatllm
 
         before_forward(ctx, n_past, qlen);
 
-        ggml_tensor *tmpq = q_proj.forward(ctx, hidden_states);
-        ggml_tensor *tmpk = k_proj.forward(ctx, hidden_states);
-        ggml_tensor *tmpv = v_proj.forward(ctx, hidden_states);
+        ggml_tensor *tmpq = nullptr;
+        ggml_tensor *tmpk = nullptr;
+        ggml_tensor *tmpv = nullptr;
 
-        ggml_mul_mat_set_prec(tmpk, prec);
-        ggml_mul_mat_set_prec(tmpq, prec);
-        ggml_mul_mat_set_prec(tmpv, prec);
+        if (can_fuse_linears(ctx, hidden_states, {&q_proj, &k_proj, &v_proj}))
+        {
+            const int64_t nq = q_proj.out_features();
+            const int64_t nk = k_proj.out_features();
+            const int64_t nv = v_proj.out_features();
+            const int64_t n  = ggml_nrows(hidden_states);
+
+            ggml_tensor *shape = shape_only(ggml_new_tensor_1d(ggctx, GGML_TYPE_F32, (nq + nk + nv) * n));
+            ggml_tensor *input = quantized_input(ctx, hidden_states, vec_dot_type(q_proj.weight));
+            ggml_tensor *qkv = ggml_map_custom2(ggctx, shape, input ? input : hidden_states, ggml_compute_forward_qkv_mul_mat, GGML_N_TASKS_MAX, this);
+
+            // not read by the op, but keeps the weights in the graph (see `WeightStreamer::collect_layer`)
+            int i = 2;
+            for (auto p : {&q_proj, &k_proj, &v_proj})
+            {
+                qkv->src[i++] = p->weight;
+                if (p->bias) qkv->src[i++] = p->bias;
+            }
+
+            tmpq = ggml_view_2d(ggctx, qkv, nq, qlen, nq * sizeof(float), 0);
+            tmpk = ggml_view_2d(ggctx, qkv, nk, qlen, nk * sizeof(float), nq * n * sizeof(float));
+            tmpv = ggml_view_2d(ggctx, qkv, nv, qlen, nv * sizeof(float), (nq + nk) * n * sizeof(float));
+        }
+        else
+        {
+            tmpq = q_proj.forward(ctx, hidden_states);
+            tmpk = k_proj.forward(ctx, hidden_states);
+            tmpv = v_proj.forward(ctx, hidden_states);
+
+            mul_mat_set_prec(tmpk, prec);
+            mul_mat_set_prec(tmpq, prec);
+            mul_mat_set_prec(tmpv, prec);
+        }
 
         ggml_tensor *scores = cross_attention(ctx, hidden_size, n_past, qlen, tmpq, tmpk, tmpv);
 
-        ggml_tensor *attn_output = o_proj.forward(ctx, scores);
+        ggml_tensor *attn_output = row_parallel_forward(ctx, o_proj, scores);
         return attn_output;
     }
 
@@ -568,6 +851,68 @@ namespace chatllm
         return ggml_alibi(ggctx, kq, /*n_past*/ 0, num_attention_heads, max_alibi_bias);
     }
 
+    RoPETable::RoPETable(int n_dims, bool neox, float scale, const std::vector<float> &params, FreqFunc freq)
+        : n_dims(n_dims), neox(neox), scale(scale), params(params), freq(freq), filled(0)
+    {
+    }
+
+    std::shared_ptr<RoPETable> RoPETable::get(int n_dims, bool neox, float scale, const std::vector<float> &params, FreqFunc freq)
+    {
+        static std::mutex mutex;
+        static std::vector<std::weak_ptr<RoPETable>> tables;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &w : tables)
+        {
+            std::shared_ptr<RoPETable> t = w.lock();
+            if (t && (t->n_dims == n_dims) && (t->neox == neox) && (t->scale == scale) && (t->params == params))
+                return t;
+        }
+
+        std::shared_ptr<RoPETable> t(new RoPETable(n_dims, neox, scale, params, freq));
+        tables.erase(std::remove_if(tables.begin(), tables.end(), [](const std::weak_ptr<RoPETable> &w) { return w.expired(); }), tables.end());
+        tables.push_back(t);
+        return t;
+    }
+
+    void RoPETable::prepare(const ggml_tensor *pos, int n)
+    {
+        const int *p = (const int *)pos->data;
+        int end = 0;
+        for (int i = 0; i < n; i++)
+            end = std::max(end, p[i] + 1);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (end <= filled) return;
+
+        const int half = n_dims / 2;
+        std::vector<float> inv_freq(half);
+        for (int i = filled; i < end; i++)
+        {
+            const int k = std::bit_width((unsigned)(i / FIRST_CHUNK + 1)) - 1;
+            CHATLLM_CHECK(k < (int)chunks.size()) << "RoPE position " << i << " is out of range";
+            if (!chunks[k])
+                chunks[k].reset(new float[(size_t)(FIRST_CHUNK << k) * 2 * n_dims]);
+
+            freq(i, inv_freq.data());
+            float *c = const_cast<float *>(cos_row(i));
+            float *s = c + n_dims;
+            for (int j = 0; j < half; j++)
+            {
+                const float theta = (float)i * inv_freq[j];
+                const float cos_theta = cosf(theta) * scale;
+                const float sin_theta = sinf(theta) * scale;
+                const int j0 = neox ? j : 2 * j;
+                const int j1 = neox ? j + half : 2 * j + 1;
+                c[j0] = cos_theta;
+                c[j1] = cos_theta;
+                s[j0] = -sin_theta;
+                s[j1] = sin_theta;
+            }
+        }
+        filled = end;
+    }
+
     QWenSelfAttention::QWenSelfAttention(InitContext *ctx, int hidden_size, int num_attention_heads, int max_length)
         : RoPESelfAttention(ctx, hidden_size, num_attention_heads, max_length, true, false),
             seq_length(0),
@@ -586,6 +931,18 @@ namespace chatllm
         this->use_dynamic_ntk = use_dynamic_ntk;
         this->use_logn_attn = use_logn_attn;
 
+        // NTK alpha (and so the base) changes with position
+        rope_table = RoPETable::get(rope_dim, true, 1.0f, {1.0f, rope_freq_base, (float)seq_length},
+            [rope_dim, rope_freq_base, seq_length](int pos, float *inv_freq)
+            {
+                const float ntk_alpha = qwen_get_ntk_alpha(pos, seq_length);
+                const float base = rope_freq_base * powf(ntk_alpha, (float)rope_dim / ((float)rope_dim - 2.0f));
+                const float inv_freq_scale = powf(base, -2.0f / (float)rope_dim);
+                inv_freq[0] = 1.0f;
+                for (int i = 1; i < rope_dim / 2; i++)
+                    inv_freq[i] = inv_freq[i - 1] * inv_freq_scale;
+            });
+
         if (use_logn_attn)
         {
             float *p = (float *)logn_list->data;
@@ -597,13 +954,17 @@ namespace chatllm
     ggml_tensor *QWenSelfAttention::apply_pos_embedding_k(ForwardContext *ctx, ggml_tensor *k, int hidden_size, int qlen, ggml_tensor * past) const
     {
         // [qlen, heads, head_size]
-        return ggml_map_custom2(ggctx, k, past, ggml_compute_forward_ntk_dynamic_rope, GGML_N_TASKS_MAX, const_cast<QWenSelfAttention *>(this));
+        if (!ctx->reserving)
+            rope_table->prepare(past, qlen);
+        return ggml_map_custom2(ggctx, k, past, ggml_compute_forward_table_rope, GGML_N_TASKS_MAX, rope_table.get());
     }
 
     ggml_tensor *QWenSelfAttention::apply_pos_embedding_q(ForwardContext *ctx, ggml_tensor *q, int hidden_size, int qlen, ggml_tensor * past) const
     {
         // [qlen, heads, head_size];
-        ggml_tensor *r = ggml_map_custom2(ggctx, q, past, ggml_compute_forward_ntk_dynamic_rope, GGML_N_TASKS_MAX, const_cast<QWenSelfAttention *>(this));
+        if (!ctx->reserving)
+            rope_table->prepare(past, qlen);
+        ggml_tensor *r = ggml_map_custom2(ggctx, q, past, ggml_compute_forward_table_rope, GGML_N_TASKS_MAX, rope_table.get());
         if (use_logn_attn)
         {
             const int *p = (const int *)past->data;
@@ -630,6 +991,11 @@ namespace chatllm
         {
             cached_hidden_size = hidden_size;
             build_ntk_mixed_inv_freq(rope_dim, inv_freq, (int)((float)max_length / rope_scaling_factor), freq_base, rope_scaling_factor, rope_scaling_power);
+
+            std::vector<float> params{2.0f};
+            params.insert(params.end(), inv_freq.begin(), inv_freq.end());
+            rope_table = RoPETable::get(rope_dim, false, 1.0f, params,
+                [freq = inv_freq](int pos, float *out) { std::copy(freq.begin(), freq.end(), out); });
         }
     }
 
@@ -639,7 +1005,9 @@ namespace chatllm
         if (rope_scaling_power > 0.0)
         {
             const_cast<BlueLMSelfAttention *>(this)->build_inv_freq_if_needed(hidden_size);
-            return ggml_map_custom2(ggctx, k, past, ggml_compute_forward_ntk_mix_rope, GGML_N_TASKS_MAX, const_cast<BlueLMSelfAttention *>(this));
+            if (!ctx->reserving)
+                rope_table->prepare(past, qlen);
+            return ggml_map_custom2(ggctx, k, past, ggml_compute_forward_table_rope, GGML_N_TASKS_MAX, rope_table.get());
         }
         else
             return RoPESelfAttention::apply_pos_embedding_k(ctx, k, hidden_size, qlen, past);
@@ -651,7 +1019,9 @@ namespace chatllm
         if (rope_scaling_power > 0.0)
         {
             const_cast<BlueLMSelfAttention *>(this)->build_inv_freq_if_needed(hidden_size);
-            return ggml_map_custom2(ggctx, q, past, ggml_compute_forward_ntk_mix_rope, GGML_N_TASKS_MAX, const_cast<BlueLMSelfAttention *>(this));
+            if (!ctx->reserving)
+                rope_table->prepare(past, qlen);
+            return ggml_map_custom2(ggctx, q, past, ggml_compute_forward_table_rope, GGML_N_TASKS_MAX, rope_table.get());
         }
         else
             return RoPESelfAttention::apply_pos_embedding_q(ctx, q, hidden_size, qlen, past);
@@ -711,6 +1081,12 @@ namespace chatllm
         this->scaling_factor = scaling_factor;
         build_inv_freq_from_factors(this->inv_freq_short, factor_len * 2, short_factor, freq_base);
         build_inv_freq_from_factors(this->inv_freq_long,  factor_len * 2, long_factor,  freq_base);
+
+        const float *inv_freq = get_inv_freq(0);
+        std::vector<float> params{3.0f};
+        params.insert(params.end(), inv_freq, inv_freq + factor_len);
+        rope_table = RoPETable::get(factor_len * 2, false, scaling_factor, params,
+            [freq = std::vector<float>(inv_freq, inv_freq + factor_len)](int pos, float *out) { std::copy(freq.begin(), freq.end(), out); });
     }
 
     const float *Phi3SUSelfAttention::get_inv_freq(int pos)
@@ -722,11 +1098,15 @@ namespace chatllm
 
     ggml_tensor *Phi3SUSelfAttention::apply_pos_embedding_k(ForwardContext *ctx, ggml_tensor *k, int hidden_size, int qlen, ggml_tensor * past) const
     {
-        return ggml_map_custom2(ggctx, k, past, ggml_compute_forward_su_rope, GGML_N_TASKS_MAX, const_cast<Phi3SUSelfAttention *>(this));
+        if (!ctx->reserving)
+            rope_table->prepare(past, qlen);
+        return ggml_map_custom2(ggctx, k, past, ggml_compute_forward_table_rope, GGML_N_TASKS_MAX, rope_table.get());
     }
 
     ggml_tensor *Phi3SUSelfAttention::apply_pos_embedding_q(ForwardContext *ctx, ggml_tensor *q, int hidden_size, int qlen, ggml_tensor * past) const
     {
-        return ggml_map_custom2(ggctx, q, past, ggml_compute_forward_su_rope, GGML_N_TASKS_MAX, const_cast<Phi3SUSelfAttention *>(this));
+        if (!ctx->reserving)
+            rope_table->prepare(past, qlen);
+        return ggml_map_custom2(ggctx, q, past, ggml_compute_forward_table_rope, GGML_N_TASKS_MAX, rope_table.get());
     }
 }
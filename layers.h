@@ -1,11 +1,15 @@
 #pragma once
 
 #include <ggml.h>
+#include <array>
+#include <bit>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <unordered_map>
 #include <vector>
 #include <iostream>
+#include <functional>
 
 #include "chat.h"
 
@@ -99,7 +103,10 @@ namespace chatllm
     public:
         Embedding() : weight(nullptr) {}
         Embedding(InitContext *ctx, int num_embeddings, int embedding_dim)
-            : weight(ggml_new_tensor_2d(ctx->gctx.get(), ctx->dtype, embedding_dim, num_embeddings)) {}
+            : weight(ggml_new_tensor_2d(ctx->gctx.get(), ctx->dtype, embedding_dim, num_embeddings))
+        {
+            weight->flags |= ModelLoader::ANY_WEIGHT_TYPE;
+        }
 
         Embedding(InitContext *ctx, int num_embeddings, int embedding_dim, int pos_max)
             : Embedding(ctx, num_embeddings, embedding_dim) {}
@@ -130,12 +137,16 @@ namespace chatllm
     public:
         Linear() : weight(nullptr), bias(nullptr) {}
         Linear(InitContext *ctx, int in_features, int out_features, bool use_bias = true)
-            : weight(ggml_new_tensor_2d(ctx->gctx.get(), ctx->dtype, in_features, out_features)),
-              bias(use_bias ? ggml_new_tensor_1d(ctx->gctx.get(), GGML_TYPE_F32, out_features) : nullptr) {}
+            : Linear(ctx, in_features, out_features, nullptr, use_bias) {}
 
+        // a shared `weight` (such as tied embeddings) is also read by others, so it is never repacked
         Linear(InitContext *ctx, int in_features, int out_features, ggml_tensor *weight, bool use_bias = true)
             : weight(weight != NULL ? weight : ggml_new_tensor_2d(ctx->gctx.get(), ctx->dtype, in_features, out_features)),
-              bias(use_bias ? ggml_new_tensor_1d(ctx->gctx.get(), GGML_TYPE_F32, out_features) : nullptr) {}
+              bias(use_bias ? ggml_new_tensor_1d(ctx->gctx.get(), GGML_TYPE_F32, out_features) : nullptr)
+        {
+            if (weight == NULL)
+                this->weight->flags |= RepackedTensor::LINEAR_WEIGHT | ModelLoader::ANY_WEIGHT_TYPE;
+        }
 
         int in_features() const { return (int)weight->ne[0]; }
         int out_features() const { return (int)weight->ne[1]; }
@@ -155,6 +166,10 @@ namespace chatllm
         ggml_tensor *bias;   // [out_features]
     };
 
+    // `linear` takes a slice of input features on each rank (see `TensorParallel`): partial outputs are summed
+    // across ranks before the bias is added
+    ggml_tensor *row_parallel_forward(ForwardContext *ctx, Linear &linear, ggml_tensor *input);
+
     class LayerNorm : public Block
     {
     public:
@@ -172,6 +187,9 @@ namespace chatllm
         using Block::forward;
         ggml_tensor *forward(ForwardContext *ctx, ggml_tensor *input) override;
 
+        // the output as rows of `type` (the `vec_dot_type` of the next products), without an F32 round trip
+        ggml_tensor *forward_quantized(ForwardContext *ctx, ggml_tensor *input, ggml_type type);
+
         int64_t get_param_num(bool effective_only) const override
         {
             int64_t r = ggml_nelements(weight);
@@ -242,6 +260,9 @@ namespace chatllm
         using Block::forward;
         ggml_tensor *forward(ForwardContext *ctx, ggml_tensor *input) override;
 
+        // see `LayerNorm::forward_quantized`
+        ggml_tensor *forward_quantized(ForwardContext *ctx, ggml_tensor *input, ggml_type type);
+
         int64_t get_param_num(bool effective_only) const override
         {
             return ggml_nelements(weight);
@@ -441,6 +462,13 @@ namespace chatllm
               post_attention_layernorm(ctx, hidden_size),
               mlp(ctx, hidden_size, intermediate_size) {}
 
+        LMBlock1(InitContext *ctx, int hidden_size, int num_attention_heads, int intermediate_size, int num_kv_heads,
+                  int max_length, int num_local_experts, int num_experts_per_tok)
+            : input_layernorm(ctx, hidden_size),
+              attention(ctx, hidden_size, num_attention_heads, num_kv_heads, max_length),
+              post_attention_layernorm(ctx, hidden_size),
+              mlp(ctx, hidden_size, intermediate_size, num_local_experts, num_experts_per_tok) {}
+
         LMBlock1(InitContext *ctx, int hidden_size, int num_attention_heads, int intermediate_size, int num_kv_heads,
                   int head_dim, int max_length)
             : input_layernorm(ctx, hidden_size),
@@ -457,6 +485,16 @@ namespace chatllm
               post_attention_layernorm(ctx, hidden_size),
               mlp(ctx, hidden_size, mlp_intermediate_size1, mlp_intermediate_size2) {}
 
+        LMBlock1(InitContext *ctx, int hidden_size, int num_attention_heads, int intermediate_size,
+                  int mlp_intermediate_size1, int mlp_intermediate_size2,
+                  int num_kv_heads,
+                  int head_dim, int max_length,
+                  int num_local_experts, int num_experts_per_tok)
+            : input_layernorm(ctx, hidden_size),
+              attention(ctx, hidden_size, num_attention_heads, num_kv_heads, head_dim, max_length),
+              post_attention_layernorm(ctx, hidden_size),
+              mlp(ctx, hidden_size, mlp_intermediate_size1, mlp_intermediate_size2, num_local_experts, num_experts_per_tok) {}
+
 
         LMBlock1(InitContext *ctx, int hidden_size, int num_attention_heads, int intermediate_size,
                   int mlp_intermediate_size1, int mlp_intermediate_size2,
@@ -470,6 +508,19 @@ namespace chatllm
               post_attention_layernorm(ctx, hidden_size),
               mlp(ctx, hidden_size, mlp_intermediate_size1, mlp_intermediate_size2) {}
 
+        LMBlock1(InitContext *ctx, int hidden_size, int num_attention_heads, int intermediate_size,
+                  int mlp_intermediate_size1, int mlp_intermediate_size2,
+                  int num_kv_heads, int max_length,
+                  int q_lora_rank, int kv_lora_rank, int rope_dim, int qk_nope_head_dim, int v_head_dim,
+                  bool use_bias,
+                  int num_local_experts, int num_experts_per_tok)
+            : input_layernorm(ctx, hidden_size),
+              attention(ctx, hidden_size, num_attention_heads, num_kv_heads, max_length,
+                        q_lora_rank, kv_lora_rank, rope_dim, qk_nope_head_dim, v_head_dim,
+                        use_bias),
+              post_attention_layernorm(ctx, hidden_size),
+              mlp(ctx, hidden_size, mlp_intermediate_size1, mlp_intermediate_size2, num_local_experts, num_experts_per_tok) {}
+
         LMBlock1(InitContext *ctx, int hidden_size, int num_attention_heads, int intermediate_size,
                   int num_kv_heads, int max_length,
                   int q_lora_rank, int kv_lora_rank, int rope_dim, int qk_nope_head_dim, int v_head_dim,
@@ -570,6 +621,15 @@ namespace chatllm
               mlp(ctx, hidden_size, intermediate_size),
               post_mlp_layernorm(ctx, hidden_size) {}
 
+        LMBlock4(InitContext *ctx, int hidden_size, int num_attention_heads, int intermediate_size, int num_kv_heads,
+                  int max_length, int num_local_experts, int num_experts_per_tok)
+            : pre_attention_layernorm(ctx, hidden_size),
+              attention(ctx, hidden_size, num_attention_heads, num_kv_heads, max_length),
+              post_attention_layernorm(ctx, hidden_size),
+              pre_mlp_layernorm(ctx, hidden_size),
+              mlp(ctx, hidden_size, intermediate_size, num_local_experts, num_experts_per_tok),
+              post_mlp_layernorm(ctx, hidden_size) {}
+
         LMBlock4(InitContext *ctx, int hidden_size, int num_attention_heads, int intermediate_size, int num_kv_heads,
                   int head_dim, int max_length)
             : pre_attention_layernorm(ctx, hidden_size),
@@ -668,6 +728,12 @@ namespace chatllm
             : Base::LMBlock1(ctx, hidden_size, num_attention_heads, intermediate_size, num_kv_heads, max_length),
               hidden_scaling(1.0f) {}
 
+        LMBlock3(InitContext *ctx, int hidden_size, int num_attention_heads, int intermediate_size, int num_kv_heads,
+                  int max_length, int num_local_experts, int num_experts_per_tok)
+            : Base::LMBlock1(ctx, hidden_size, num_attention_heads, intermediate_size, num_kv_heads, max_length,
+                             num_local_experts, num_experts_per_tok),
+              hidden_scaling(1.0f) {}
+
         using Block::forward;
         ggml_tensor *forward(ForwardContext *ctx, ggml_tensor *hidden_states, int n_past) override
         {
@@ -893,12 +959,15 @@ namespace chatllm
         BaseAttention(InitContext *ctx, int hidden_size, int num_attention_heads, int num_kv_heads, int head_dim, int max_length,
                       bool qkv_bias, bool o_bias,
                       ggml_type cache_type, int cache_length)
-            : KVCacheAttention(ctx, num_attention_heads, num_kv_heads, head_dim * num_kv_heads, head_dim * num_kv_heads, max_length, cache_type, cache_length),
-              q_proj(ctx, hidden_size, head_dim * num_attention_heads, nullptr, qkv_bias),
-              k_proj(ctx, hidden_size, head_dim * num_kv_heads, nullptr, qkv_bias),
-              v_proj(ctx, hidden_size, head_dim * num_kv_heads, nullptr, qkv_bias),
-              o_proj(ctx, head_dim * num_attention_heads, hidden_size, o_bias)
+            : KVCacheAttention(ctx, num_attention_heads / ctx->tp_size, num_kv_heads / ctx->tp_size,
+                               head_dim * num_kv_heads / ctx->tp_size, head_dim * num_kv_heads / ctx->tp_size, max_length, cache_type, cache_length),
+              q_proj(ctx, hidden_size, head_dim * num_attention_heads / ctx->tp_size, nullptr, qkv_bias),
+              k_proj(ctx, hidden_size, head_dim * num_kv_heads / ctx->tp_size, nullptr, qkv_bias),
+              v_proj(ctx, hidden_size, head_dim * num_kv_heads / ctx->tp_size, nullptr, qkv_bias),
+              o_proj(ctx, head_dim * num_attention_heads / ctx->tp_size, hidden_size, o_bias)
         {
+            CHATLLM_CHECK((num_attention_heads % ctx->tp_size == 0) && (num_kv_heads % ctx->tp_size == 0))
+                << "heads (" << num_attention_heads << ", " << num_kv_heads << ") can't be split among " << ctx->tp_size << " ranks";
         }
 
         BaseAttention(InitContext *ctx, int hidden_size, int num_attention_heads, int num_kv_heads, int max_length,
@@ -1390,15 +1459,20 @@ namespace chatllm
     public:
         BaseMLP() = default;
         BaseMLP(InitContext *ctx, int hidden_size, int intermediate_size, ActFunc act)
-            : gate_proj(ctx, hidden_size, intermediate_size, false),
-              down_proj(ctx, intermediate_size, hidden_size, false),
-                up_proj(ctx, hidden_size, intermediate_size, false),
+            : gate_proj(ctx, hidden_size, intermediate_size / ctx->tp_size, false),
+              down_proj(ctx, intermediate_size / ctx->tp_size, hidden_size, false),
+                up_proj(ctx, hidden_size, intermediate_size / ctx->tp_size, false),
               act(act)
-        {}
+        {
+            CHATLLM_CHECK(intermediate_size % ctx->tp_size == 0)
+                << "intermediate_size (" << intermediate_size << ") can't be split among " << ctx->tp_size << " ranks";
+        }
 
         using Block::forward;
         ggml_tensor *forward(ForwardContext *ctx, ggml_tensor *hidden_states) override;
 
+        bool can_fuse(ForwardContext *ctx, ggml_tensor *input) const;
+
         int64_t get_param_num(bool effective_only) const override
         {
             int64_t r = 0;
@@ -1470,6 +1544,12 @@ namespace chatllm
                mlp2(ctx, hidden_size, intermediate_size2)
         {}
 
+        CombinedMLP(InitContext *ctx, int hidden_size, int intermediate_size1, int intermediate_size2,
+                    int num_local_experts, int num_experts_per_tok)
+            :  mlp1(ctx, hidden_size, intermediate_size1, num_local_experts, num_experts_per_tok),
+               mlp2(ctx, hidden_size, intermediate_size2)
+        {}
+
         using Block::forward;
         ggml_tensor *forward(ForwardContext *ctx, ggml_tensor *hidden_states) override
         {
@@ -1479,6 +1559,13 @@ namespace chatllm
             return r;
         }
 
+        void set_id(int id) override
+        {
+            Block::set_id(id);
+            mlp1.set_id(id);
+            mlp2.set_id(id);
+        }
+
         int64_t get_param_num(bool effective_only) const override
         {
             int64_t r = 0;
@@ -1491,107 +1578,46 @@ namespace chatllm
         MLP2 mlp2;
     };
 
-    template<class Expert, int num_local_experts, int num_experts_per_tok> class SparseMoE : public Block
+    // Mixture of experts with counts known only at runtime.
+    // Tokens routed to the same expert are gathered and multiplied in one pass over the expert's weights.
+    class BaseSparseMLP : public Block
     {
     public:
-        //typedef SiLUMLP Expert;
-        SparseMoE() = default;
-        SparseMoE(InitContext *ctx, int hidden_size, int intermediate_size)
-            : gate(ctx, hidden_size, num_local_experts, false),
-              norm_topk_prob(true)
-        {
-            for (int i = 0; i < num_local_experts; i++)
-            {
-                experts.emplace_back(Expert(ctx, hidden_size, intermediate_size));
-                expert_gates.push_back(experts[i].gate_proj.weight);
-                expert_downs.push_back(experts[i].down_proj.weight);
-                expert_ups.push_back(experts[i].up_proj.weight);
-            }
-        }
+        BaseSparseMLP(InitContext *ctx, int hidden_size, int intermediate_size, int num_local_experts, int num_experts_per_tok, ActFunc act);
 
         using Block::forward;
-        ggml_tensor *forward(ForwardContext *ctx, ggml_tensor *hidden_states) override
-        {
-            const int64_t n_tokens = hidden_states->ne[1];
-            const int n_expert = num_local_experts;
-
-            ggml_context * ggctx = ctx->gctx.get();
-
-            ggml_tensor * logits = gate.forward(ctx, hidden_states); // [n_tokens, num_experts]
-
-            ggml_tensor * probs = ggml_soft_max(ggctx, logits); // [n_tokens, num_experts]
-
-            // select experts
-            ggml_tensor * selected_experts = ggml_top_k(ggctx, probs, num_experts_per_tok); // [n_tokens, num_experts_per_tok]
-
-            ggml_tensor * weights = ggml_get_rows(ggctx,
-                    ggml_reshape_3d(ggctx, probs, 1, n_expert, n_tokens), selected_experts);
-
-            weights = ggml_reshape_2d(ggctx, weights, num_experts_per_tok, n_tokens); // [n_tokens, num_experts_per_tok]
-
-            if (norm_topk_prob)
-            {
-                ggml_tensor * weights_sum = ggml_sum_rows(ggctx, weights);
-
-                weights = ggml_div(ggctx, weights, weights_sum); // [n_tokens, num_experts_per_tok]
-            }
-
-            // compute expert outputs
-            ggml_tensor * moe_out = nullptr;
-
-            for (int i = 0; i < num_experts_per_tok; i++)
-            {
-                ggml_tensor * cur_expert;
-
-                ggml_tensor * cur_up = ggml_mul_mat_id(ggctx, expert_ups.data(), n_expert, selected_experts, i, hidden_states);
-
-                ggml_tensor * cur_gate = ggml_mul_mat_id(ggctx, expert_gates.data(), n_expert, selected_experts, i, hidden_states);
-
-                cur_gate = ggml_silu(ggctx, cur_gate);
-
-                cur_expert = ggml_mul(ggctx, cur_up, cur_gate); // [n_tokens, n_embd]
-
-                cur_expert = ggml_mul_mat_id(ggctx, expert_downs.data(), n_expert, selected_experts, i, cur_expert); // [n_tokens, n_embd]
-
-                cur_expert = ggml_mul(ggctx, cur_expert,
-                        ggml_view_2d(ggctx, weights, 1, n_tokens, weights->nb[1], i * weights->nb[0]));
+        ggml_tensor *forward(ForwardContext *ctx, ggml_tensor *hidden_states) override;
 
-                if (i == 0) {
-                    moe_out = cur_expert;
-                } else {
-                    moe_out = ggml_add(ggctx, moe_out, cur_expert);
-                }
-            }
+        void set_prec(ggml_prec prec) override;
 
-            return moe_out;
-        }
-
-        void set_prec(ggml_prec prec) override
-        {
-            gate.set_prec(prec);
-            for (auto &expert : experts)
-            {
-                // TODO: At present, `Expert.forward` is implemented in `forward`.
-                expert.set_prec(prec);
-            }
-        }
-
-        int64_t get_param_num(bool effective_only) const override
-        {
-            int64_t r = 0;
-            r += gate.get_param_num(effective_only);
-            r += experts[0].get_param_num(effective_only) *
-                    (effective_only ? num_experts_per_tok : experts.size());
-            return r;
-        }
+        int64_t get_param_num(bool effective_only) const override;
 
     public:
+        const int num_local_experts;
+        const int num_experts_per_tok;
         Linear gate;
-        std::vector<Expert> experts;
+        std::vector<BaseMLP> experts;
         std::vector<ggml_tensor *> expert_gates;
         std::vector<ggml_tensor *> expert_ups;
         std::vector<ggml_tensor *> expert_downs;
         bool norm_topk_prob;
+        const ActFunc act;
+    };
+
+    class SparseMoE : public BaseSparseMLP
+    {
+    public:
+        SparseMoE(InitContext *ctx, int hidden_size, int intermediate_size, int num_local_experts, int num_experts_per_tok)
+            : BaseSparseMLP(ctx, hidden_size, intermediate_size, num_local_experts, num_experts_per_tok, ActFunc::SILU)
+        {}
+    };
+
+    class GELUSparseMoE : public BaseSparseMLP
+    {
+    public:
+        GELUSparseMoE(InitContext *ctx, int hidden_size, int intermediate_size, int num_local_experts, int num_experts_per_tok)
+            : BaseSparseMLP(ctx, hidden_size, intermediate_size, num_local_experts, num_experts_per_tok, ActFunc::GELU)
+        {}
     };
 
     template <bool bias> class InternLMBlock : public LMBlock1<RMSNorm, InternLMSelfAttention<bias>, RMSNorm, SiLUMLP>
@@ -1923,13 +1949,13 @@ namespace chatllm
             : RoPESelfAttention<SlidingWindowAttentionImpl<sliding_window_len>>(ctx, hidden_size, num_attention_heads, num_kv_heads, max_length, false, false) {}
     };
 
-    template<int num_local_experts, int num_experts_per_tok, int sliding_window_len> class MixtralBlock : public LMBlock1<RMSNorm, MistralSelfAttention<sliding_window_len>, RMSNorm,
-                        SparseMoE<SiLUMLP, num_local_experts, num_experts_per_tok>>
+    template<int sliding_window_len> class MixtralBlock : public LMBlock1<RMSNorm, MistralSelfAttention<sliding_window_len>, RMSNorm, SparseMoE>
     {
     public:
-        MixtralBlock(InitContext *ctx, int hidden_size, int num_attention_heads, int intermediate_size, int num_kv_heads, int max_length)
-            : LMBlock1<RMSNorm, MistralSelfAttention<sliding_window_len>, RMSNorm,
-                       SparseMoE<SiLUMLP, num_local_experts, num_experts_per_tok>>(ctx, hidden_size, num_attention_heads, intermediate_size, num_kv_heads, max_length)
+        MixtralBlock(InitContext *ctx, int hidden_size, int num_attention_heads, int intermediate_size, int num_kv_heads, int max_length,
+                     int num_local_experts, int num_experts_per_tok)
+            : LMBlock1<RMSNorm, MistralSelfAttention<sliding_window_len>, RMSNorm, SparseMoE>(ctx, hidden_size, num_attention_heads, intermediate_size, num_kv_heads, max_length,
+                                                                                              num_local_experts, num_experts_per_tok)
         {}
     };
 
@@ -1967,6 +1993,48 @@ namespace chatllm
         {}
     };
 
+    // cos & sin of RoPE angles of positions [0, n), extended as positions grow, and shared by layers with equal parameters.
+    // a row holds `n_dims` cos, then `n_dims` signed sin, so that rotating is `x * cos + partner(x) * sin`,
+    // where the partner of x[i] is x[i ^ 1], or x[i +/- n_dims / 2] in the neox layout.
+    // tables are shared by models too: rows are kept in chunks that never move, so that extending a table (under a lock)
+    // doesn't disturb a model computing with rows it has prepared.
+    class RoPETable
+    {
+    public:
+        // frequencies of the `n_dims / 2` pairs at a position
+        typedef std::function<void (int pos, float *inv_freq)> FreqFunc;
+
+        // `params` identify the table, i.e. they must determine `freq`
+        static std::shared_ptr<RoPETable> get(int n_dims, bool neox, float scale, const std::vector<float> &params, FreqFunc freq);
+
+        // make positions of `pos[0..n)` available, called when building graphs to be computed
+        void prepare(const ggml_tensor *pos, int n);
+
+        // chunk i holds FIRST_CHUNK << i positions
+        const float *cos_row(int pos) const
+        {
+            const int i = std::bit_width((unsigned)(pos / FIRST_CHUNK + 1)) - 1;
+            return chunks[i].get() + (size_t)(pos - FIRST_CHUNK * ((1 << i) - 1)) * 2 * n_dims;
+        }
+        const float *sin_row(int pos) const { return cos_row(pos) + n_dims; }
+
+    public:
+        const int n_dims;
+        const bool neox;
+
+    private:
+        RoPETable(int n_dims, bool neox, float scale, const std::vector<float> &params, FreqFunc freq);
+
+        const float scale;
+        const std::vector<float> params;
+        const FreqFunc freq;
+
+        static constexpr int FIRST_CHUNK = 64;
+        std::mutex mutex;
+        int filled;
+        std::array<std::unique_ptr<float[]>, 25> chunks;
+    };
+
     class QWenSelfAttention : public RoPESelfAttention<BaseAttention>
     {
     public:
@@ -1985,6 +2053,7 @@ namespace chatllm
         bool use_logn_attn;
     protected:
         ggml_tensor *logn_list;
+        std::shared_ptr<RoPETable> rope_table;
     };
 
     class QWenBlock : public LMBlock1<RMSNorm, QWenSelfAttention, RMSNorm, SiLUMLP>
@@ -2045,6 +2114,8 @@ namespace chatllm
         std::vector<float> inv_freq;
 
     protected:
+        std::shared_ptr<RoPETable> rope_table;
+
         // input & output: [qlen, heads, head_size]
         ggml_tensor *apply_pos_embedding_k(ForwardContext *ctx, ggml_tensor *k, int hidden_size, int qlen, ggml_tensor * past) const override;
         ggml_tensor *apply_pos_embedding_q(ForwardContext *ctx, ggml_tensor *q, int hidden_size, int qlen, ggml_tensor * past) const override;
@@ -2252,6 +2323,8 @@ namespace chatllm
         const float *get_inv_freq(int pos);
 
     protected:
+        std::shared_ptr<RoPETable> rope_table;
+
         // input & output: [qlen, heads, head_size]
         ggml_tensor *apply_pos_embedding_k(ForwardContext *ctx, ggml_tensor *k, int hidden_size, int qlen, ggml_tensor * past) const override;
         ggml_tensor *apply_pos_embedding_q(ForwardContext *ctx, ggml_tensor *q, int hidden_size, int qlen, ggml_tensor * past) const override;
@@ -16,6 +16,15 @@
 #include <fcntl.h>
 #include <io.h>
 #include <windows.h>
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #endif
 
 struct Args
@@ -38,6 +47,32 @@ struct Args
     std::string layer_spec;
     std::string load_session;
     std::string save_session;
+    std::string collect_imatrix;
+    int prefault = 0;
+    chatllm::MappedFile::Advice mmap_advice = chatllm::MappedFile::Advice::Normal;
+    bool hugepage = false;
+    bool mlock = false;
+    int repack = 0;
+    std::string repack_cache;
+    std::vector<std::string> shards;
+    int stream_layers = 0;
+    bool expert_stats = false;
+    float pin_hot_experts = 0.0f;
+    std::string thread_affinity = "none";
+    int thread_spin_us = 100;
+    std::string numa = "none";
+    int threads_prefill = 0;
+    int threads_decode = 0;
+    std::string threads_tune_cache;
+    int tp_rank = 0;
+    int tp_size = 1;
+    std::string tp_transport;
+    bool show_ttft = false;
+    std::string startup_report;
+    chatllm::StartupProfiler *profiler = nullptr;
+    std::string serve;
+    int workers = 2;
+    int health_port = 0;
     int max_length = -1;
     int max_context_length = 512;
     bool interactive = false;
@@ -70,6 +105,25 @@ struct Args
 
 bool has_extending = false;
 
+static chatllm::MappedFile::Advice parse_mmap_advice(const std::string &s)
+{
+    if (s == "normal")
+        return chatllm::MappedFile::Advice::Normal;
+    else if (s == "willneed")
+        return chatllm::MappedFile::Advice::WillNeed;
+    else if (s == "random")
+        return chatllm::MappedFile::Advice::Random;
+    else if (s == "sequential")
+        return chatllm::MappedFile::Advice::Sequential;
+    CHATLLM_THROW << "unknown mmap advice: " << s;
+    return chatllm::MappedFile::Advice::Normal;
+}
+
+static int parse_threads(const std::string &s)
+{
+    return s == "auto" ? -1 : std::stoi(s);
+}
+
 static chatllm::Pipeline::ExtendingMethod parse_extending_method(const std::string &s)
 {
     has_extending = true;
@@ -88,6 +142,8 @@ void usage(const std::string &prog)
               << "Basic options:\n"
               << "  -h, --help              show this help message and exit\n"
               << "  -m, --model PATH        model path\n"
+              << "      --shard PATH        load tensors from another file (chatllm, safetensors or GGUF); tensors found in\n"
+              << "                          shards take precedence over those in the model file (can be specified multiple times)\n"
               << "  -p, --prompt PROMPT     prompt to start generation with (default: 你好)\n"
               << "  -s, --system SYSTEM     system prompt (instruction) (default: model specific)\n"
               << "      --sys_file FN       system prompt (instruction) from file\n"
@@ -102,7 +158,20 @@ void usage(const std::string &prog)
               << "                          `step` is optional, e.g.\n"
               << "                            --layer_spec 0:3,1:4 (3 + 3 = 6 layers are selected, layer #1/2 are used twice)\n"
               << "                                                 layer structure: 0->1->2->1->2->3\n"
-              << "  -n, --threads N         number of threads for inference (default: number of cores)\n"
+              << "  -n, --threads N         number of threads for inference (default: number of physical cores)\n"
+              << "  --threads_prefill N     number of threads for prompt evaluation (default: same as --threads)\n"
+              << "  --threads_decode N      number of threads for generating tokens (default: same as --threads)\n"
+              << "                          with N = auto, counts up to --threads are measured on first use and the fastest\n"
+              << "                          is kept for this model & host\n"
+              << "  --threads_tune_cache FILE\n"
+              << "                          file keeping tuned thread counts (default: MODEL.threads, `-` to disable)\n"
+              << "  --thread_affinity SPEC  pin inference threads: none, cores (one thread per physical core), or a list of\n"
+              << "                          CPUs like 0-7,16 (default: none)\n"
+              << "  --thread_spin_us N      idle inference threads busy-wait N us for the next graph before sleeping\n"
+              << "                          (default: 100)\n"
+              << "  --numa MODE             on NUMA systems (MODE = none | distribute | interleave): distribute splits rows\n"
+              << "                          of each weight and inference threads among nodes, so that threads read local\n"
+              << "                          weights; interleave spreads weight pages round-robin (default: none)\n"
               << "  -c, --max_context_length N\n"
               << "                          max context length (default: 512)\n"
               << "  --extending EXT         context extending method (EXT = restart | shift | none)\n"
@@ -148,6 +217,41 @@ void usage(const std::string &prog)
               << "  --rag_post_extending N  extend selected items with pre & post N chunks with same metadata. (default: 0)\n"
               << "                          this may be useful when context length of embedding/reranker models is limited.\n"
               << "   +rag_dump              (debug) dump retrieved/re-ranking results\n"
+              << "Memory:\n"
+              << "  --prefault N            touch all weights with N threads after loading, so that the first generation\n"
+              << "                          does not page-fault through the model (default: 0, disabled)\n"
+              << "  --mmap_advice ADV       page cache hint for weights (ADV = normal | willneed | random | sequential)\n"
+              << "                          willneed: start reading ahead asynchronously; random: disable read-ahead,\n"
+              << "                          useful when the model is larger than RAM (default: normal)\n"
+              << "  --hugepage              ask for transparent huge pages for the mapped model, where supported\n"
+              << "  --mlock                 lock the model in memory, so that it is never swapped or evicted\n"
+              << "  --repack N              repack Q4_0/Q8_0 weights for the CPU GEMV kernel with N threads when loading\n"
+              << "                          (default: 0, disabled)\n"
+              << "  --repack_cache FILE     file caching repacked weights, so that repacking is done only once\n"
+              << "                          (default: MODEL.repack, `-` to disable)\n"
+              << "  --stream_layers N       for models larger than RAM: evaluate layer by layer, prefetching weights of the\n"
+              << "                          next N layers and releasing those of finished ones (default: 0, disabled)\n"
+              << "  --expert_stats          count how often each expert of MoE layers is selected, shown with timings\n"
+              << "  --pin_hot_experts R     keep the most selected experts of each MoE layer, which receive R (0..1) of its\n"
+              << "                          selections, locked in memory and release the others (default: 0, disabled)\n"
+              << "  --tp_size N             tensor parallelism: split attention heads and MLP features among N processes\n"
+              << "                          (ranks), which are run with the same arguments except --tp_rank (default: 1)\n"
+              << "  --tp_rank R             rank of this process, 0..N-1 (default: 0)\n"
+              << "  --tp_transport T        shm:NAME (ranks on this host) or tcp:HOST:PORT (rank 0 listens on HOST:PORT)\n"
+              << "                          (default: shm named after the model file and N; name it explicitly to run\n"
+              << "                          several groups of the same model on one host)\n"
+              << "  --show_ttft             show model loading time and time-to-first-token\n"
+              << "  --startup_report FILE   write timings, page faults and RSS growth of each startup phase up to the\n"
+              << "                          first generation (or, with --serve, up to loading) to FILE as JSON (`-` for stdout)\n"
+              << "Server:\n"
+              << "  --serve [HOST:]PORT     load the model once, then serve requests with pre-forked workers sharing the\n"
+              << "                          mapped weights. A request is a line of UTF-8 text (the prompt), the response\n"
+              << "                          is the streamed output; the line `/health` returns workers' status and memory\n"
+              << "                          usage as JSON. (default host: 127.0.0.1)\n"
+              << "  --workers N             number of worker processes (default: 2)\n"
+              << "  --health_port N         port on HOST where the server process itself answers every connection with\n"
+              << "                          the `/health` JSON, also when all workers are busy (default: PORT + 1,\n"
+              << "                          -1 to disable)\n"
               << "Session:\n"
               << "  --save_session N FILE   save session to FILE after N round(s) of chatting (N >= 0) and quit\n"
               << "                          when N = 0, system prompt is evaluated.\n"
@@ -157,6 +261,8 @@ void usage(const std::string &prog)
               << "  --merge_vs FILE         merge multiple vector store files into a single one\n"
               << "  --tokenize              (debug) tokenize `prompt` and exit\n"
               << "  --test FILE             test against inputs from a file and exit\n"
+              << "  --collect_imatrix FILE  evaluate calibration text (from `--test FILE`, or `prompt`) and\n"
+              << "                          save the importance matrix to FILE for `quantize --imatrix`\n"
               << "  --hide_banner           hide banner\n"
               << "  --show                  show model info and quit\n"
               << "Additional key-value args:\n"
@@ -243,6 +349,22 @@ static size_t parse_args(Args &args, const std::vector<std::string> &argv)
             {
                 args.show = true;
             }
+            else if (strcmp(arg, "--hugepage") == 0)
+            {
+                args.hugepage = true;
+            }
+            else if (strcmp(arg, "--mlock") == 0)
+            {
+                args.mlock = true;
+            }
+            else if (strcmp(arg, "--expert_stats") == 0)
+            {
+                args.expert_stats = true;
+            }
+            else if (strcmp(arg, "--show_ttft") == 0)
+            {
+                args.show_ttft = true;
+            }
             else if (strcmp(arg, "+rag_dump") == 0)
             {
                 args.rag_dump = true;
@@ -304,6 +426,7 @@ static size_t parse_args(Args &args, const std::vector<std::string> &argv)
             handle_para0("--seed",                        seed,                 std::stoi)
             handle_para0("--test",                        test_fn,              std::string)
             append_param("--vector_store",                vector_store,         std::string)
+            append_param("--shard",                       shards,               std::string)
             handle_para0("--embedding_model",             embedding_model_path, std::string)
             handle_para0("--distance_strategy",           vc,                   ParseDistanceStrategy)
             handle_para0("--retrieve_top_n",              retrieve_top_n,       std::stoi)
@@ -318,6 +441,26 @@ static size_t parse_args(Args &args, const std::vector<std::string> &argv)
             handle_para0("--merge_vs",                    merge_vs,             std::string)
             handle_para0("--layer_spec",                  layer_spec,           std::string)
             handle_para0("--load_session",                load_session,         std::string)
+            handle_para0("--collect_imatrix",             collect_imatrix,      std::string)
+            handle_para0("--prefault",                    prefault,             std::stoi)
+            handle_para0("--mmap_advice",                 mmap_advice,          parse_mmap_advice)
+            handle_para0("--repack",                      repack,               std::stoi)
+            handle_para0("--repack_cache",                repack_cache,         std::string)
+            handle_para0("--stream_layers",               stream_layers,        std::stoi)
+            handle_para0("--pin_hot_experts",             pin_hot_experts,      std::stof)
+            handle_para0("--thread_affinity",             thread_affinity,      std::string)
+            handle_para0("--thread_spin_us",              thread_spin_us,       std::stoi)
+            handle_para0("--numa",                        numa,                 std::string)
+            handle_para0("--threads_prefill",             threads_prefill,      parse_threads)
+            handle_para0("--threads_decode",              threads_decode,       parse_threads)
+            handle_para0("--threads_tune_cache",          threads_tune_cache,   std::string)
+            handle_para0("--tp_rank",                     tp_rank,              std::stoi)
+            handle_para0("--tp_size",                     tp_size,              std::stoi)
+            handle_para0("--tp_transport",                tp_transport,         std::string)
+            handle_para0("--startup_report",              startup_report,       std::string)
+            handle_para0("--serve",                       serve,                std::string)
+            handle_para0("--workers",                     workers,              std::stoi)
+            handle_para0("--health_port",                 health_port,          std::stoi)
             else
                 break;
 
@@ -417,6 +560,10 @@ static bool get_utf8_line(std::string &line, bool multi_line)
 
 static inline int get_num_physical_cores()
 {
+    int n_cores = (int)chatllm::ComputePool::physical_cores().size();
+    if (n_cores > 0)
+        return n_cores;
+
     unsigned int n_threads = std::thread::hardware_concurrency();
     return n_threads > 0 ? (n_threads <= 4 ? n_threads : n_threads / 2) : 4;
 }
@@ -475,6 +622,87 @@ static void show_stat(chatllm::Pipeline &pipeline, chatllm::BaseStreamer &stream
         (perf->timings[chatllm::ModelPerfInfo::Type::Generation].duration_ms + perf->timings[chatllm::ModelPerfInfo::Type::Prompt].duration_ms),
         perf->timings[chatllm::ModelPerfInfo::Type::Generation].tok_count    + perf->timings[chatllm::ModelPerfInfo::Type::Prompt].tok_count);
     streamer.putln(str);
+
+    const chatllm::ExpertStats *stats = pipeline.get_model_object().expert_stats.get();
+    if (stats)
+    {
+        for (auto &line : stats->summary())
+            streamer.putln("experts: " + line);
+        if (stats->get_pinned_bytes() > 0)
+        {
+            sprintf(str, "experts: pinned = %.1f MiB", stats->get_pinned_bytes() / 1024.0 / 1024.0);
+            streamer.putln(str);
+        }
+    }
+
+    const chatllm::ThreadTuner *tuner = pipeline.get_model_object().thread_tuner.get();
+    if (tuner && ((tuner->get_best(chatllm::ThreadTuner::Phase::Prefill) > 0) || (tuner->get_best(chatllm::ThreadTuner::Phase::Decode) > 0)))
+    {
+        sprintf(str, "threads: prefill = %d, decode = %d (tuned, 0: not yet)",
+            tuner->get_best(chatllm::ThreadTuner::Phase::Prefill), tuner->get_best(chatllm::ThreadTuner::Phase::Decode));
+        streamer.putln(str);
+    }
+}
+
+static void show_ttft(chatllm::Pipeline &pipeline, chatllm::BaseStreamer &streamer)
+{
+    const chatllm::ModelObject &obj = pipeline.get_model_object();
+    const double prompt_ms = pipeline.performance.timings[chatllm::ModelPerfInfo::Type::Prompt].duration_ms;
+    char str[1024];
+
+    if (obj.resident_before_load >= 0)
+        sprintf(str,  "timings:       model load = %12.2f ms (%.1f%% of file in page cache before loading)", obj.load_ms, obj.resident_before_load * 100);
+    else
+        sprintf(str,  "timings:       model load = %12.2f ms", obj.load_ms);
+    streamer.putln(str);
+
+    sprintf(str,      "timings:   1st token time = %12.2f ms (model load + prompt eval)", obj.load_ms + prompt_ms);
+    streamer.putln(str);
+}
+
+static void save_startup_report(const Args &args)
+{
+    if (args.startup_report == "-")
+    {
+        std::cout << args.profiler->to_json() << std::flush;
+        return;
+    }
+
+    std::ofstream f(args.startup_report);
+    if (f.is_open())
+        f << args.profiler->to_json();
+    else
+        std::cerr << "failed to write startup report to " << args.startup_report << std::endl;
+}
+
+static void write_startup_report(Args &args, chatllm::Pipeline &pipeline)
+{
+    const chatllm::ModelObject &obj = pipeline.get_model_object();
+    const chatllm::ModelPerfInfo::Performance &prompt = pipeline.performance.timings[chatllm::ModelPerfInfo::Type::Prompt];
+
+    args.profiler->set_value("prompt_tokens", (double)prompt.tok_count);
+    args.profiler->set_value("prompt_eval_ms", prompt.duration_ms);
+    if (obj.loader)
+        args.profiler->set_value("resident_after_first_generate", obj.loader->get_mapped_file()->resident_ratio());
+
+    save_startup_report(args);
+}
+
+// the first generation completes the startup report
+static std::string chat_round(Args &args, chatllm::Pipeline &pipeline, std::vector<std::string> &history,
+                              const chatllm::GenerationConfig &gen_config, TextStreamer &streamer)
+{
+    if (nullptr == args.profiler)
+        return pipeline.chat(history, gen_config, &streamer);
+
+    std::string output;
+    {
+        chatllm::StartupProfiler::Scope phase(args.profiler, "first_generate");
+        output = pipeline.chat(history, gen_config, &streamer);
+    }
+    write_startup_report(args, pipeline);
+    args.profiler = nullptr;
+    return output;
 }
 
 static void run_file(Args &args, chatllm::Pipeline &pipeline, TextStreamer &streamer, const chatllm::GenerationConfig &gen_config)
@@ -492,7 +720,7 @@ static void run_file(Args &args, chatllm::Pipeline &pipeline, TextStreamer &stre
             history.emplace_back(std::move(input));
 
             streamer.cout << "A.I. > " << std::flush;
-            std::string output = pipeline.chat(history, gen_config, &streamer);
+            std::string output = chat_round(args, pipeline, history, gen_config, streamer);
             history.emplace_back(std::move(output));
         }
     }
@@ -608,16 +836,21 @@ static void run_qa_ranker(Args &args, chatllm::Pipeline &pipeline, TextStreamer
 }
 
 #define DEF_GenerationConfig(gen_config, args) chatllm::GenerationConfig gen_config(args.max_length, args.max_context_length, args.temp > 0, args.top_k,    \
-                                         args.top_p, args.temp, args.num_threads, args.sampling, args.presence_penalty, args.tfs_z)
+                                         args.top_p, args.temp, args.num_threads, args.sampling, args.presence_penalty, args.tfs_z); \
+                                         gen_config.num_threads_prefill = args.threads_prefill;                                          \
+                                         gen_config.num_threads_decode  = args.threads_decode
 
 void chat(Args &args, chatllm::Pipeline &pipeline, TextStreamer &streamer)
 {
     if (args.system.size() > 0)
         pipeline.set_system_prompt(args.system);
 
+    chatllm::TensorParallel *tp = pipeline.is_loaded() ? pipeline.get_model_object().tensor_parallel.get() : nullptr;
+
     if (pipeline.is_loaded())
     {
-        pipeline.model->seed(args.seed);
+        // ranks sample the same tokens
+        pipeline.model->seed(tp ? tp->broadcast(args.seed) : args.seed);
         args.max_length = pipeline.model->get_max_length();
 
         pipeline.set_extending_method(args.extending);
@@ -625,16 +858,6 @@ void chat(Args &args, chatllm::Pipeline &pipeline, TextStreamer &streamer)
         pipeline.tokenizer->set_chat_format(args.format);
     }
 
-    if (args.tokenize)
-    {
-        auto ids = pipeline.tokenizer->encode(args.prompt);
-        streamer.cout << "ID: ";
-        for (auto x : ids)
-            streamer.cout << x << ", ";
-        streamer.cout << std::endl;
-        return;
-    }
-
     pipeline.set_additional_args(args.additional);
 
     const std::string ai_prompt   = "A.I.";
@@ -670,8 +893,10 @@ void chat(Args &args, chatllm::Pipeline &pipeline, TextStreamer &streamer)
     if (!args.interactive)
     {
         history.push_back(args.prompt);
-        pipeline.chat(history, gen_config, &streamer);
+        chat_round(args, pipeline, history, gen_config, streamer);
         show_stat(pipeline, streamer);
+        if (args.show_ttft)
+            show_ttft(pipeline, streamer);
         return;
     }
 
@@ -713,7 +938,20 @@ void chat(Args &args, chatllm::Pipeline &pipeline, TextStreamer &streamer)
 
         streamer.cout << std::setw(prompt_len) << std::left << user_prompt << " > " << std::flush;
         std::string input;
-        if (!get_utf8_line(input, args.multi_line))
+        bool got_line = (tp && (tp->rank > 0)) || get_utf8_line(input, args.multi_line);
+
+        // only rank 0 reads the input, others take its line (bytes, or -1 when failed)
+        if (tp)
+        {
+            std::vector<int> bytes{-1};
+            if (got_line)
+                bytes.assign((const unsigned char *)input.data(), (const unsigned char *)input.data() + input.size());
+            bytes = tp->broadcast(bytes);
+            got_line = (bytes.size() != 1) || (bytes[0] >= 0);
+            input.assign(bytes.begin(), bytes.end());
+        }
+
+        if (!got_line)
         {
             streamer.cout << "FAILED to read line." << std::endl;
             break;
@@ -722,7 +960,7 @@ void chat(Args &args, chatllm::Pipeline &pipeline, TextStreamer &streamer)
 
         history.emplace_back(std::move(input));
         streamer.cout << std::setw(prompt_len) << std::left << ai_prompt << " > " << std::flush;
-        std::string output = pipeline.chat(history, gen_config, &streamer);
+        std::string output = chat_round(args, pipeline, history, gen_config, streamer);
         history.emplace_back(std::move(output));
     }
     streamer.cout << "Bye\n";
@@ -805,6 +1043,370 @@ static int init_vector_store(Args &args)
     return 0;
 }
 
+static int tokenize(Args &args)
+{
+    chatllm::TokenizerObject tok(args.model_path, chatllm::ModelObject::extra_args(args.max_length, args.layer_spec));
+    auto ids = tok.tokenizer->encode(args.prompt);
+    std::cout << "ID: ";
+    for (auto x : ids)
+        std::cout << x << ", ";
+    std::cout << std::endl;
+    return 0;
+}
+
+static int collect_imatrix(Args &args)
+{
+    chatllm::Pipeline pipeline(args.model_path, chatllm::ModelObject::extra_args(args.max_length, args.layer_spec));
+    args.max_length = pipeline.model->get_max_length();
+
+    DEF_GenerationConfig(gen_config, args);
+
+    std::string text = args.test_fn.size() > 0 ? load_txt(args.test_fn) : args.prompt;
+    std::vector<int> ids = pipeline.tokenizer->encode(text);
+    CHATLLM_CHECK(ids.size() > 0) << "calibration text is empty";
+
+    const size_t chunk = std::max(1, std::min(args.max_context_length, args.max_length - 2));
+
+    chatllm::ImatrixCollector collector;
+    pipeline.model->set_imatrix_collector(&collector);
+
+    for (size_t i = 0; i < ids.size(); i += chunk)
+    {
+        std::vector<int> input(ids.begin() + i, ids.begin() + std::min(ids.size(), i + chunk));
+        bool completed = false;
+        pipeline.model->generate(input, gen_config, false, completed, nullptr, 1);
+        printf("\rprocessed %zu/%zu tokens", i + input.size(), ids.size());
+        fflush(stdout);
+    }
+
+    pipeline.model->set_imatrix_collector(nullptr);
+    collector.save(args.collect_imatrix);
+    printf("\nimatrix of %zu tensors saved to: %s\n", collector.size(), args.collect_imatrix.c_str());
+    return 0;
+}
+
+#if !defined(_WIN32)
+
+// status of workers, in memory shared between the server and workers
+struct WorkerStatus
+{
+    pid_t pid;
+    int busy;
+    int64_t requests;
+    int64_t last_active;        // unix time
+};
+
+class SocketStreamer : public chatllm::BaseStreamer
+{
+public:
+    SocketStreamer(chatllm::BaseTokenizer *tokenizer, int fd) :
+        BaseStreamer(tokenizer), fd(fd) {}
+
+    void put_chunk(bool first, const std::string &chunk) override
+    {
+        write_all(chunk);
+    }
+
+    void putln(const std::string &line, TextType type = TextType::META) override
+    {
+        switch (type)
+        {
+        case TextType::ERR:
+            write_all("ERROR: " + line + "\n");
+            break;
+        case TextType::HISTORY_USER:
+        case TextType::HISTORY_AI:
+            break;
+        default:
+            write_all(line + "\n");
+            break;
+        }
+    }
+
+    void write_all(const std::string &s)
+    {
+        size_t written = 0;
+        while (written < s.size())
+        {
+            ssize_t n = send(fd, s.data() + written, s.size() - written, MSG_NOSIGNAL);
+            if (n <= 0) return;
+            written += n;
+        }
+    }
+
+private:
+    int fd;
+};
+
+// in KiB, from /proc/<pid>/smaps_rollup: Pss & Private_* tell the real cost of a worker,
+// since mapped weights are shared
+static std::map<std::string, int64_t> read_mem_info(pid_t pid)
+{
+    std::map<std::string, int64_t> r;
+    std::ifstream f("/proc/" + std::to_string(pid) + "/smaps_rollup");
+    std::string key;
+    int64_t value;
+    std::string unit;
+
+    while (f >> key)
+    {
+        if (key.back() != ':')
+        {
+            std::getline(f, unit);
+            continue;
+        }
+        f >> value >> unit;
+        key.pop_back();
+        r[key] = value;
+    }
+    return r;
+}
+
+static std::string health_report(const WorkerStatus *workers, int n, pid_t server)
+{
+    std::ostringstream oss;
+    auto mem_json = [&oss](pid_t pid)
+    {
+        auto mem = read_mem_info(pid);
+        oss << "\"rss_kb\": " << mem["Rss"] << ", \"pss_kb\": " << mem["Pss"]
+            << ", \"shared_kb\": " << mem["Shared_Clean"] + mem["Shared_Dirty"]
+            << ", \"private_kb\": " << mem["Private_Clean"] + mem["Private_Dirty"];
+    };
+
+    oss << "{\"server\": {\"pid\": " << server << ", ";
+    mem_json(server);
+    oss << "}, \"workers\": [";
+    for (int i = 0; i < n; i++)
+    {
+        oss << (i > 0 ? ", " : "") << "{\"pid\": " << workers[i].pid << ", \"busy\": " << (workers[i].busy ? "true" : "false")
+            << ", \"requests\": " << workers[i].requests << ", \"last_active\": " << workers[i].last_active << ", ";
+        mem_json(workers[i].pid);
+        oss << "}";
+    }
+    oss << "]}\n";
+    return oss.str();
+}
+
+// a client must send its request line within this time, and it can't be longer than this size
+static const int    REQUEST_TIMEOUT_SEC = 10;
+static const size_t MAX_REQUEST_SIZE    = 1 << 20;
+
+static void serve_worker(Args &args, chatllm::Pipeline &pipeline, int listen_fd, WorkerStatus *workers, int slot)
+{
+    DEF_GenerationConfig(gen_config, args);
+    WorkerStatus &status = workers[slot];
+
+    chatllm::ComputePool *pool = pipeline.get_model_object().compute_pool.get();
+    if (pool)
+        pool->partition(slot, std::max(1, args.workers));
+
+    // thread counts are tuned by the first worker only, the others pick them up from the cache
+    chatllm::ThreadTuner *tuner = pipeline.get_model_object().thread_tuner.get();
+    if (tuner && (slot > 0))
+        tuner->follow();
+
+    timeval timeout;
+    timeout.tv_sec  = REQUEST_TIMEOUT_SEC;
+    timeout.tv_usec = 0;
+
+    while (true)
+    {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0)
+        {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        std::string input;
+        char buf[4096];
+        while ((input.find('\n') == std::string::npos) && (input.size() <= MAX_REQUEST_SIZE))
+        {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0) break;
+            input.append(buf, n);
+        }
+
+        // timed out, too long, or closed before the line is complete
+        if (input.find('\n') == std::string::npos)
+        {
+            close(fd);
+            continue;
+        }
+
+        input = input.substr(0, input.find('\n'));
+        if ((input.size() > 0) && (input.back() == '\r')) input.pop_back();
+
+        SocketStreamer streamer(pipeline.tokenizer, fd);
+        if (input == "/health")
+        {
+            streamer.write_all(health_report(workers, args.workers, getppid()));
+        }
+        else if (input.size() > 0)
+        {
+            status.busy = 1;
+            std::vector<std::string> history({input});
+            pipeline.restart();
+            pipeline.chat(history, gen_config, &streamer);
+            status.busy = 0;
+            status.requests++;
+        }
+
+        status.last_active = time(nullptr);
+        close(fd);
+    }
+}
+
+static volatile sig_atomic_t server_stopping = 0;
+
+static void on_server_signal(int)
+{
+    server_stopping = 1;
+}
+
+static int listen_on(const std::string &host, int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    CHATLLM_CHECK(fd >= 0) << "socket: " << strerror(errno);
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    CHATLLM_CHECK(inet_pton(AF_INET, host.c_str(), &addr.sin_addr) == 1) << "invalid host: " << host;
+    CHATLLM_CHECK(bind(fd, (sockaddr *)&addr, sizeof(addr)) == 0) << "bind " << host << ":" << port << ": " << strerror(errno);
+    CHATLLM_CHECK(listen(fd, 64) == 0) << "listen: " << strerror(errno);
+    return fd;
+}
+
+static int serve(Args &args, const chatllm::ModelObject::extra_args &pipe_args)
+{
+    std::string host = "127.0.0.1";
+    std::string port = args.serve;
+    size_t pos = args.serve.find_last_of(':');
+    if (pos != std::string::npos)
+    {
+        host = args.serve.substr(0, pos);
+        port = args.serve.substr(pos + 1);
+    }
+    const int n = std::max(1, args.workers);
+
+    // workers inherit the mapped weights copy-on-write; per-worker buffers are only touched (and thus
+    // allocated) by workers
+    chatllm::Pipeline pipeline(args.model_path, pipe_args);
+    if (args.system.size() > 0)
+        pipeline.set_system_prompt(args.system);
+    pipeline.model->seed(args.seed);
+    args.max_length = pipeline.model->get_max_length();
+    pipeline.set_extending_method(args.extending);
+    pipeline.tokenizer->set_chat_format(args.format);
+    pipeline.set_additional_args(args.additional);
+
+    // no generation is part of a server's startup: the report ends once the model is loaded
+    if (args.profiler)
+    {
+        save_startup_report(args);
+        args.profiler = nullptr;
+    }
+
+    int listen_fd = listen_on(host, std::stoi(port));
+
+    // answered by this process, which is never busy
+    const int health_port = args.health_port != 0 ? args.health_port : std::stoi(port) + 1;
+    int health_fd = health_port > 0 ? listen_on(host, health_port) : -1;
+
+    WorkerStatus *workers = (WorkerStatus *)mmap(nullptr, sizeof(WorkerStatus) * n, PROT_READ | PROT_WRITE,
+                                                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    CHATLLM_CHECK(workers != MAP_FAILED) << "mmap: " << strerror(errno);
+    memset(workers, 0, sizeof(WorkerStatus) * n);
+
+    auto spawn = [&](int slot)
+    {
+        pid_t pid = fork();
+        CHATLLM_CHECK(pid >= 0) << "fork: " << strerror(errno);
+        if (pid == 0)
+        {
+            signal(SIGINT, SIG_DFL);
+            signal(SIGTERM, SIG_DFL);
+            if (health_fd >= 0) close(health_fd);
+            workers[slot].pid = getpid();
+            serve_worker(args, pipeline, listen_fd, workers, slot);
+            _exit(0);
+        }
+        workers[slot].pid = pid;
+        workers[slot].busy = 0;
+    };
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_server_signal;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+
+    for (int i = 0; i < n; i++)
+        spawn(i);
+
+    printf("serving on %s:%s with %d workers\n", host.c_str(), port.c_str(), n);
+    if (health_fd >= 0)
+        printf("health on %s:%d\n", host.c_str(), health_port);
+    fflush(stdout);
+
+    // answer health checks and restart workers that died, until stopped
+    while (!server_stopping)
+    {
+        pollfd pfd = {health_fd, POLLIN, 0};
+        if (health_fd < 0)
+            sleep(1);
+        else if (poll(&pfd, 1, 1000) > 0)
+        {
+            int fd = accept(health_fd, nullptr, nullptr);
+            if (fd >= 0)
+            {
+                std::string report = health_report(workers, n, getpid());
+                send(fd, report.data(), report.size(), MSG_NOSIGNAL);
+                close(fd);
+            }
+        }
+
+        int wstatus = 0;
+        pid_t pid;
+        while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                if ((workers[i].pid == pid) && !server_stopping)
+                {
+                    fprintf(stderr, "worker %d exited (status %d), restarting\n", (int)pid, wstatus);
+                    spawn(i);
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < n; i++)
+        kill(workers[i].pid, SIGTERM);
+    while (waitpid(-1, nullptr, 0) > 0);
+
+    close(listen_fd);
+    if (health_fd >= 0) close(health_fd);
+    munmap(workers, sizeof(WorkerStatus) * n);
+    return 0;
+}
+
+#else
+
+static int serve(Args &args, const chatllm::ModelObject::extra_args &pipe_args)
+{
+    CHATLLM_THROW << "--serve is not supported on this platform";
+    return 1;
+}
+
+#endif
+
 static int merge_vector_store(Args &args)
 {
     CVectorStore vs(args.vc, args.vector_store);
@@ -813,6 +1415,9 @@ static int merge_vector_store(Args &args)
     return 0;
 }
 
+// constructed before `main`, so that phases are timed from process start
+static chatllm::StartupProfiler startup_profiler;
+
 #if defined(_WIN32)
 int wmain(int argc, const wchar_t **wargv)
 {
@@ -854,6 +1459,13 @@ int main(int argc, const char **argv)
         exit(EXIT_FAILURE);
     }
 
+    // forked workers would share the transport of ranks, running their all-reduces into each other's
+    if ((args.serve.size() > 0) && (args.tp_size > 1))
+    {
+        std::cerr << "--serve can't be used with --tp_size > 1" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
     if (args.num_threads <= 0)
         args.num_threads = get_num_physical_cores();
 
@@ -872,7 +1484,44 @@ int main(int argc, const char **argv)
 
     try
     {
+        if (args.tokenize)
+            return tokenize(args);
+
+        if (args.collect_imatrix.size() > 0)
+            return collect_imatrix(args);
+
         chatllm::ModelObject::extra_args pipe_args(args.max_length, args.layer_spec);
+        pipe_args.prefault_threads  = args.prefault;
+        pipe_args.mmap_advice       = args.mmap_advice;
+        pipe_args.hugepage          = args.hugepage;
+        pipe_args.mlock             = args.mlock;
+        pipe_args.repack_threads    = args.repack;
+        pipe_args.repack_cache      = args.repack_cache.size() > 0 ? args.repack_cache : args.model_path + ".repack";
+        if (pipe_args.repack_cache == "-")
+            pipe_args.repack_cache = "";
+        pipe_args.stream_layers     = args.stream_layers;
+        pipe_args.expert_stats      = args.expert_stats;
+        pipe_args.pin_hot_experts   = args.pin_hot_experts;
+        pipe_args.thread_affinity   = args.thread_affinity;
+        pipe_args.thread_spin_us    = args.thread_spin_us;
+        pipe_args.numa              = args.numa;
+        pipe_args.thread_tune_cache = args.threads_tune_cache.size() > 0 ? args.threads_tune_cache : args.model_path + ".threads";
+        if (pipe_args.thread_tune_cache == "-")
+            pipe_args.thread_tune_cache = "";
+        pipe_args.tp_rank           = args.tp_rank;
+        pipe_args.tp_size           = args.tp_size;
+        pipe_args.tp_transport      = args.tp_transport;
+        pipe_args.shards            = args.shards;
+
+        if (args.startup_report.size() > 0)
+        {
+            args.profiler       = &startup_profiler;
+            pipe_args.profiler  = args.profiler;
+        }
+
+        if (args.serve.size() > 0)
+            return serve(args, pipe_args);
+
         if (args.embedding_model_path.size() < 1)
         {
             chatllm::Pipeline pipeline(args.model_path, pipe_args);
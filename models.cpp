@@ -17,6 +17,9 @@
 
 #include "layers.h"
 
+#include <ggml-alloc.h>
+#include <ggml-backend.h>
+
 #ifdef GGML_USE_CLBLAST
 #include "ggml-opencl.h"
 #endif
@@ -24,6 +27,7 @@
 namespace chatllm
 {
     ForwardContext *dbg_ctx = nullptr;
+    const std::vector<int> *dbg_input_ids = nullptr;
 
     void print_tensor(ggml_tensor *tensor, int offset = 0)
     {
@@ -60,8 +64,23 @@ namespace chatllm
     void inspect_tensor(ggml_tensor *tensor, const char *msg, ggml_tensor *temp1, ggml_tensor *temp2, ggml_tensor *temp3, ggml_tensor *temp4, ggml_tensor *temp5)
     {
         ggml_tensor *dup = ggml_dup(dbg_ctx->gctx.get(), tensor);
+        ggml_set_output(dup);
         ggml_build_forward_expand(dbg_ctx->gf, dup);
-        ggml_graph_compute_with_ctx(dbg_ctx->gctx.get(), dbg_ctx->gf, 4);
+
+        // never freed: the process exits below
+        ggml_gallocr_t galloc = ggml_gallocr_new(ggml_backend_cpu_buffer_type());
+        CHATLLM_CHECK(ggml_gallocr_alloc_graph(galloc, dbg_ctx->gf)) << "failed to allocate compute buffer";
+        for (int i = 0; i < dbg_ctx->gf->n_leafs; i++)
+        {
+            ggml_tensor *leaf = dbg_ctx->gf->leafs[i];
+            if ((leaf->flags & GGML_TENSOR_FLAG_INPUT) && dbg_input_ids)
+                memcpy(leaf->data, dbg_input_ids->data(), ggml_nbytes(leaf));
+        }
+
+        ggml_cplan plan = ggml_graph_plan(dbg_ctx->gf, 4);
+        std::vector<uint8_t> work(plan.work_size);
+        plan.work_data = work.data();
+        ggml_graph_compute(dbg_ctx->gf, &plan);
         printf("%s:\n", msg);
         print_tensor(dup);
 
@@ -601,13 +620,15 @@ namespace chatllm
     template<class LM> class BaseModelForConditionalGeneration : public BaseModel
     {
     public:
-        BaseModelForConditionalGeneration(ModelType model_type, BaseConfig config, size_t mem_size, size_t scratch_size)
+        BaseModelForConditionalGeneration(ModelType model_type, BaseConfig config)
             : BaseModel(model_type, to_string(model_type), to_native_string(model_type), get_model_purpose(model_type)),
               transformer(nullptr),
               GRAPH_SIZE(GGML_DEFAULT_GRAPH_SIZE),
-              batch_input(true), logit_scale(-1.0f),
-              config_(config), mem_size_(mem_size), mem_buffer_(new char[mem_size]),
-              scratch_size_(scratch_size), scratch_buffer_(new char[scratch_size])
+              batch_input(true), logit_scale(-1.0f), imatrix(nullptr), weight_streamer(nullptr), expert_stats(nullptr),
+              compute_pool(nullptr), thread_tuner(nullptr), tensor_parallel(nullptr),
+              config_(config),
+              galloc_(ggml_gallocr_new(ggml_backend_cpu_buffer_type()), ggml_gallocr_free),
+              decoding_reserved(false)
         {
             for (int i = 0; i < config.num_hidden_layers; i++)
                 layer_ids.push_back(i);
@@ -641,6 +662,36 @@ namespace chatllm
             return transformer->get_param_num(effective_only);
         }
 
+        void set_imatrix_collector(ImatrixCollector *collector) override
+        {
+            imatrix = collector;
+        }
+
+        void set_weight_streamer(WeightStreamer *streamer) override
+        {
+            weight_streamer = streamer;
+        }
+
+        void set_expert_stats(ExpertStats *stats) override
+        {
+            expert_stats = stats;
+        }
+
+        void set_compute_pool(ComputePool *pool) override
+        {
+            compute_pool = pool;
+        }
+
+        void set_thread_tuner(ThreadTuner *tuner) override
+        {
+            thread_tuner = tuner;
+        }
+
+        void set_tensor_parallel(TensorParallel *tp) override
+        {
+            tensor_parallel = tp;
+        }
+
         std::vector<int> generate(const std::vector<int> &input_ids, const GenerationConfig &gen_config,
                                   const bool continuous,
                                   bool &completed,
@@ -660,7 +711,8 @@ namespace chatllm
 
             aborted = false;
 
-            std::vector<int> curr_input_ids(input_ids);
+            // all ranks evaluate the input of rank 0
+            std::vector<int> curr_input_ids(tensor_parallel ? tensor_parallel->broadcast(input_ids) : input_ids);
 
             std::vector<int> output_ids;
             output_ids.reserve(gen_config.max_length);
@@ -673,9 +725,18 @@ namespace chatllm
 
             completed = false;
 
-            transformer->set_ctx((int)input_ids.size());
+            transformer->set_ctx((int)curr_input_ids.size());
             int next_output_idx = 0;
 
+            // the last decoding step (attending to the whole context) is measured in advance, otherwise the compute
+            // buffer would be reallocated as the context grows. Graph building touches the states of caches,
+            // which are reset when `n_past == 0`.
+            if (!decoding_reserved && (n_past + n_past_offset == 0))
+            {
+                reserve_compute_buffer(1, config_.max_length - 1);
+                decoding_reserved = true;
+            }
+
             if (gen_max_tokens > 0)
                 gen_max_tokens = n_past + (int)curr_input_ids.size() + gen_max_tokens;
 
@@ -811,31 +872,79 @@ namespace chatllm
                                        int past)
         {
             ForwardContext ctx;
-            ctx.gctx = GGMLContext({.mem_size = mem_size_, .mem_buffer = mem_buffer_.get(), .no_alloc = false});
-            ctx.scratch = {.offs = 0, .size = scratch_size_, .data = scratch_buffer_.get()};
-            int n_threads = input_ids.size() >= 32 && ggml_cpu_has_blas() && !ggml_cpu_has_gpublas() ? 1 : gen_config.num_threads;
+            const bool blas = input_ids.size() >= 32 && ggml_cpu_has_blas() && !ggml_cpu_has_gpublas();
+            const ThreadTuner::Phase phase = input_ids.size() > 1 ? ThreadTuner::Phase::Prefill : ThreadTuner::Phase::Decode;
+            int n_threads = phase == ThreadTuner::Phase::Prefill ? gen_config.num_threads_prefill : gen_config.num_threads_decode;
+            const bool tuning = (n_threads < 0) && thread_tuner && !blas;
+            if (tuning)
+                n_threads = thread_tuner->pick(phase, gen_config.num_threads);
+            else if ((n_threads <= 0) || blas)
+                n_threads = blas ? 1 : gen_config.num_threads;
+
+            ggml_tensor *input_ids_tensor = nullptr;
+            dbg_input_ids = &input_ids;
+            ggml_tensor *r = build_graph(ctx, input_ids_tensor, (int)input_ids.size(), past);
+
+            // intermediate tensors share memory according to their liveness, the buffer grows to fit if needed
+            CHATLLM_CHECK(ggml_gallocr_alloc_graph(galloc_.get(), ctx.gf)) << "failed to allocate compute buffer";
+            memcpy(input_ids_tensor->data, input_ids.data(), ggml_nbytes(input_ids_tensor));
+
+            ggml_cplan plan = ggml_graph_plan(ctx.gf, n_threads);
+            if (plan.work_size > work_buffer_.size())
+                work_buffer_.resize(plan.work_size);
+            plan.work_data = work_buffer_.data();
+            plan.threadpool = compute_pool ? compute_pool->get(n_threads) : nullptr;
+            auto t0 = std::chrono::steady_clock::now();
+            ggml_graph_compute(ctx.gf, &plan);
+            if (tuning)
+                thread_tuner->record(phase, n_threads, (int)input_ids.size(),
+                                     std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count());
+
+#ifdef GGML_PERF
+            ggml_graph_print(&ctx.gf);
+#endif
+
+            return r;
+        }
+
+        ggml_tensor *build_graph(ForwardContext &ctx, ggml_tensor *&input_ids_tensor, int qlen, int past)
+        {
+            // tensor objects only, data is allocated by `galloc_`
+            const size_t meta_size = ggml_tensor_overhead() * GRAPH_SIZE + ggml_graph_overhead_custom(GRAPH_SIZE, false);
+            if (meta_buffer_.size() < meta_size)
+                meta_buffer_.resize(meta_size);
+
+            ctx.gctx = GGMLContext({.mem_size = meta_buffer_.size(), .mem_buffer = meta_buffer_.data(), .no_alloc = true});
             ctx.gf = ggml_new_graph_custom(ctx.gctx.get(), GRAPH_SIZE, false);
+            ctx.imatrix = imatrix;
+            ctx.weight_streamer = weight_streamer;
+            ctx.expert_stats    = expert_stats;
+            ctx.tensor_parallel = tensor_parallel;
 
             dbg_ctx = &ctx;
 
-            ggml_tensor *input_ids_tensor = ggml_new_tensor_1d(ctx.gctx.get(), GGML_TYPE_I32, input_ids.size());
-            memcpy(input_ids_tensor->data, input_ids.data(), ggml_nbytes(input_ids_tensor));
+            input_ids_tensor = ggml_new_tensor_1d(ctx.gctx.get(), GGML_TYPE_I32, qlen);
+            ggml_set_input(input_ids_tensor);
 
             ggml_tensor *r = transformer->forward(&ctx, input_ids_tensor, past);
 
             if (logit_scale > 0)
                 r = ggml_scale_inplace(ctx.gctx.get(), r, logit_scale);
 
+            ggml_set_output(r);
             ggml_build_forward_expand(ctx.gf, r);
-            ggml_graph_compute_with_ctx(ctx.gctx.get(), ctx.gf, n_threads);
-
-#ifdef GGML_PERF
-            ggml_graph_print(&ctx.gf);
-#endif
-
             return r;
         }
 
+        void reserve_compute_buffer(int qlen, int past)
+        {
+            ForwardContext ctx;
+            ctx.reserving = true;
+            ggml_tensor *input_ids_tensor = nullptr;
+            build_graph(ctx, input_ids_tensor, qlen, past);
+            CHATLLM_CHECK(ggml_gallocr_reserve(galloc_.get(), ctx.gf)) << "failed to reserve compute buffer";
+        }
+
         virtual bool is_output_terminated(const std::vector<int> &output_ids, int &keep_idx, int &pop_output)
         {
             if (output_ids.size() < 1)
@@ -877,12 +986,18 @@ namespace chatllm
         bool batch_input;
         float logit_scale;
         std::vector<int> layer_ids;
+        ImatrixCollector *imatrix;
+        WeightStreamer *weight_streamer;
+        ExpertStats *expert_stats;
+        ComputePool *compute_pool;
+        ThreadTuner *thread_tuner;
+        TensorParallel *tensor_parallel;
     private:
         BaseConfig config_;
-        size_t mem_size_;
-        std::unique_ptr<char[]> mem_buffer_; // BLAS buffer
-        size_t scratch_size_;
-        std::unique_ptr<char[]> scratch_buffer_; // intermediate tensor buffer
+        std::unique_ptr<ggml_gallocr, decltype(&ggml_gallocr_free)> galloc_;
+        std::vector<uint8_t> meta_buffer_;
+        std::vector<uint8_t> work_buffer_;
+        bool decoding_reserved;
     };
 
     static std::string regex_replace(const std::string &input, const std::regex &regex,
@@ -932,11 +1047,14 @@ namespace chatllm
         ggml_tensor *forward(ForwardContext *ctx, ggml_tensor *input_ids, int n_past) override
         {
             ggml_tensor *hidden_states = word_embeddings.forward(ctx, input_ids);
-            for (auto &layer : layers)
+            for (int i = 0; i < (int)layers.size(); i++)
             {
-                ggml_set_scratch(ctx->gctx.get(), ctx->scratch);
-                hidden_states = layer->forward(ctx, hidden_states, n_past);
+                if (ctx->weight_streamer)
+                    hidden_states = ctx->weight_streamer->layer_boundary(ctx, i, hidden_states);
+                hidden_states = layers[i]->forward(ctx, hidden_states, n_past);
             }
+            if (ctx->weight_streamer)
+                hidden_states = ctx->weight_streamer->layer_boundary(ctx, (int)layers.size(), hidden_states);
 
             return final_steps(ctx, input_ids, hidden_states);
         }
@@ -1000,8 +1118,6 @@ namespace chatllm
     protected:
         ggml_tensor *final_steps(ForwardContext *ctx, ggml_tensor *input_ids, ggml_tensor *hidden_states)
         {
-            ggml_set_scratch(ctx->gctx.get(), {.offs = 0, .size = 0, .data = nullptr});
-
             // NOTE: only compute next_token_logits for the last token
             hidden_states = ggml_view_2d(ctx->gctx.get(), hidden_states, config.hidden_size, 1,
                                         config.hidden_size * ggml_element_size(hidden_states),
@@ -1100,7 +1216,6 @@ namespace chatllm
             ggml_tensor *hidden_states = Base::word_embeddings.forward(ctx, input_ids, n_past);
             for (auto &layer : BaseBase::layers)
             {
-                ggml_set_scratch(ctx->gctx.get(), ctx->scratch);
                 hidden_states = layer->forward(ctx, hidden_states, n_past);
             }
             return final_steps(ctx, input_ids, hidden_states);
@@ -1109,8 +1224,6 @@ namespace chatllm
     protected:
         ggml_tensor *final_steps(ForwardContext *ctx, ggml_tensor *input_ids, ggml_tensor *hidden_states)
         {
-            ggml_set_scratch(ctx->gctx.get(), {.offs = 0, .size = 0, .data = nullptr});
-
             ggml_tensor *transformer_outputs = Base::final_layernorm.forward(ctx, hidden_states);
 
             return transformer_outputs;
@@ -1306,7 +1419,7 @@ namespace chatllm
     }
 
     template <class Config, class Tokenizer>
-    Tokenizer *load_tokenizer(ModelLoader &loader, Config &config)
+    Tokenizer *load_tokenizer(ModelLoader &loader, Config &config, bool index_tensors = true)
     {
         loader.seek(loader.offset_tokenizer, SEEK_SET);
 
@@ -1319,12 +1432,23 @@ namespace chatllm
         if (0 == loader.offset_tensors)
         {
             loader.offset_tensors = loader.tell();
-            loader.load_all_tensors();
+            if (index_tensors)
+                loader.load_all_tensors();
         }
 
         return tokenizer;
     }
 
+    template <class Config, class Tokenizer>
+    BaseTokenizer *load_tokenizer(ModelLoader &loader, const ModelObject::extra_args &args)
+    {
+        Config config;
+
+        load_config<Config>(loader, config, args);
+
+        return load_tokenizer<Config, Tokenizer>(loader, config, false);
+    }
+
     static void parse_slice(std::vector<int> &values, const std::string &s, int num_hidden_layers)
     {
         int spec[3] = {0, num_hidden_layers, 1};
@@ -1396,10 +1520,24 @@ namespace chatllm
         }
 
         // load model
-        ConditionalGeneration *model = new ConditionalGeneration(config);
-        if (layers.size() > 0)
-            model->set_layer_ids(layers);
-        model->load(loader);
+        ConditionalGeneration *model = nullptr;
+        {
+            StartupProfiler::Scope phase(args.profiler, "model");
+            {
+                InitContext::TensorParallelScope tp_scope(loader.tp_size);
+                model = new ConditionalGeneration(config);
+            }
+            if (layers.size() > 0)
+                model->set_layer_ids(layers);
+            model->load(loader);
+        }
+
+        // `Linear` weights are known once read
+        if (args.repack_threads > 0)
+        {
+            StartupProfiler::Scope phase(args.profiler, "repack");
+            loader.repack_tensors(args.repack_threads, args.repack_cache);
+        }
 
         return model;
     }
@@ -1420,10 +1558,28 @@ namespace chatllm
         // load config
         Config config;
 
-        load_config<Config>(loader, config, args);
+        {
+            StartupProfiler::Scope phase(args.profiler, "config");
+            load_config<Config>(loader, config, args);
+        }
 
         // load tokenizer
-        result.tokenizer = std::unique_ptr<BaseTokenizer>(load_tokenizer<Config, Tokenizer>(loader, config));
+        const bool index_tensors = 0 == loader.offset_tensors;
+        {
+            StartupProfiler::Scope phase(args.profiler, "tokenizer");
+            result.tokenizer = std::unique_ptr<BaseTokenizer>(load_tokenizer<Config, Tokenizer>(loader, config, false));
+        }
+        if (index_tensors)
+        {
+            StartupProfiler::Scope phase(args.profiler, "tensor_index");
+            loader.load_all_tensors();
+        }
+        if (args.shards.size() > 0)
+        {
+            StartupProfiler::Scope phase(args.profiler, "shards");
+            for (auto &path : args.shards)
+                loader.add_shard(path);
+        }
 
 #if (0)
         // test tokenizer
@@ -1448,10 +1604,16 @@ namespace chatllm
         // load magic
         loader.seek(0, SEEK_SET);
         std::string magic = loader.read_string(4);
-        CHATLLM_CHECK(magic == "ggml") << "model file is broken (bad magic)";
+        CHATLLM_CHECK((magic == "ggml") || (magic == "ggm2")) << "model file is broken (bad magic)";
 
         loader.model_type = loader.read_basic<int>();
         loader.version = loader.read_basic<int>();
+
+        if (magic == "ggm2")
+        {
+            loader.container = 2;
+            loader.load_tensor_directory();
+        }
     }
 
     std::string ModelFactory::load_info(ModelLoader &loader)
@@ -1461,7 +1623,8 @@ namespace chatllm
         std::ostringstream oss;
         oss << "Model name  : " << to_string((ModelType(loader.model_type))) << std::endl
             << "Model type  : " << to_string(get_model_purpose((ModelType(loader.model_type)))) << std::endl
-            << "File version: " << loader.version << std::endl << std::endl
+            << "File version: " << loader.version << std::endl
+            << "Container   : v" << loader.container << std::endl << std::endl
 
             << "vocab_size          : " << config.vocab_size << std::endl
             << "hidden_size         : " << config.hidden_size << std::endl
@@ -1475,7 +1638,10 @@ namespace chatllm
 
     bool ModelFactory::load(ModelLoader &loader, Result &result, const ModelObject::extra_args &args)
     {
-        load_file_header(loader);
+        {
+            StartupProfiler::Scope phase(args.profiler, "header");
+            load_file_header(loader);
+        }
         return ModelFactory::load(loader.model_type, loader.version, loader, result, args);
     }
 
@@ -1588,8 +1754,57 @@ namespace chatllm
         #undef CASE
     }
 
+    BaseTokenizer *ModelFactory::load_tokenizer(ModelLoader &loader, const ModelObject::extra_args &args)
+    {
+        load_file_header(loader);
+
+        int model_type = loader.model_type;
+        int version = loader.version;
+
+        #define CASE(TYPE, ns, ver)         \
+            case MODEL_TYPE_ ##TYPE:        \
+            {                               \
+                CHATLLM_CHECK(version == ver) << "only support version " #ver " for now but got " << version;   \
+                return chatllm::load_tokenizer<ns::Config,                                                      \
+                                               ns::Tokenizer>(loader, args);                                    \
+            }
+
+        switch ((ModelType)model_type)
+        {
+        ALL_MODELS
+        default:
+            CHATLLM_THROW << "invalid model type " << model_type;
+            return nullptr;
+        }
+
+        #undef CASE
+    }
+
+    // models built from `BaseAttention` (or the MLA of DeepSeek-V2) and `BaseMLP` (or `BaseSparseMLP`) only,
+    // with nothing depending on all heads
+    bool TensorParallel::is_supported(int model_type)
+    {
+        switch ((ModelType)model_type)
+        {
+        case MODEL_TYPE_LLAMA2:
+        case MODEL_TYPE_LLAMA3:
+        case MODEL_TYPE_CODELLAMA:
+        case MODEL_TYPE_MISTRAL:
+        case MODEL_TYPE_MIXTRAL:
+        case MODEL_TYPE_GROK_1:
+        case MODEL_TYPE_DEEPSEEK_V2_LIGHT:
+        case MODEL_TYPE_DEEPSEEK_V2:
+            return true;
+        default:
+            return false;
+        }
+    }
+
     bool ModelFactory::load(int model_type, int version, ModelLoader &loader, Result &result, const ModelObject::extra_args &args)
     {
+        CHATLLM_CHECK((loader.tp_size == 1) || TensorParallel::is_supported(model_type))
+            << "tensor parallelism is not supported by " << to_string((ModelType)model_type);
+
         #define CASE(TYPE, ns, ver)         \
             case MODEL_TYPE_ ##TYPE:        \
             {                               \
@@ -47,9 +47,6 @@ namespace persimmon
         void load(ModelLoader &loader) override;
 
     public:
-        static constexpr size_t MEM_SIZE = 1812ull * 1024 * 1024;
-        static constexpr size_t SCRATCH_SIZE = 444ull * 1024 * 1024;
-
         Config config;
 
     private:
@@ -106,7 +103,7 @@ namespace persimmon
 
     ConditionalGeneration::ConditionalGeneration(const Config &config)
         : BaseModelForConditionalGeneration<
-                                    Model<Config, Embedding, LayerNorm, PersimmonBlock, int, int, int, int>>(MODEL_TYPE_PERSIMMON, config, MEM_SIZE, SCRATCH_SIZE), config(config)
+                                    Model<Config, Embedding, LayerNorm, PersimmonBlock, int, int, int, int>>(MODEL_TYPE_PERSIMMON, config), config(config)
     {
         constexpr size_t tensor_ovhd = GGML_TENSOR_SIZE + GGML_OBJECT_SIZE;
         const size_t num_tensors = 4 + config.num_hidden_layers * 23;
@@ -61,9 +61,9 @@ namespace embedding
     public:
         ConditionalGeneration() = default;
 
-        ConditionalGeneration(const Config &config, ModelType type, size_t mem_size, size_t scratch_size)
+        ConditionalGeneration(const Config &config, ModelType type)
             : BaseModelForConditionalGeneration<
-                EmbeddingModel<Config, RobertaEmbedding, RobertaBlock, BCEFinalNorm, int, int, int, int, int>>(type, config, mem_size, scratch_size),
+                EmbeddingModel<Config, RobertaEmbedding, RobertaBlock, BCEFinalNorm, int, int, int, int, int>>(type, config),
               config(config)
         {
             constexpr size_t tensor_ovhd = GGML_TENSOR_SIZE + GGML_OBJECT_SIZE;
@@ -78,7 +78,7 @@ namespace embedding
         }
 
         ConditionalGeneration(const Config &config)
-            : ConditionalGeneration(config, MODEL_TYPE_BCE_Embedding, MEM_SIZE, SCRATCH_SIZE)
+            : ConditionalGeneration(config, MODEL_TYPE_BCE_Embedding)
         {}
 
         void load(ModelLoader &loader) override
@@ -121,9 +121,6 @@ namespace embedding
         }
 
     public:
-        static constexpr size_t MEM_SIZE = 812ull * 1024 * 1024;
-        static constexpr size_t SCRATCH_SIZE = 44ull * 1024 * 1024;
-
         Config config;
 
     private:
@@ -183,12 +180,12 @@ namespace ranker
         ConditionalGeneration() = default;
 
         ConditionalGeneration(const Config &config)
-            : ConditionalGeneration(config, MODEL_TYPE_BCE_ReRanker, MEM_SIZE, SCRATCH_SIZE)
+            : ConditionalGeneration(config, MODEL_TYPE_BCE_ReRanker)
         {}
 
-        ConditionalGeneration(const Config &config, ModelType type, size_t mem_size, size_t scratch_size)
+        ConditionalGeneration(const Config &config, ModelType type)
             : BaseModelForConditionalGeneration<
-                EmbeddingModel<Config, RobertaEmbedding, RobertaBlock, RobertaClassificationHead, int, int, int, int, int>>(type, config, mem_size, scratch_size),
+                EmbeddingModel<Config, RobertaEmbedding, RobertaBlock, RobertaClassificationHead, int, int, int, int, int>>(type, config),
               config(config)
         {
             constexpr size_t tensor_ovhd = GGML_TENSOR_SIZE + GGML_OBJECT_SIZE;
@@ -242,9 +239,6 @@ namespace ranker
         }
 
     public:
-        static constexpr size_t MEM_SIZE = 812ull * 1024 * 1024;
-        static constexpr size_t SCRATCH_SIZE = 44ull * 1024 * 1024;
-
         Config config;
 
     private:
@@ -10,11 +10,8 @@ namespace embedding
         ConditionalGeneration() = default;
 
         ConditionalGeneration(const Config &config)
-            : bce::embedding::ConditionalGeneration(config, MODEL_TYPE_BGE_M3, MEM_SIZE, SCRATCH_SIZE)
+            : bce::embedding::ConditionalGeneration(config, MODEL_TYPE_BGE_M3)
         {}
-    public:
-        static constexpr size_t MEM_SIZE = 812ull * 1024 * 1024;
-        static constexpr size_t SCRATCH_SIZE = 544ull * 1024 * 1024;
     };
 }
 
@@ -30,10 +27,7 @@ namespace ranker
         ConditionalGeneration() = default;
 
         ConditionalGeneration(const Config &config)
-            : bce::ranker::ConditionalGeneration(config, MODEL_TYPE_BGE_ReRanker_M3, MEM_SIZE, SCRATCH_SIZE)
+            : bce::ranker::ConditionalGeneration(config, MODEL_TYPE_BGE_ReRanker_M3)
         {}
-    public:
-        static constexpr size_t MEM_SIZE = 812ull * 1024 * 1024;
-        static constexpr size_t SCRATCH_SIZE = 544ull * 1024 * 1024;
     };
 }
\ No newline at end of file
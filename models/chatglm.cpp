@@ -41,8 +41,6 @@ public:
     void load(ModelLoader &loader) override;
 
 public:
-    static constexpr size_t MEM_SIZE = 272ull * 1024 * 1024;
-    static constexpr size_t SCRATCH_SIZE = 228ull * 1024 * 1024;
     Config config;
 
 private:
@@ -164,7 +162,7 @@ std::string Tokenizer::postprocess(const std::string &text) const
 }
 
 ConditionalGeneration::ConditionalGeneration(const Config &config)
-    : BaseModelForConditionalGeneration(MODEL_TYPE_CHATGLM, config, MEM_SIZE, SCRATCH_SIZE), config(config)
+    : BaseModelForConditionalGeneration(MODEL_TYPE_CHATGLM, config), config(config)
 {
     constexpr size_t tensor_ovhd = GGML_TENSOR_SIZE + GGML_OBJECT_SIZE;
     const size_t num_tensors = 3 + config.num_hidden_layers * 15;
@@ -255,9 +253,6 @@ public:
     void load(ModelLoader &loader) override;
 
 public:
-    static constexpr size_t MEM_SIZE = 512ull * 1024 * 1024;
-    static constexpr size_t SCRATCH_SIZE = 244ull * 1024 * 1024;
-
     Config config;
 
 private:
@@ -311,7 +306,7 @@ bool Tokenizer::is_special_id(int id) const
 }
 
 ConditionalGeneration::ConditionalGeneration(const Config &config, ModelType type)
-    : BaseModelForConditionalGeneration(type, config, MEM_SIZE, SCRATCH_SIZE), config(config)
+    : BaseModelForConditionalGeneration(type, config), config(config)
 {
     constexpr size_t tensor_ovhd = GGML_TENSOR_SIZE + GGML_OBJECT_SIZE;
     const size_t num_tensors = 3 + config.num_hidden_layers * 10;
@@ -160,23 +160,27 @@ namespace v2_light
                       int q_lora_rank, int kv_lora_rank, int rope_dim, int qk_nope_head_dim, int v_head_dim,
                       bool use_bias,
                       ggml_type cache_type, int cache_length)
-            : KVCacheAttention(ctx, num_attention_heads, num_kv_heads,
-                               opt_speed ? (qk_nope_head_dim + rope_dim) * num_kv_heads : rope_dim * 1,
-                               opt_speed ? v_head_dim * num_kv_heads : kv_lora_rank,
+            : KVCacheAttention(ctx, num_attention_heads / ctx->tp_size, num_kv_heads / ctx->tp_size,
+                               opt_speed ? (qk_nope_head_dim + rope_dim) * num_kv_heads / ctx->tp_size : rope_dim * 1,
+                               opt_speed ? v_head_dim * num_kv_heads / ctx->tp_size : kv_lora_rank,
                                max_length,
                                opt_speed ? cache_type : GGML_TYPE_F32, cache_length),
               d_kv_proj(ctx, hidden_size, kv_lora_rank, nullptr, use_bias),
               k_pe_proj(ctx, hidden_size, rope_dim, nullptr, use_bias),
-              u_k_nope_proj(ctx, kv_lora_rank, qk_nope_head_dim * num_kv_heads, nullptr, false),
-              u_v_proj(ctx, kv_lora_rank, v_head_dim * num_kv_heads, nullptr, false),
-              q_proj(ctx, hidden_size, num_attention_heads, q_lora_rank, rope_dim, qk_nope_head_dim, use_bias),
-              o_proj(ctx, v_head_dim * num_attention_heads, hidden_size, use_bias),
+              u_k_nope_proj(ctx, kv_lora_rank, qk_nope_head_dim * num_kv_heads / ctx->tp_size, nullptr, false),
+              u_v_proj(ctx, kv_lora_rank, v_head_dim * num_kv_heads / ctx->tp_size, nullptr, false),
+              q_proj(ctx, hidden_size, num_attention_heads / ctx->tp_size, q_lora_rank, rope_dim, qk_nope_head_dim, use_bias),
+              o_proj(ctx, v_head_dim * num_attention_heads / ctx->tp_size, hidden_size, use_bias),
               kv_norm(ctx, kv_lora_rank),
               kv_lora_rank(kv_lora_rank),
               rope_dim(rope_dim),
               qk_nope_head_dim(qk_nope_head_dim),
               v_head_dim(v_head_dim)
         {
+            // tensor parallelism: the up projections of q, k_nope & v and o_proj are split by heads, while the
+            // compressed kv (d_kv_proj, k_pe_proj, so the cache of `opt_speed == false`) is computed by all ranks
+            CHATLLM_CHECK((num_attention_heads % ctx->tp_size == 0) && (num_kv_heads % ctx->tp_size == 0))
+                << "heads (" << num_attention_heads << ", " << num_kv_heads << ") can't be split among " << ctx->tp_size << " ranks";
         }
 
         BaseMLAttention(InitContext *ctx, int hidden_size, int num_attention_heads, int num_kv_heads, int max_length,
@@ -230,7 +234,7 @@ namespace v2_light
 
             ggml_tensor *scores = cross_attention_speed(ctx, hidden_size, n_past, qlen, tmpq, k_nope, k_pe, tmpv);
 
-            ggml_tensor *attn_output = o_proj.forward(ctx, scores);
+            ggml_tensor *attn_output = row_parallel_forward(ctx, o_proj, scores);
 
             return attn_output;
         }
@@ -290,7 +294,7 @@ namespace v2_light
 
             ggml_tensor *scores = cross_attention_memory(ctx, hidden_size, n_past, qlen, tmpq, k_pe, kv_lora);
 
-            ggml_tensor *attn_output = o_proj.forward(ctx, scores);
+            ggml_tensor *attn_output = row_parallel_forward(ctx, o_proj, scores);
 
             return attn_output;
         }
@@ -459,13 +463,13 @@ namespace v2_light
         return 0.1f * mscale * logf(scale) + 1.0f;
     }
 
-    template <int NUM_EXPERTS, int EXPERTS_PER_TOK, int EFFECTIVE_EXPERTS_PER_TOK> class ConditionalGeneration0 : public BaseModelForConditionalGeneration<
+    typedef CombinedMLP<SparseMoE, SiLUMLP> DeepSeekMoEMLP;
+    typedef LMBlock1<RMSNorm, SpeedMLAttention, RMSNorm, DeepSeekMoEMLP> DeepSeek2MoEBlock;
+
+    class ConditionalGeneration0 : public BaseModelForConditionalGeneration<
                                     HeterogeneousModel<Config, Embedding, RMSNorm>>
     {
     public:
-        typedef SparseMoE<SiLUMLP, NUM_EXPERTS, EFFECTIVE_EXPERTS_PER_TOK> DeepSeekSparseMoE;
-        typedef CombinedMLP<DeepSeekSparseMoE, SiLUMLP> DeepSeekMoEMLP;
-        typedef LMBlock1<RMSNorm, SpeedMLAttention, RMSNorm, DeepSeekMoEMLP> DeepSeek2MoEBlock;
         typedef BaseModelForConditionalGeneration<HeterogeneousModel<Config, Embedding, RMSNorm>> Base;
     public:
         ConditionalGeneration0() = default;
@@ -476,7 +480,7 @@ namespace v2_light
         ConditionalGeneration0(const Config &config, ModelType type, int q_lora_rank)
             : BaseModelForConditionalGeneration<
                                         HeterogeneousModel<Config, Embedding, RMSNorm>>(
-                                            type, config, MEM_SIZE, SCRATCH_SIZE),
+                                            type, config),
               config(config)
         {
             constexpr size_t tensor_ovhd = GGML_TENSOR_SIZE + GGML_OBJECT_SIZE;
@@ -486,10 +490,8 @@ namespace v2_light
             w_ctx_.gctx = GGMLContext({.mem_size = ctx_size, .mem_buffer = nullptr, .no_alloc = true});
             w_ctx_.dtype = config.dtype;
 
-            CHATLLM_CHECK((NUM_EXPERTS == config.n_routed_experts)
-                            && (EXPERTS_PER_TOK == config.num_experts_per_tok)
-                            && (EFFECTIVE_EXPERTS_PER_TOK <= EXPERTS_PER_TOK))
-                << "unsupported MoE param";
+            CHATLLM_CHECK((config.num_experts_per_tok > 0) && (config.num_experts_per_tok <= config.n_routed_experts))
+                << "invalid MoE param: num_experts_per_tok = " << config.num_experts_per_tok;
 
             auto create_layer = [&](InitContext *ctx, int layer_index) -> Block * {
                 if (is_layer_moe(layer_index))
@@ -498,7 +500,8 @@ namespace v2_light
                                                 config.moe_intermediate_size, config.moe_intermediate_size * config.n_shared_experts,
                                                 config.num_key_value_heads, config.max_length,
                                                 q_lora_rank, config.kv_lora_rank, config.qk_rope_head_dim, config.qk_nope_head_dim, config.v_head_dim,
-                                                false);
+                                                false,
+                                                config.n_routed_experts, config.num_experts_per_tok);
                 }
                 else
                 {
@@ -620,9 +623,6 @@ namespace v2_light
         }
 
     public:
-        static constexpr size_t MEM_SIZE = 812ull * 1024 * 1024;
-        static constexpr size_t SCRATCH_SIZE = 1844ull * 1024 * 1024;
-
         Config config;
 
         bool is_layer_moe(int layer_index)
@@ -634,9 +634,7 @@ namespace v2_light
         InitContext w_ctx_; // weight context
     };
 
-    const int NUM_EXPERTS                   =  64;
-    const int EXPERTS_PER_TOK               =  6;
-    typedef ConditionalGeneration0<NUM_EXPERTS, EXPERTS_PER_TOK, EXPERTS_PER_TOK> ConditionalGeneration;
+    typedef ConditionalGeneration0 ConditionalGeneration;
 }
 
 namespace v2
@@ -649,16 +647,13 @@ namespace v2
 
     typedef v1::Tokenizer Tokenizer;
 
-    const int NUM_EXPERTS                   =  160;
-    const int EXPERTS_PER_TOK               =  6;
-
-    class ConditionalGeneration : public v2_light::ConditionalGeneration0<NUM_EXPERTS, EXPERTS_PER_TOK, EXPERTS_PER_TOK>
+    class ConditionalGeneration : public v2_light::ConditionalGeneration0
     {
     public:
         ConditionalGeneration() = default;
 
         ConditionalGeneration(const Config &config)
-            : v2_light::ConditionalGeneration0<NUM_EXPERTS, EXPERTS_PER_TOK, EXPERTS_PER_TOK>(config, MODEL_TYPE_DEEPSEEK_V2, config.q_lora_rank)
+            : v2_light::ConditionalGeneration0(config, MODEL_TYPE_DEEPSEEK_V2, config.q_lora_rank)
         {
         }
     };
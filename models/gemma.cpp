@@ -72,7 +72,7 @@ class ConditionalGeneration : public BaseModelForConditionalGeneration<
 public:
     ConditionalGeneration(const Config &config, ModelType type = MODEL_TYPE_GEMMA)
         : BaseModelForConditionalGeneration<
-                                  Model<BaseConfig, Embedding, RMSNorm, GemmaBlock, int, int, int, int, int, int>>(type, config, MEM_SIZE, SCRATCH_SIZE), config(config)
+                                  Model<BaseConfig, Embedding, RMSNorm, GemmaBlock, int, int, int, int, int, int>>(type, config), config(config)
     {
         constexpr size_t tensor_ovhd = GGML_TENSOR_SIZE + GGML_OBJECT_SIZE;
         const size_t num_tensors = 2 + config.num_hidden_layers * 12;
@@ -116,9 +116,6 @@ public:
     }
 
 public:
-    static constexpr size_t MEM_SIZE = 1812ull * 1024 * 1024;
-    static constexpr size_t SCRATCH_SIZE = 244ull * 1024 * 1024;
-
     BaseConfig config;
 
 private:
@@ -21,11 +21,6 @@ public:
     size_t load(const char *buffer, int n_vocab) override;
 };
 
-const int NUM_EXPERTS                   =  8;
-const int EXPERTS_PER_TOK               =  2;
-
-// make it easy to test with different number of experts.
-#define EFFECTIVE_EXPERTS_PER_TOK       EXPERTS_PER_TOK
 
 class GrokBaseAttention : public BaseAttention
 {
@@ -56,11 +51,11 @@ public:
         : RoPESelfAttention(ctx, hidden_size, num_attention_heads, num_kv_heads, hidden_size / num_attention_heads, max_length, false, false) {}
 };
 
-template<int num_local_experts, int num_experts_per_tok> class GrokBlock : public LMBlock4<RMSNorm,
+class GrokBlock : public LMBlock4<RMSNorm,
                  GrokSelfAttention,
                  RMSNorm,
                  RMSNorm,
-                 SparseMoE<GELUMLP, num_local_experts, num_experts_per_tok>,
+                 GELUSparseMoE,
                  RMSNorm>
 {
 public:
@@ -68,15 +63,17 @@ public:
                  GrokSelfAttention,
                  RMSNorm,
                  RMSNorm,
-                 SparseMoE<GELUMLP, num_local_experts, num_experts_per_tok>,
+                 GELUSparseMoE,
                  RMSNorm> GrokLMBlock;
-    GrokBlock(InitContext *ctx, int hidden_size, int num_attention_heads, int intermediate_size, int num_kv_heads, int max_length)
-        : GrokLMBlock(ctx, hidden_size, num_attention_heads, intermediate_size, num_kv_heads, max_length)
+    GrokBlock(InitContext *ctx, int hidden_size, int num_attention_heads, int intermediate_size, int num_kv_heads, int max_length,
+              int num_local_experts, int num_experts_per_tok)
+        : GrokLMBlock(ctx, hidden_size, num_attention_heads, intermediate_size, num_kv_heads, max_length,
+                      num_local_experts, num_experts_per_tok)
     {}
 };
 
 class ConditionalGeneration : public BaseModelForConditionalGeneration<Model<Config, Embedding, RMSNorm,
-    GrokBlock<NUM_EXPERTS, EFFECTIVE_EXPERTS_PER_TOK>, int, int, int, int, int>>
+    GrokBlock, int, int, int, int, int, int, int>>
 {
 public:
     ConditionalGeneration() = default;
@@ -86,9 +83,6 @@ public:
     void load(ModelLoader &loader) override;
 
 public:
-    static constexpr size_t MEM_SIZE = 812ull * 1024 * 1024;
-    static constexpr size_t SCRATCH_SIZE = 244ull * 1024 * 1024;
-
     Config config;
 
 private:
@@ -104,7 +98,7 @@ size_t Tokenizer::load(const char *buffer, int n_vocab)
 }
 
 ConditionalGeneration::ConditionalGeneration(const Config &config)
-    : BaseModelForConditionalGeneration(MODEL_TYPE_GROK_1, config, MEM_SIZE, SCRATCH_SIZE), config(config)
+    : BaseModelForConditionalGeneration(MODEL_TYPE_GROK_1, config), config(config)
 {
     constexpr size_t tensor_ovhd = GGML_TENSOR_SIZE + GGML_OBJECT_SIZE;
     const size_t num_tensors = 2 + config.num_hidden_layers * (12 + config.num_experts * 3);
@@ -112,15 +106,16 @@ ConditionalGeneration::ConditionalGeneration(const Config &config)
     w_ctx_.gctx = GGMLContext({.mem_size = ctx_size, .mem_buffer = nullptr, .no_alloc = true});
     w_ctx_.dtype = config.dtype;
 
-    CHATLLM_CHECK((NUM_EXPERTS == config.num_experts) && (EXPERTS_PER_TOK == config.num_selected_experts))
-        << "unsupported MoE param";
+    CHATLLM_CHECK((config.num_selected_experts > 0) && (config.num_selected_experts <= config.num_experts))
+        << "invalid MoE param: num_selected_experts = " << config.num_selected_experts;
 
     GRAPH_SIZE = 4096 * 2;
 
-    transformer = new Model<Config, Embedding, RMSNorm, GrokBlock<NUM_EXPERTS, EFFECTIVE_EXPERTS_PER_TOK>, int, int, int, int, int>(
+    transformer = new Model<Config, Embedding, RMSNorm, GrokBlock, int, int, int, int, int, int, int>(
                         &w_ctx_, config, nullptr,
                         config.hidden_size, config.num_attention_heads,
-                        config.intermediate_size, config.num_key_value_heads, config.max_length);
+                        config.intermediate_size, config.num_key_value_heads, config.max_length,
+                        config.num_experts, config.num_selected_experts);
 
     for (int i = 0; i < config.num_hidden_layers; i++)
         {
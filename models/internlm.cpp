@@ -11,7 +11,7 @@ public:
     {}
 
     GenericConditionalGeneration(const BaseConfig &config, ModelType type, int num_key_value_heads, float rope_theta, float rope_scaling)
-        : Base(type, config, MEM_SIZE, SCRATCH_SIZE), config(config)
+        : Base(type, config), config(config)
     {
         constexpr size_t tensor_ovhd = GGML_TENSOR_SIZE + GGML_OBJECT_SIZE;
         const size_t num_tensors = 3 + config.num_hidden_layers * (bias ? 16 : 12);
@@ -68,9 +68,6 @@ public:
     }
 
 public:
-    static constexpr size_t MEM_SIZE = 1512ull * 1024 * 1024;
-    static constexpr size_t SCRATCH_SIZE = 244ull * 1024 * 1024;
-
     BaseConfig config;
 
 private:
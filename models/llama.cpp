@@ -48,7 +48,7 @@ If a question does not make any sense, or is not factually coherent, explain why
     public:
         GenericConditionalGeneration(const BaseConfig &config, ModelType type, int num_key_value_heads, int max_length, int tensors_per_layer = 12)
             : BaseModelForConditionalGeneration<
-                                    Model<BaseConfig, Embedding, RMSNorm, LayerBlock, int, int, int, int, int>>(type, config, MEM_SIZE, SCRATCH_SIZE), config(config)
+                                    Model<BaseConfig, Embedding, RMSNorm, LayerBlock, int, int, int, int, int>>(type, config), config(config)
         {
             constexpr size_t tensor_ovhd = GGML_TENSOR_SIZE + GGML_OBJECT_SIZE;
             const size_t num_tensors = 3 + config.num_hidden_layers * tensors_per_layer;
@@ -87,9 +87,6 @@ If a question does not make any sense, or is not factually coherent, explain why
         }
 
     public:
-        static constexpr size_t MEM_SIZE = 1812ull * 1024 * 1024;
-        static constexpr size_t SCRATCH_SIZE = 2844ull * 1024 * 1024;
-
         BaseConfig config;
 
     private:
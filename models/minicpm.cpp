@@ -40,7 +40,7 @@ namespace v1
     public:
         ConditionalGeneration(const Config &config, ModelType type = ModelType::MODEL_TYPE_MINICPM, bool tie_word_embeddings = true)
             : BaseModelForConditionalGeneration<
-                                    Model<Config, Embedding, RMSNorm, MiniCPMBlock, int, int, int, int, int>>(type, config, MEM_SIZE, SCRATCH_SIZE), config(config)
+                                    Model<Config, Embedding, RMSNorm, MiniCPMBlock, int, int, int, int, int>>(type, config), config(config)
         {
             constexpr size_t tensor_ovhd = GGML_TENSOR_SIZE + GGML_OBJECT_SIZE;
             const size_t num_tensors = (tie_word_embeddings ? 2 : 3) + config.num_hidden_layers * 12;
@@ -101,9 +101,6 @@ namespace v1
         }
 
     public:
-        static constexpr size_t MEM_SIZE = 812ull * 1024 * 1024;
-        static constexpr size_t SCRATCH_SIZE = 1344ull * 1024 * 1024;
-
         Config config;
 
     private:
@@ -252,29 +249,23 @@ namespace moe
 
     typedef v1::Tokenizer Tokenizer;
 
-    const int NUM_EXPERTS                   =  8;
-    const int EXPERTS_PER_TOK               =  2;
-
-    // make it easy to test with different number of experts.
-    #define EFFECTIVE_EXPERTS_PER_TOK       EXPERTS_PER_TOK
-
-    typedef SparseMoE<SiLUMLP, NUM_EXPERTS, EXPERTS_PER_TOK> MiniCPMSparseMoE;
-
-    class MiniCPMBlock : public LMBlock3<RMSNorm, LlamaSelfAttention, RMSNorm, MiniCPMSparseMoE>
+    class MiniCPMBlock : public LMBlock3<RMSNorm, LlamaSelfAttention, RMSNorm, SparseMoE>
     {
     public:
-        MiniCPMBlock(InitContext *ctx, int hidden_size, int num_attention_heads, int intermediate_size, int num_kv_heads, int max_length)
-            : LMBlock3(ctx, hidden_size, num_attention_heads, intermediate_size, num_kv_heads, max_length)
+        MiniCPMBlock(InitContext *ctx, int hidden_size, int num_attention_heads, int intermediate_size, int num_kv_heads, int max_length,
+                     int num_local_experts, int num_experts_per_tok)
+            : LMBlock3(ctx, hidden_size, num_attention_heads, intermediate_size, num_kv_heads, max_length,
+                       num_local_experts, num_experts_per_tok)
         {}
     };
 
     class ConditionalGeneration : public BaseModelForConditionalGeneration<
-                                    Model<Config, Embedding, RMSNorm, MiniCPMBlock, int, int, int, int, int>>
+                                    Model<Config, Embedding, RMSNorm, MiniCPMBlock, int, int, int, int, int, int, int>>
     {
     public:
         ConditionalGeneration(const Config &config, ModelType type = ModelType::MODEL_TYPE_MINICPM_MoE)
             : BaseModelForConditionalGeneration<
-                                    Model<Config, Embedding, RMSNorm, MiniCPMBlock, int, int, int, int, int>>(type, config, MEM_SIZE, SCRATCH_SIZE), config(config)
+                                    Model<Config, Embedding, RMSNorm, MiniCPMBlock, int, int, int, int, int, int, int>>(type, config), config(config)
         {
             constexpr size_t tensor_ovhd = GGML_TENSOR_SIZE + GGML_OBJECT_SIZE;
             const size_t num_tensors = 2 + config.num_hidden_layers * (10 + config.num_experts * 3);
@@ -282,12 +273,13 @@ namespace moe
             w_ctx_.gctx = GGMLContext({.mem_size = ctx_size, .mem_buffer = nullptr, .no_alloc = true});
             w_ctx_.dtype = config.dtype;
 
-            CHATLLM_CHECK((NUM_EXPERTS == config.num_experts) && (EXPERTS_PER_TOK == config.num_experts_per_tok))
-                << "unsupported MoE param";
+            CHATLLM_CHECK((config.num_experts_per_tok > 0) && (config.num_experts_per_tok <= config.num_experts))
+                << "invalid MoE param: num_experts_per_tok = " << config.num_experts_per_tok;
 
-            transformer = new Model<Config, Embedding, RMSNorm, MiniCPMBlock, int, int, int, int, int>(&w_ctx_, config, nullptr,
+            transformer = new Model<Config, Embedding, RMSNorm, MiniCPMBlock, int, int, int, int, int, int, int>(&w_ctx_, config, nullptr,
                                                                                 config.hidden_size, config.num_attention_heads,
-                                                                                config.intermediate_size, config.num_key_value_heads, config.max_length);
+                                                                                config.intermediate_size, config.num_key_value_heads, config.max_length,
+                                                                                config.num_experts, config.num_experts_per_tok);
 
             for (int i = 0; i < config.num_hidden_layers; i++)
             {
@@ -332,9 +324,6 @@ namespace moe
         }
 
     public:
-        static constexpr size_t MEM_SIZE = 812ull * 1024 * 1024;
-        static constexpr size_t SCRATCH_SIZE = 1344ull * 1024 * 1024;
-
         Config config;
 
     private:
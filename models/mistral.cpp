@@ -231,35 +231,36 @@ namespace mixtral
         }
     };
 
-    template<int _NUM_EXPERTS, int _EXPERTS_PER_TOK, ModelType type> class _ConditionalGeneration : public BaseModelForConditionalGeneration<Model<Config, Embedding, RMSNorm,
-        MixtralBlock<_NUM_EXPERTS, _EXPERTS_PER_TOK, mistral::SLIDING_WINDOW_LEN>, int, int, int, int, int>>
+    template<ModelType type> class _ConditionalGeneration : public BaseModelForConditionalGeneration<Model<Config, Embedding, RMSNorm,
+        MixtralBlock<mistral::SLIDING_WINDOW_LEN>, int, int, int, int, int, int, int>>
     {
     typedef BaseModelForConditionalGeneration<Model<Config, Embedding, RMSNorm,
-        MixtralBlock<_NUM_EXPERTS, _EXPERTS_PER_TOK, mistral::SLIDING_WINDOW_LEN>, int, int, int, int, int>> Base;
+        MixtralBlock<mistral::SLIDING_WINDOW_LEN>, int, int, int, int, int, int, int>> Base;
     public:
         _ConditionalGeneration() = default;
 
         _ConditionalGeneration(const Config &config)
-        : Base(type, config, MEM_SIZE, SCRATCH_SIZE), config(config)
+        : Base(type, config), config(config)
         {
             constexpr size_t tensor_ovhd = GGML_TENSOR_SIZE + GGML_OBJECT_SIZE;
-            const size_t num_tensors = 3 + config.num_hidden_layers * (11 + _NUM_EXPERTS * 3);
+            const size_t num_tensors = 3 + config.num_hidden_layers * (11 + config.num_local_experts * 3);
             const size_t ctx_size = num_tensors * tensor_ovhd;
             w_ctx_.gctx = GGMLContext({.mem_size = ctx_size, .mem_buffer = nullptr, .no_alloc = true});
             w_ctx_.dtype = config.dtype;
 
-            CHATLLM_CHECK((_NUM_EXPERTS == config.num_local_experts) && (_EXPERTS_PER_TOK == config.num_experts_per_tok))
-                << "unsupported MoE param";
+            CHATLLM_CHECK((config.num_experts_per_tok > 0) && (config.num_experts_per_tok <= config.num_local_experts))
+                << "invalid MoE param: num_experts_per_tok = " << config.num_experts_per_tok;
 
             CHATLLM_CHECK((mistral::SLIDING_WINDOW_LEN == config.sliding_window) || (config.sliding_window <= 0))
                 << "sliding_window (" << config.sliding_window << ") must equal to " << mistral::SLIDING_WINDOW_LEN;
 
             Base::GRAPH_SIZE = 4096 * 2;
 
-            Base::transformer = new Model<Config, Embedding, RMSNorm, MixtralBlock<_NUM_EXPERTS, _EXPERTS_PER_TOK, mistral::SLIDING_WINDOW_LEN>, int, int, int, int, int>(
+            Base::transformer = new Model<Config, Embedding, RMSNorm, MixtralBlock<mistral::SLIDING_WINDOW_LEN>, int, int, int, int, int, int, int>(
                                 &w_ctx_, config, false,
                                 config.hidden_size, config.num_attention_heads,
-                                config.intermediate_size, config.num_key_value_heads, config.max_length);
+                                config.intermediate_size, config.num_key_value_heads, config.max_length,
+                                config.num_local_experts, config.num_experts_per_tok);
 
             Base::batch_input = false;
         }
@@ -271,7 +272,7 @@ namespace mixtral
             {
                 std::string layer_prefix = "model.layers." + std::to_string(Base::layer_ids[i]) + '.';
 
-                for (int j = 0; j < _NUM_EXPERTS; j++)
+                for (int j = 0; j < config.num_local_experts; j++)
                 {
                     std::string prefix = layer_prefix + "block_sparse_moe.experts." + std::to_string(j) + '.';
                     loader.read_tensor(prefix + "w1.weight", Base::transformer->layers[i].mlp.experts[j].gate_proj.weight);
@@ -301,9 +302,6 @@ namespace mixtral
         }
 
     public:
-        static constexpr size_t MEM_SIZE = 812ull * 1024 * 1024;
-        static constexpr size_t SCRATCH_SIZE = 244ull * 1024 * 1024;
-
         Config config;
 
     private:
@@ -336,8 +334,5 @@ namespace mixtral
         tok->encode(oss_prompt.str(), ids, false, false);
     }
 
-    const int NUM_EXPERTS                   =  8;
-    const int EXPERTS_PER_TOK               =  2;
-
-    typedef _ConditionalGeneration<NUM_EXPERTS, EXPERTS_PER_TOK, MODEL_TYPE_MIXTRAL> ConditionalGeneration;
+    typedef _ConditionalGeneration<MODEL_TYPE_MIXTRAL> ConditionalGeneration;
 }
\ No newline at end of file
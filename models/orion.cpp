@@ -47,7 +47,7 @@ private:
 public:
     ConditionalGeneration(const Config &config, ModelType type = ModelType::MODEL_TYPE_ORION)
         : BaseModelForConditionalGeneration<
-                                  Model<Config, Embedding, LayerNorm, OrionBlock, int, int, int, int, int>>(type, config, MEM_SIZE, SCRATCH_SIZE), config(config)
+                                  Model<Config, Embedding, LayerNorm, OrionBlock, int, int, int, int, int>>(type, config), config(config)
     {
         constexpr size_t tensor_ovhd = GGML_TENSOR_SIZE + GGML_OBJECT_SIZE;
         const size_t num_tensors = 4 + config.num_hidden_layers * 14;
@@ -88,9 +88,6 @@ public:
     }
 
 public:
-    static constexpr size_t MEM_SIZE = 1812ull * 1024 * 1024;
-    static constexpr size_t SCRATCH_SIZE = 244ull * 1024 * 1024;
-
     Config config;
 
 private:
@@ -93,7 +93,7 @@ namespace v2
     public:
         Phi2ConditionalGeneration() = default;
         Phi2ConditionalGeneration(const BaseConfig &config, ModelType type)
-            : BaseModelForConditionalGeneration(type, config, MEM_SIZE, SCRATCH_SIZE), config(config)
+            : BaseModelForConditionalGeneration(type, config), config(config)
         {
             constexpr size_t tensor_ovhd = GGML_TENSOR_SIZE + GGML_OBJECT_SIZE;
             const size_t num_tensors = 5 + config.num_hidden_layers * 17;
@@ -114,9 +114,6 @@ namespace v2
         }
 
     public:
-        static constexpr size_t MEM_SIZE = 812ull * 1024 * 1024;
-        static constexpr size_t SCRATCH_SIZE = 484ull * 1024 * 1024;
-
         BaseConfig config;
 
     protected:
@@ -60,9 +60,6 @@ namespace v1
         void load(ModelLoader &loader) override;
 
     public:
-        static constexpr size_t MEM_SIZE = 1812ull * 1024 * 1024;
-        static constexpr size_t SCRATCH_SIZE = 844ull * 1024 * 1024;
-
         Config config;
 
     private:
@@ -150,7 +147,7 @@ namespace v1
 
     ConditionalGeneration::ConditionalGeneration(const Config &config, ModelType type)
         : BaseModelForConditionalGeneration<
-                                    Model<Config, Embedding, RMSNorm, QWenBlock, int, int, int, int>>(type, config, MEM_SIZE, SCRATCH_SIZE), config(config)
+                                    Model<Config, Embedding, RMSNorm, QWenBlock, int, int, int, int>>(type, config), config(config)
     {
         constexpr size_t tensor_ovhd = GGML_TENSOR_SIZE + GGML_OBJECT_SIZE;
         const size_t num_tensors = 3 + config.num_hidden_layers * 16;
@@ -249,9 +246,6 @@ namespace v2
         void load(ModelLoader &loader) override;
 
     public:
-        static constexpr size_t MEM_SIZE = 1812ull * 1024 * 1024;
-        static constexpr size_t SCRATCH_SIZE = 444ull * 1024 * 1024;
-
         Config config;
 
     private:
@@ -262,7 +256,7 @@ namespace v2
 
     ConditionalGeneration::ConditionalGeneration(const Config &config, ModelType type, bool tie_embeddings)
         : BaseModelForConditionalGeneration<
-                                    Model<Config, Embedding, RMSNorm, QWen2Block, int, int, int, int, int>>(type, config, MEM_SIZE, SCRATCH_SIZE),
+                                    Model<Config, Embedding, RMSNorm, QWen2Block, int, int, int, int, int>>(type, config),
         config(config), tie_embeddings(tie_embeddings)
     {
         constexpr size_t tensor_ovhd = GGML_TENSOR_SIZE + GGML_OBJECT_SIZE;
@@ -359,30 +353,32 @@ namespace v2_moe
 
     typedef v2::Tokenizer Tokenizer;
 
-    template <class QWenMoEMLP> class QWen2MoEBlock : public LMBlock1<RMSNorm, QWen2SelfAttention, RMSNorm, QWenMoEMLP>
+    typedef CombinedMLP<SparseMoE, GatedMLP<SiLUMLP>> QWenMoEMLP;
+
+    class QWen2MoEBlock : public LMBlock1<RMSNorm, QWen2SelfAttention, RMSNorm, QWenMoEMLP>
     {
     public:
         QWen2MoEBlock(InitContext *ctx, int hidden_size, int num_attention_heads, int intermediate_size,
                   int mlp_intermediate_size1, int mlp_intermediate_size2,
                   int num_kv_heads,
-                  int head_dim, int max_length)
-            : LMBlock1<RMSNorm, QWen2SelfAttention, RMSNorm, QWenMoEMLP>(ctx, hidden_size, num_attention_heads, intermediate_size, mlp_intermediate_size1, mlp_intermediate_size2,
-              num_kv_heads, head_dim, max_length)
+                  int head_dim, int max_length,
+                  int num_local_experts, int num_experts_per_tok)
+            : LMBlock1(ctx, hidden_size, num_attention_heads, intermediate_size, mlp_intermediate_size1, mlp_intermediate_size2,
+              num_kv_heads, head_dim, max_length, num_local_experts, num_experts_per_tok)
         {}
     };
 
-    template <const int NUM_EXPERTS, const int EXPERTS_PER_TOK, const int EFFECTIVE_EXPERTS_PER_TOK, class MoEBlock> class GenericConditionalGeneration : public BaseModelForConditionalGeneration<
-                                    Model<Config, Embedding, RMSNorm, MoEBlock, int, int, int, int, int, int, int, int>>
+    class ConditionalGeneration : public BaseModelForConditionalGeneration<
+                                    Model<Config, Embedding, RMSNorm, QWen2MoEBlock, int, int, int, int, int, int, int, int, int, int>>
     {
     public:
         typedef BaseModelForConditionalGeneration<
-                                    Model<Config, Embedding, RMSNorm, MoEBlock, int, int, int, int, int, int, int, int>> Base;
+                                    Model<Config, Embedding, RMSNorm, QWen2MoEBlock, int, int, int, int, int, int, int, int, int, int>> Base;
     public:
-        GenericConditionalGeneration() = default;
+        ConditionalGeneration() = default;
 
-        GenericConditionalGeneration(const Config &config)
-            : BaseModelForConditionalGeneration<
-                                        Model<Config, Embedding, RMSNorm, MoEBlock, int, int, int, int, int, int, int, int>>(MODEL_TYPE_QWEN2MoE, config, MEM_SIZE, SCRATCH_SIZE),
+        ConditionalGeneration(const Config &config)
+            : Base(MODEL_TYPE_QWEN2MoE, config),
               config(config)
         {
             constexpr size_t tensor_ovhd = GGML_TENSOR_SIZE + GGML_OBJECT_SIZE;
@@ -391,15 +387,15 @@ namespace v2_moe
             w_ctx_.gctx = GGMLContext({.mem_size = ctx_size, .mem_buffer = nullptr, .no_alloc = true});
             w_ctx_.dtype = config.dtype;
 
-            CHATLLM_CHECK((NUM_EXPERTS == config.num_experts) && (EXPERTS_PER_TOK == config.num_experts_per_tok))
-                << "unsupported MoE param";
+            CHATLLM_CHECK((config.num_experts_per_tok > 0) && (config.num_experts_per_tok <= config.num_experts))
+                << "invalid MoE param: num_experts_per_tok = " << config.num_experts_per_tok;
 
-            Base::transformer = new Model<Config, Embedding, RMSNorm, MoEBlock, int, int, int, int, int, int, int, int>(
+            Base::transformer = new Model<Config, Embedding, RMSNorm, QWen2MoEBlock, int, int, int, int, int, int, int, int, int, int>(
                 &w_ctx_, config, false,
                 config.hidden_size, config.num_attention_heads,
                 config.intermediate_size, config.moe_intermediate_size, config.shared_expert_intermediate_size,
                 config.num_key_value_heads, config.hidden_size / config.num_attention_heads,
-                config.max_length);
+                config.max_length, config.num_experts, config.num_experts_per_tok);
 
             for (int i = 0; i < config.num_hidden_layers; i++)
             {
@@ -453,82 +449,10 @@ namespace v2_moe
         }
 
     public:
-        static constexpr size_t MEM_SIZE = 812ull * 1024 * 1024;
-        static constexpr size_t SCRATCH_SIZE = 1844ull * 1024 * 1024;
-
         Config config;
 
     private:
         // hold ggml_context & kv_cache
         InitContext w_ctx_; // weight context
     };
-
-    template <const int NUM_EXPERTS, const int EXPERTS_PER_TOK, const int EFFECTIVE_EXPERTS_PER_TOK> class ClassConditionalGeneration
-    {
-    public:
-        typedef SparseMoE<SiLUMLP, NUM_EXPERTS, EXPERTS_PER_TOK> QWenSparseMoE;
-
-        typedef GatedMLP<SiLUMLP> QWenGatedMLP;
-
-        typedef CombinedMLP<QWenSparseMoE, QWenGatedMLP> QWenMoEMLP;
-
-        typedef QWen2MoEBlock<QWenMoEMLP> MoEBlock;
-
-        class ConditionalGeneration : public GenericConditionalGeneration<NUM_EXPERTS, EXPERTS_PER_TOK, EFFECTIVE_EXPERTS_PER_TOK, MoEBlock>
-        {
-        public:
-            ConditionalGeneration() = default;
-
-            ConditionalGeneration(const Config &config) : GenericConditionalGeneration<NUM_EXPERTS, EXPERTS_PER_TOK, EFFECTIVE_EXPERTS_PER_TOK, MoEBlock>(config) {}
-        };
-
-        static AbstractModel *create(const Config &config)
-        {
-            return new ConditionalGeneration(config);
-        }
-    };
-
-    namespace experts_60
-    {
-        const int NUM_EXPERTS                   =  60;
-        const int EXPERTS_PER_TOK               =  4;
-
-        // make it easy to test with different number of experts.
-        #define EFFECTIVE_EXPERTS_PER_TOK       EXPERTS_PER_TOK
-
-        typedef ClassConditionalGeneration<NUM_EXPERTS, EXPERTS_PER_TOK, EFFECTIVE_EXPERTS_PER_TOK> ConditionalGeneration;
-    }
-
-    namespace experts_64
-    {
-        const int NUM_EXPERTS                   =  64;
-        const int EXPERTS_PER_TOK               =  8;
-
-        // make it easy to test with different number of experts.
-        #define EFFECTIVE_EXPERTS_PER_TOK       EXPERTS_PER_TOK
-
-        typedef ClassConditionalGeneration<NUM_EXPERTS, EXPERTS_PER_TOK, EFFECTIVE_EXPERTS_PER_TOK> ConditionalGeneration;
-    }
-
-    class ConditionalGeneration : public ModelProxy
-    {
-    public:
-        ConditionalGeneration() = default;
-
-        ConditionalGeneration(const Config &config) : ModelProxy()
-        {
-            switch (config.num_experts)
-            {
-            case experts_60::NUM_EXPERTS:
-                set_proxy_model(experts_60::ConditionalGeneration::create(config));
-                break;
-            case experts_64::NUM_EXPERTS:
-                set_proxy_model(experts_64::ConditionalGeneration::create(config));
-                break;
-            default:
-                CHATLLM_CHECK(false) << "unsupported MoE param: num_experts = " << config.num_experts;
-                break;
-            }
-        }
-    };
 }
@@ -34,9 +34,6 @@ namespace v2
         void load(ModelLoader &loader) override;
 
     public:
-        static constexpr size_t MEM_SIZE = 1812ull * 1024 * 1024;
-        static constexpr size_t SCRATCH_SIZE = 444ull * 1024 * 1024;
-
         Config config;
 
     private:
@@ -53,7 +50,7 @@ namespace v2
 
     ConditionalGeneration::ConditionalGeneration(const Config &config)
         : BaseModelForConditionalGeneration<
-                                    Model<Config, Embedding, LayerNorm, StarCoder2Block<SLIDING_WINDOW_LEN>, int, int, int, int, int>>(MODEL_TYPE_STARCODER2, config, MEM_SIZE, SCRATCH_SIZE), config(config)
+                                    Model<Config, Embedding, LayerNorm, StarCoder2Block<SLIDING_WINDOW_LEN>, int, int, int, int, int>>(MODEL_TYPE_STARCODER2, config), config(config)
     {
         constexpr size_t tensor_ovhd = GGML_TENSOR_SIZE + GGML_OBJECT_SIZE;
         const size_t num_tensors = 3 + config.num_hidden_layers * 20;
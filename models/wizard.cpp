@@ -183,8 +183,5 @@ namespace moe
         }
     };
 
-const int NUM_EXPERTS                   =  8;
-const int EXPERTS_PER_TOK               =  2;
-
-typedef mistral::mixtral::_ConditionalGeneration<NUM_EXPERTS, EXPERTS_PER_TOK, MODEL_TYPE_WIZARDLM2_MOE> ConditionalGeneration;
+typedef mistral::mixtral::_ConditionalGeneration<MODEL_TYPE_WIZARDLM2_MOE> ConditionalGeneration;
 }
\ No newline at end of file
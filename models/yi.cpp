@@ -44,9 +44,6 @@ public:
     void load(ModelLoader &loader) override;
 
 public:
-    static constexpr size_t MEM_SIZE = 1812ull * 1024 * 1024;
-    static constexpr size_t SCRATCH_SIZE = 844ull * 1024 * 1024;
-
     Config config;
 
 private:
@@ -113,7 +110,7 @@ bool Tokenizer::is_special_id(int id) const
 }
 
 ConditionalGeneration::ConditionalGeneration(const Config &config, ModelType type)
-    : BaseModelForConditionalGeneration(type, config, MEM_SIZE, SCRATCH_SIZE), config(config)
+    : BaseModelForConditionalGeneration(type, config), config(config)
 {
     constexpr size_t tensor_ovhd = GGML_TENSOR_SIZE + GGML_OBJECT_SIZE;
     const size_t num_tensors = 3 + config.num_hidden_layers * 12;
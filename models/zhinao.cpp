@@ -53,9 +53,6 @@ public:
     void load(ModelLoader &loader) override;
 
 public:
-    static constexpr size_t MEM_SIZE = 1812ull * 1024 * 1024;
-    static constexpr size_t SCRATCH_SIZE = 444ull * 1024 * 1024;
-
     Config config;
 
 private:
@@ -65,7 +62,7 @@ private:
 
 ConditionalGeneration::ConditionalGeneration(const Config &config)
     : BaseModelForConditionalGeneration<
-                                Model<Config, Embedding, RMSNorm, QWen2Block, int, int, int, int, int>>(MODEL_TYPE_ZHINAO, config, MEM_SIZE, SCRATCH_SIZE), config(config)
+                                Model<Config, Embedding, RMSNorm, QWen2Block, int, int, int, int, int>>(MODEL_TYPE_ZHINAO, config), config(config)
 {
     constexpr size_t tensor_ovhd = GGML_TENSOR_SIZE + GGML_OBJECT_SIZE;
     const size_t num_tensors = 3 + config.num_hidden_layers * 15;
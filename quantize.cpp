@@ -0,0 +1,435 @@
+#include "chat.h"
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <thread>
+#include <regex>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+
+struct TypeOverride
+{
+    std::regex pattern;
+    ggml_type type;
+};
+
+struct Args
+{
+    std::string input;
+    std::string output;
+    std::string imatrix;
+    ggml_type type = GGML_TYPE_COUNT;
+    std::vector<TypeOverride> overrides;
+    int num_threads = 0;
+    bool verify = false;
+};
+
+struct TensorInfo
+{
+    std::string name;
+    int ndim;
+    int64_t ne[4];
+    ggml_type type;
+    int64_t data_offset;
+    uint32_t checksum;
+};
+
+static ggml_type parse_type(const std::string &s)
+{
+    for (auto t : chatllm::ModelLoader::weight_types())
+    {
+        if (strcasecmp(ggml_type_name(t), s.c_str()) == 0)
+            return t;
+    }
+    CHATLLM_THROW << "unsupported type: " << s;
+    return GGML_TYPE_COUNT;
+}
+
+static void usage(const std::string &prog)
+{
+    std::cout << "Usage: " << prog << " [options]\n"
+              << "\n"
+              << "Re-quantize an existing model file. Output is always written in container v2,\n"
+              << "so that running without `-t` upgrades an old file.\n"
+              << "\n"
+              << "Options:\n"
+              << "  -h, --help              show this help message and exit\n"
+              << "  -i, --input PATH        input model path\n"
+              << "  -o, --output PATH       output model path (default: replace the input file)\n"
+              << "  -t, --type TYPE         target type of weights (default: keep)\n"
+              << "  --imatrix FILE          importance matrix (see `main --collect_imatrix`)\n"
+              << "  --override REGEX=TYPE   use TYPE for weights whose name matches REGEX (can be specified multiple times,\n"
+              << "                          the first match wins), e.g. --override \"lm_head|embed_tokens=q8_0\"\n"
+              << "  -n, --threads N         number of threads (default: number of cores)\n"
+              << "  --verify                verify checksums of tensors in the input file (container v2) and exit\n"
+              << "\n"
+              << "TYPE:";
+    for (auto t : chatllm::ModelLoader::weight_types())
+        std::cout << " " << ggml_type_name(t);
+    std::cout << "\n" << std::endl;
+}
+
+static bool parse_args(Args &args, int argc, const char **argv)
+{
+    for (int c = 1; c < argc; c++)
+    {
+        const char *arg = argv[c];
+        if ((strcmp(arg, "--help") == 0) || (strcmp(arg, "-h") == 0))
+            return false;
+        else if (((strcmp(arg, "--input") == 0) || (strcmp(arg, "-i") == 0)) && (c + 1 < argc))
+            args.input = argv[++c];
+        else if (((strcmp(arg, "--output") == 0) || (strcmp(arg, "-o") == 0)) && (c + 1 < argc))
+            args.output = argv[++c];
+        else if (((strcmp(arg, "--type") == 0) || (strcmp(arg, "-t") == 0)) && (c + 1 < argc))
+            args.type = parse_type(argv[++c]);
+        else if (strcmp(arg, "--verify") == 0)
+            args.verify = true;
+        else if ((strcmp(arg, "--imatrix") == 0) && (c + 1 < argc))
+            args.imatrix = argv[++c];
+        else if ((strcmp(arg, "--override") == 0) && (c + 1 < argc))
+        {
+            std::string s(argv[++c]);
+            size_t pos = s.find_last_of('=');
+            CHATLLM_CHECK(pos != std::string::npos) << "invalid override: " << s;
+            args.overrides.push_back(TypeOverride{std::regex(s.substr(0, pos)), parse_type(s.substr(pos + 1))});
+        }
+        else if (((strcmp(arg, "--threads") == 0) || (strcmp(arg, "-n") == 0)) && (c + 1 < argc))
+            args.num_threads = atoi(argv[++c]);
+        else
+        {
+            std::cerr << "Unknown or incomplete argument: " << arg << std::endl;
+            return false;
+        }
+    }
+    return args.input.size() > 0;
+}
+
+// imatrix file:
+// [int n_entries] n_entries * [int name_len][name][int n_call][int n_val][float values[n_val]]
+// where values / n_call is the mean of squared activations of each input column
+static std::map<std::string, std::vector<float>> load_imatrix(const std::string &fn)
+{
+    std::map<std::string, std::vector<float>> r;
+    std::ifstream f(fn, std::ios::binary);
+    CHATLLM_CHECK(f.is_open()) << "failed to open imatrix file " << fn;
+
+    auto read_int = [&f]() { int v = 0; f.read((char *)&v, sizeof(v)); return v; };
+
+    int n = read_int();
+    for (int i = 0; i < n; i++)
+    {
+        std::string name(read_int(), '\0');
+        f.read(name.data(), name.size());
+        int n_call = read_int();
+        int n_val  = read_int();
+        std::vector<float> values(n_val);
+        f.read((char *)values.data(), n_val * sizeof(float));
+        CHATLLM_CHECK(f.good()) << "imatrix file is broken";
+        if (n_call > 0)
+            for (auto &v : values) v /= (float)n_call;
+        r.emplace(name, std::move(values));
+    }
+    return r;
+}
+
+static std::vector<TensorInfo> scan_tensors(chatllm::ModelLoader &loader)
+{
+    std::vector<TensorInfo> tensors;
+
+    loader.seek(loader.offset_tensors, SEEK_SET);
+    loader.load_all_tensors();
+
+    for (auto &kv : loader.tensor_dict)
+    {
+        TensorInfo t;
+        t.name = kv.first;
+        t.ndim = kv.second.ndim;
+        std::copy(kv.second.ne, kv.second.ne + 4, t.ne);
+        t.type = kv.second.type;
+        t.data_offset = kv.second.offset;
+        t.checksum = kv.second.checksum;
+        tensors.push_back(t);
+    }
+
+    // keep the original order
+    std::sort(tensors.begin(), tensors.end(), [](const TensorInfo &a, const TensorInfo &b) { return a.data_offset < b.data_offset; });
+    return tensors;
+}
+
+static size_t tensor_size(const TensorInfo &t)
+{
+    return ggml_row_size(t.type, t.ne[0]) * t.ne[1] * t.ne[2] * t.ne[3];
+}
+
+static ggml_type select_type(const Args &args, const TensorInfo &t, ggml_type model_dtype)
+{
+    // only weights stored as the model's dtype are quantized, others (norms, etc) are kept as is
+    if ((t.ndim < 2) || (t.type != model_dtype))
+        return t.type;
+
+    ggml_type type = args.type;
+    for (auto &o : args.overrides)
+    {
+        if (std::regex_search(t.name, o.pattern))
+        {
+            type = o.type;
+            break;
+        }
+    }
+
+    if (type == GGML_TYPE_COUNT)
+        return t.type;
+
+    if (t.ne[0] % ggml_blck_size(type) != 0)
+    {
+        std::cout << "    " << t.name << ": row size " << t.ne[0] << " is not a multiple of " << ggml_blck_size(type)
+                  << ", kept as " << ggml_type_name(t.type) << std::endl;
+        return t.type;
+    }
+
+    return type;
+}
+
+static void quantize_tensor(const char *src, ggml_type src_type, char *dst, ggml_type dst_type,
+                            int64_t nrows, int64_t n_per_row, const float *imatrix, int num_threads)
+{
+    auto to_float = ggml_internal_get_type_traits(src_type).to_float;
+    const size_t src_row_size = ggml_row_size(src_type, n_per_row);
+    const size_t dst_row_size = ggml_row_size(dst_type, n_per_row);
+    const int64_t rows_per_chunk = std::max((int64_t)1, (int64_t)(1024 * 1024 / n_per_row));
+
+    std::atomic<int64_t> next_row(0);
+
+    auto worker = [&]()
+    {
+        std::vector<float> buf(rows_per_chunk * n_per_row);
+
+        while (true)
+        {
+            int64_t row0 = next_row.fetch_add(rows_per_chunk);
+            if (row0 >= nrows) break;
+            int64_t n = std::min(rows_per_chunk, nrows - row0);
+
+            const char *p = src + row0 * src_row_size;
+            if (src_type == GGML_TYPE_F32)
+                memcpy(buf.data(), p, n * n_per_row * sizeof(float));
+            else
+            {
+                for (int64_t i = 0; i < n; i++)
+                    to_float(p + i * src_row_size, buf.data() + i * n_per_row, (int)n_per_row);
+            }
+
+            ggml_quantize_chunk(dst_type, buf.data(), dst + row0 * dst_row_size, 0, (int)n, (int)n_per_row, imatrix);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < num_threads; i++)
+        threads.emplace_back(worker);
+    worker();
+    for (auto &t : threads)
+        t.join();
+}
+
+static void write_padding(std::ofstream &f, int64_t align)
+{
+    static const char zeros[64] = {0};
+    int64_t pos = f.tellp();
+    int64_t pad = ((pos + align - 1) & ~(align - 1)) - pos;
+    f.write(zeros, pad);
+}
+
+template <class T> static void write_basic(std::ofstream &f, const T &v)
+{
+    f.write((const char *)&v, sizeof(v));
+}
+
+// container v2:
+// "ggm2" [int model_type][int version][int64 n_tensors][int64 offset_config]
+// n_tensors * [int name_len][name][int ndim][dims, outer first][int dtype][int64 offset][uint32 crc32]
+// config & tokenizer (at offset_config), then data of tensors, each aligned to 64 bytes
+static void write_directory(std::ofstream &f, const chatllm::ModelLoader &loader, const std::vector<TensorInfo> &tensors,
+                            int64_t offset_config)
+{
+    f.seekp(0);
+    f.write("ggm2", 4);
+    write_basic(f, loader.model_type);
+    write_basic(f, loader.version);
+    write_basic(f, (int64_t)tensors.size());
+    write_basic(f, offset_config);
+
+    for (auto &t : tensors)
+    {
+        write_basic(f, (int)t.name.size());
+        f.write(t.name.data(), t.name.size());
+        write_basic(f, t.ndim);
+        for (int i = t.ndim - 1; i >= 0; i--)
+            write_basic(f, (int)t.ne[i]);
+        write_basic(f, (int)t.type);
+        write_basic(f, t.data_offset);
+        write_basic(f, t.checksum);
+    }
+}
+
+static void quantize(const Args &args, const std::string &output)
+{
+    // ggml_init() initializes the fp16 tables used by dequantization
+    ggml_free(ggml_init({.mem_size = 0, .mem_buffer = nullptr, .no_alloc = true}));
+
+    chatllm::TokenizerObject obj(args.input);
+    chatllm::ModelLoader &loader = *obj.loader;
+
+    loader.seek(loader.offset_config, SEEK_SET);
+    const ggml_type model_dtype = loader.read_basic<chatllm::BaseConfig>().dtype;
+
+    std::map<std::string, std::vector<float>> imatrix;
+    if (args.imatrix.size() > 0)
+        imatrix = load_imatrix(args.imatrix);
+
+    std::vector<TensorInfo> tensors = scan_tensors(loader);
+
+    // plan the layout: header & directory, config & tokenizer, then tensors
+    std::vector<TensorInfo> planned(tensors);
+    int64_t offset = 4 + sizeof(int) * 2 + sizeof(int64_t) * 2;
+    for (auto &t : planned)
+        offset += sizeof(int) * (3 + t.ndim) + t.name.size() + sizeof(int64_t) + sizeof(uint32_t);
+
+    const int64_t offset_config = offset;
+    offset += loader.offset_tensors - loader.offset_config;
+
+    for (auto &t : planned)
+    {
+        constexpr int64_t align = chatllm::ModelLoader::CONTAINER_V2_ALIGN;
+        t.type = select_type(args, t, model_dtype);
+        t.data_offset = (offset + align - 1) & ~(align - 1);
+        t.checksum = 0;
+        offset = t.data_offset + tensor_size(t);
+    }
+
+    std::ofstream f(output, std::ios::binary);
+    CHATLLM_CHECK(f.is_open()) << "failed to create " << output;
+
+    // directory is written again once checksums are known.
+    // `dtype` in config is kept, and `ModelLoader::read_tensor` adopts the type of each weight in the file.
+    write_directory(f, loader, planned, offset_config);
+    f.write(loader.data + loader.offset_config, loader.offset_tensors - loader.offset_config);
+
+    std::vector<char> buf;
+    size_t total_in = 0;
+    size_t total_out = 0;
+
+    for (size_t i = 0; i < tensors.size(); i++)
+    {
+        const TensorInfo &t = tensors[i];
+        TensorInfo &q = planned[i];
+        const int64_t n_per_row = t.ne[0];
+        const int64_t nrows = t.ne[1] * t.ne[2] * t.ne[3];
+        const size_t in_size = tensor_size(t);
+        const size_t out_size = tensor_size(q);
+        const char *src = loader.data + t.data_offset;
+        const char *out = src;
+
+        write_padding(f, chatllm::ModelLoader::CONTAINER_V2_ALIGN);
+        CHATLLM_CHECK((int64_t)f.tellp() == q.data_offset) << "layout of " << t.name << " mismatch";
+
+        if (q.type != t.type)
+        {
+            const float *im = nullptr;
+            auto it = imatrix.find(t.name);
+            if (it != imatrix.end())
+            {
+                CHATLLM_CHECK((int64_t)it->second.size() == n_per_row)
+                    << "imatrix of " << t.name << " has " << it->second.size() << " columns, expect " << n_per_row;
+                im = it->second.data();
+            }
+            CHATLLM_CHECK((im != nullptr) || !ggml_quantize_requires_imatrix(q.type))
+                << t.name << ": " << ggml_type_name(q.type) << " requires an importance matrix";
+
+            buf.resize(out_size);
+            quantize_tensor(src, t.type, buf.data(), q.type, nrows, n_per_row, im, args.num_threads);
+            out = buf.data();
+        }
+
+        q.checksum = chatllm::ModelLoader::checksum(out, out_size);
+        f.write(out, out_size);
+
+        CHATLLM_CHECK(f.good()) << "failed to write " << output;
+
+        total_in  += in_size;
+        total_out += out_size;
+
+        std::cout << std::left << std::setw(48) << t.name << std::right
+                  << " [" << std::setw(6) << t.ne[0] << ", " << std::setw(6) << nrows << "] "
+                  << std::setw(8) << ggml_type_name(t.type) << " -> " << std::setw(8) << ggml_type_name(q.type)
+                  << std::fixed << std::setprecision(2) << std::setw(10) << out_size / 1024.0 / 1024.0 << " MB"
+                  << std::endl;
+    }
+
+    write_directory(f, loader, planned, offset_config);
+    CHATLLM_CHECK(f.good()) << "failed to write " << output;
+
+    ggml_quantize_free();
+
+    std::cout << std::endl << "size: " << std::fixed << std::setprecision(2)
+              << total_in / 1024.0 / 1024.0 << " MB -> " << total_out / 1024.0 / 1024.0 << " MB" << std::endl;
+}
+
+static int verify(const Args &args)
+{
+    chatllm::TokenizerObject obj(args.input);
+    chatllm::ModelLoader &loader = *obj.loader;
+    CHATLLM_CHECK(loader.container >= 2) << "checksums are only available in container v2, upgrade the file first";
+
+    int failed = 0;
+    for (auto &t : scan_tensors(loader))
+    {
+        if (chatllm::ModelLoader::checksum(loader.data + t.data_offset, tensor_size(t)) == t.checksum)
+            continue;
+        std::cout << t.name << ": checksum mismatch" << std::endl;
+        failed++;
+    }
+
+    std::cout << loader.tensor_dict.size() << " tensors, " << failed << " failed" << std::endl;
+    return failed > 0 ? 1 : 0;
+}
+
+int main(int argc, const char **argv)
+{
+    Args args;
+
+    try
+    {
+        if (!parse_args(args, argc, argv))
+        {
+            usage(argv[0]);
+            return 1;
+        }
+
+        if (args.num_threads <= 0)
+            args.num_threads = std::max(1, (int)std::thread::hardware_concurrency());
+
+        if (args.verify)
+            return verify(args);
+
+        if (args.output.size() > 0)
+        {
+            quantize(args, args.output);
+        }
+        else
+        {
+            const std::string tmp = args.input + ".tmp";
+            quantize(args, tmp);
+            CHATLLM_CHECK(std::rename(tmp.c_str(), args.input.c_str()) == 0)
+                << "failed to replace " << args.input << ": " << strerror(errno);
+        }
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
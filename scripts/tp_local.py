@@ -0,0 +1,80 @@
+# Check tensor parallelism with local processes: runs the model as one process, then as N ranks on this host,
+# and compares the generated text of all ranks with that of the single process.
+#
+# usage: python tp_local.py [--main PATH] [--size N] [--transport T] [--timeout S] -- ARGS...
+#   ARGS are passed to every process, e.g. -m model.bin -p "hello" -t 0 (greedy, or give a --seed)
+#   T is passed as --tp_transport: shm:NAME or tcp:127.0.0.1:PORT (default: derived from the model)
+
+import sys, os, subprocess, tempfile
+
+this_dir = os.path.dirname(os.path.abspath(sys.argv[0]))
+DEF_MAIN = os.path.join(this_dir, '..', 'build', 'bin', 'main')
+
+def parse_args(argv: list[str]) -> dict:
+    opts = {'main': DEF_MAIN, 'size': 2, 'transport': '', 'timeout': 600, 'args': []}
+    i = 0
+    while i < len(argv):
+        a = argv[i]
+        if a == '--':
+            opts['args'] = argv[i + 1:]
+            break
+        elif a in ['--main', '--transport']:
+            opts[a[2:]] = argv[i + 1]
+            i += 1
+        elif a in ['--size', '--timeout']:
+            opts[a[2:]] = int(argv[i + 1])
+            i += 1
+        else:
+            raise Exception(f'unknown option: {a}')
+        i += 1
+    return opts
+
+def clean(output: bytes) -> str:
+    lines = output.decode('utf-8', errors='replace').splitlines()
+    return '\n'.join([l for l in lines if not l.startswith('timings:')]).strip()
+
+def run(opts: dict) -> int:
+    cmd = [opts['main']] + opts['args'] + ['--hide_banner']
+
+    single = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, stdin=subprocess.DEVNULL,
+                            timeout=opts['timeout'])
+    expected = clean(single.stdout)
+
+    tp_args = ['--tp_size', str(opts['size'])]
+    if opts['transport'] != '':
+        tp_args += ['--tp_transport', opts['transport']]
+
+    # ranks wait for each other when connecting, so all are started before any is waited for.
+    # outputs go to files, which (unlike pipes) never block a rank
+    logs = [tempfile.TemporaryFile() for r in range(opts['size'])]
+    ranks = [subprocess.Popen(cmd + tp_args + ['--tp_rank', str(r)], stdout=logs[r], stderr=subprocess.STDOUT,
+                              stdin=subprocess.DEVNULL)
+             for r in range(opts['size'])]
+    outputs = []
+    for p, log in zip(ranks, logs):
+        try:
+            p.wait(timeout=opts['timeout'])
+        except subprocess.TimeoutExpired:
+            for q in ranks: q.kill()
+            print('FAILED: timed out')
+            return 1
+        log.seek(0)
+        outputs.append(clean(log.read()))
+
+    failed = 0
+    for r, (p, out) in enumerate(zip(ranks, outputs)):
+        if (p.returncode != 0) or (out != expected):
+            print(f'rank {r} FAILED (exit code {p.returncode}):')
+            print(out)
+            failed += 1
+    if failed > 0:
+        print('expected:')
+        print(expected)
+        return 1
+
+    print(f'OK: {opts["size"]} ranks match the single process')
+    print(expected)
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(run(parse_args(sys.argv[1:])))
@@ -5,6 +5,7 @@
 #include <cstring>
 #include <limits>
 #include <regex>
+#include <algorithm>
 
 #include "unicode.h"
 #include "chat.h"
@@ -118,9 +119,9 @@ struct llama_sp_tokenizer
         for (int i = 0; i != -1; i = symbols_[i].next)
         {
             auto &symbol = symbols_[i];
-            auto token = vocab_.token_to_id.find(std::string(symbol.text, symbol.n));
+            auto token = vocab_.find(std::string_view(symbol.text, symbol.n));
 
-            if (token == vocab_.token_to_id.end())
+            if (token < 0)
             {
                 // output any symbols that did not form tokens as bytes.
                 for (int j = 0; j < (int)symbol.n; ++j)
@@ -131,7 +132,7 @@ struct llama_sp_tokenizer
             }
             else
             {
-                output.push_back((*token).second);
+                output.push_back(token);
             }
         }
     }
@@ -144,21 +145,16 @@ private:
             return;
         }
 
-        const std::string text = std::string(symbols_[left].text, symbols_[left].n + symbols_[right].n);
+        const std::string_view text(symbols_[left].text, symbols_[left].n + symbols_[right].n);
 
-        auto token = vocab_.token_to_id.find(text);
+        auto token = vocab_.find(text);
 
-        if (token == vocab_.token_to_id.end())
+        if (token < 0)
         {
             return;
         }
 
-        if (static_cast<size_t>((*token).second) >= vocab_.id_to_token.size())
-        {
-            return;
-        }
-
-        const auto &tok_score = vocab_.id_to_token[(*token).second];
+        const auto &tok_score = vocab_.id_to_token[token];
 
         llama_sp_bigram bigram;
         bigram.left = left;
@@ -166,7 +162,7 @@ private:
         bigram.score = tok_score.score;
         bigram.size = text.size();
 #ifdef debug_bigram
-        bigram.text = text;
+        bigram.text = std::string(text);
 #endif
         work_queue_.push(bigram);
     }
@@ -209,6 +205,13 @@ public:
         return std::string(chars.data(), len);
     }
 
+    std::string_view read_view(int len)
+    {
+        std::string_view r(buffer + offset, len);
+        offset += len;
+        return r;
+    }
+
     size_t get_total_size(void) { return offset; }
 
 private:
@@ -266,8 +269,8 @@ int Processor::Encode(const std::string &input, std::vector<int> *ids) const
 
 int Processor::PieceToId(std::string_view piece) const
 {
-    auto r = vocab_.token_to_id.find(std::string(piece));
-    return r != vocab_.token_to_id.end() ? r->second : id_unk_token;
+    auto r = vocab_.find(piece);
+    return r >= 0 ? r : id_unk_token;
 }
 
 const std::string Processor::IdToPiece(int id) const
@@ -276,7 +279,7 @@ const std::string Processor::IdToPiece(int id) const
         return token_override.find(id)->second;
 
     if (id < 0) return token_unk_id;
-    return id < (int)vocab_.id_to_token.size() ? vocab_.id_to_token[id].tok : token_unk_id;
+    return id < (int)vocab_.id_to_token.size() ? std::string(vocab_.piece(id)) : token_unk_id;
 }
 
 void Processor::OverrideTokenDecoding(int id, const std::string &tok)
@@ -318,7 +321,7 @@ static int load_vocab_list(_vocab &vocab, Reader &reader, bool has_score, bool h
         int id = start_piece_id + count;
         CHATLLM_CHECK((size_t)(id) < vocab.id_to_token.size()) << "too many extra tokens";
 
-        std::string word = reader.read_string(len);
+        std::string_view word = reader.read_view(len);
 
         float score = 0.0f;
         uint8_t type = token_type::NORMAL;
@@ -327,16 +330,14 @@ static int load_vocab_list(_vocab &vocab, Reader &reader, bool has_score, bool h
         if (has_type)
             reader.read_raw(&type, sizeof(type));
 
-        vocab.token_to_id[word] = id;
-
-        auto &tok_score = vocab.id_to_token[id];
-        tok_score.tok = std::move(word);
-        tok_score.score = score;
-        tok_score.type = (token_type)type;
+        vocab.set_token(id, word, score, (token_type)type);
 
         count++;
     }
 
+    vocab.id_to_token.resize(start_piece_id + count);
+    vocab.build_index();
+
     return count;
 }
 
@@ -373,15 +374,14 @@ static int load_vocab_merges(_vocab &vocab, Reader &reader)
 
 static void build_special_token_cache(_vocab &vocab)
 {
-    for (const auto & t : vocab.token_to_id)
+    for (_vocab::id id = 0; id < (_vocab::id)vocab.id_to_token.size(); id++)
     {
-        const auto & token = t.first;
-        const auto & id    = t.second;
+        const auto token = vocab.piece(id);
 
         // Count all non-normal tokens in the vocab while iterating
-        if (vocab.id_to_token[id].type != token_type::NORMAL)
+        if ((vocab.id_to_token[id].type != token_type::NORMAL) && (vocab.find(token) == id))
         {
-            vocab.special_tokens_cache[id] = token;
+            vocab.special_tokens_cache[id] = std::string(token);
         }
     }
 }
@@ -390,7 +390,7 @@ size_t BPEProcessor1::Load(const char *buffer, int n_vocab)
 {
     Reader reader(buffer);
 
-    vocab_.token_to_id.clear();
+    vocab_.arena.clear();
     vocab_.id_to_token.resize((size_t)n_vocab + 100);
 
     piece_size = load_vocab_list(vocab_, reader, true, false, 0);
@@ -411,7 +411,7 @@ size_t BPEProcessor2::Load(const char *buffer, int n_vocab)
 {
     Reader reader(buffer);
 
-    vocab_.token_to_id.clear();
+    vocab_.arena.clear();
     vocab_.id_to_token.resize((size_t)n_vocab + 100);
     piece_size = load_vocab_list(vocab_, reader, false, true, 0);
 
@@ -531,20 +531,19 @@ struct llm_bpe_tokenizer {
                     continue;
                 }
 
-                const std::string str = std::string(symbol.text, symbol.n);
-                const auto token = vocab.token_to_id.find(str);
+                const std::string_view str(symbol.text, symbol.n);
+                const auto token = vocab.find(str);
 
-                if (token == vocab.token_to_id.end()) {
-                    for (auto j = str.begin(); j != str.end(); ++j) {
-                        std::string byte_str(1, *j);
-                        auto token_multibyte = vocab.token_to_id.find(byte_str);
-                        if (token_multibyte == vocab.token_to_id.end()) {
+                if (token < 0) {
+                    for (size_t j = 0; j < str.size(); ++j) {
+                        auto token_multibyte = vocab.find(str.substr(j, 1));
+                        if (token_multibyte < 0) {
                             throw std::runtime_error("ERROR: byte not found in vocab");
                         }
-                        output.push_back((*token_multibyte).second);
+                        output.push_back(token_multibyte);
                     }
                 } else {
-                    output.push_back((*token).second);
+                    output.push_back(token);
                 }
             }
         }
@@ -811,7 +810,7 @@ const std::string BPEProcessor2::IdToPiece(int id) const
 
     if (vocab_.is_normal_token(id))
     {
-        std::string result = vocab_.id_to_token[id].tok;
+        std::string result(vocab_.piece(id));
         return _decode_text(result);
     }
     else if (vocab_.is_control_token(id))
@@ -821,123 +820,184 @@ const std::string BPEProcessor2::IdToPiece(int id) const
     else
     {
         if (ret_special_token)
-            return vocab_.id_to_token[id].tok;
+            return std::string(vocab_.piece(id));
         else
             return "";
     }
 }
 
-struct unigram_tokenizer
+void DoubleArrayTrie::build(const std::vector<std::pair<std::string, int>> &keys)
 {
-    using index = int;
+    units.clear();
+    units.resize(1024, unit{0, -1});
+    units[0].check = 0;
+    next_check_pos = 1;
 
-    struct best
-    {
-        best(int prev, float score, int tok_id = 0): prev(prev), score(score), tok_id(tok_id) {}
-        index prev;
-        float score;
-        index tok_id;
-    };
+    if (keys.size() > 0)
+        insert(0, 0, keys, 0, keys.size());
 
-    struct unigram
-    {
-        unigram(const char *text, int pos, int n): text(text), start(pos), end(pos + n) {}
-
-        const char *text;
-        index start, end;
-    };
+    while ((units.size() > 1) && (units.back().check < 0))
+        units.pop_back();
+    units.shrink_to_fit();
+}
 
-    unigram_tokenizer(const _vocab &vocab, int tok_max_len, int unk_id) : vocab_(vocab), tok_max_len(tok_max_len), unk_id(unk_id) {}
+int DoubleArrayTrie::find_base(const std::vector<int> &codes)
+{
+    int pos = std::max(next_check_pos, codes[0] + 1) - 1;
+    int nonzero = 0;
+    bool first = true;
 
-    void tokenize(const std::string &text, std::vector<_vocab::id> &output)
+    while (true)
     {
-        size_t offs = 0;
+        pos++;
+        if (pos >= (int)units.size()) units.resize(pos + 1, unit{0, -1});
 
-        symbols_.emplace_back(text.c_str(), 0, 0);
-        trace.push_back(best(0, 0.0f));
-
-        while (offs < text.size())
+        if (units[pos].check >= 0)
         {
-            size_t char_len = std::min(text.size() - offs, utf8_len(text[offs]));
-            symbols_.emplace_back(text.c_str() + offs, (int)offs, (int)char_len);
-            offs += char_len;
+            nonzero++;
+            continue;
+        }
+        else if (first)
+        {
+            next_check_pos = pos;
+            first = false;
         }
 
-        if (symbols_.size() <= 1)
-            return;
+        int b = pos - codes[0];
+        if ((size_t)(b + codes.back()) >= units.size())
+            units.resize((size_t)(b + codes.back()) + 1 + units.size() / 2, unit{0, -1});
 
-        // Viterbi algorithm
-        for (int i = 1; i < (int)symbols_.size(); i++)
+        bool ok = true;
+        for (size_t i = 1; i < codes.size(); i++)
         {
-            find_best(i);
+            if (units[b + codes[i]].check >= 0)
+            {
+                ok = false;
+                break;
+            }
         }
+        if (!ok) continue;
 
-        // backtrace
-        int prev = (int)(trace.size()) - 1;
-        std::vector<int> temp;
-        while (prev != 0)
+        // cells before `pos` are mostly occupied, skip them next time
+        if (1.0 * nonzero / (pos - next_check_pos + 1) >= 0.95)
+            next_check_pos = pos;
+
+        return b;
+    }
+}
+
+void DoubleArrayTrie::insert(int state, size_t depth, const std::vector<std::pair<std::string, int>> &keys, size_t lo, size_t hi)
+{
+    // code 0 marks the end of a key, byte `c` is coded as `c + 1`
+    auto code_of = [&keys, depth](size_t i) -> int
+    {
+        const std::string &k = keys[i].first;
+        return depth < k.size() ? (uint8_t)k[depth] + 1 : 0;
+    };
+
+    std::vector<int> codes;
+    std::vector<size_t> bounds;
+    for (size_t i = lo; i < hi; i++)
+    {
+        int c = code_of(i);
+        if ((codes.size() < 1) || (codes.back() != c))
         {
-            auto &b = trace[prev];
-            temp.push_back(b.tok_id);
-            prev = b.prev;
+            codes.push_back(c);
+            bounds.push_back(i);
         }
-        for (int i = (int)temp.size() - 1; i >= 0; i--)
-            output.push_back(temp[i]);
     }
+    bounds.push_back(hi);
 
-private:
-    void find_best(int pos)
+    int b = find_base(codes);
+    units[state].base = b;
+    for (auto c : codes)
+        units[b + c].check = state;
+
+    for (size_t i = 0; i < codes.size(); i++)
     {
-        int start = pos - tok_max_len;
-        if (start < 0) start = 0;
+        int t = b + codes[i];
+        if (codes[i] == 0)
+            units[t].base = -keys[bounds[i]].second - 1;
+        else
+            insert(t, depth + 1, keys, bounds[i], bounds[i + 1]);
+    }
+}
 
-        float max_prop = std::numeric_limits<float>::lowest();
-        int prev = -1;
-        int tok_id = -1;
+int DoubleArrayTrie::exact_match(const char *text, size_t len) const
+{
+    int r = -1;
+    common_prefix_search(text, len, [&r, len](int n, int id) { if ((size_t)n == len) r = id; });
+    return r;
+}
 
-        for (int i = start; i < pos; i++)
-        {
-            auto &b = trace[i];
-            auto &sym = symbols_[i];
+struct unigram_tokenizer
+{
+    struct best
+    {
+        float score;
+        int prev;
+        int tok_id;
+        bool matched;
+    };
 
-            const std::string text = std::string(sym.text + sym.end - sym.start, symbols_[pos].end - sym.end);
+    unigram_tokenizer(const _vocab &vocab, const DoubleArrayTrie &trie, int unk_id) : vocab_(vocab), trie(trie), unk_id(unk_id) {}
 
-            auto token = vocab_.token_to_id.find(text);
-            if (token == vocab_.token_to_id.end())
-                continue;
+    void tokenize(const std::string &text, std::vector<_vocab::id> &output)
+    {
+        // lattice nodes are byte offsets, reused across calls
+        thread_local std::vector<best> trace;
+        thread_local std::vector<int> ids;
 
-            auto &tok = vocab_.id_to_token[token->second];
+        const int n = (int)text.size();
+        if (n < 1) return;
 
-            if (b.score + tok.score > max_prop)
+        trace.assign((size_t)n + 1, best{std::numeric_limits<float>::lowest(), -1, -1, false});
+        trace[0] = best{0.0f, 0, 0, true};
+
+        // Viterbi algorithm
+        int prev_char = 0;
+        for (int pos = 0; pos < n; )
+        {
+            if (!trace[pos].matched)
             {
-                prev = i;
-                max_prop = b.score + tok.score;
-                tok_id = token->second;
+                auto &tok = vocab_.id_to_token[unk_id];
+                trace[pos] = best{trace[prev_char].score + tok.score, prev_char, unk_id, true};
             }
+
+            const float score = trace[pos].score;
+            trie.common_prefix_search(text.c_str() + pos, (size_t)(n - pos), [this, pos, score](int len, int id)
+            {
+                if (len < 1) return;
+                auto &b = trace[pos + len];
+                float s = score + vocab_.id_to_token[id].score;
+                if (!b.matched || (s > b.score))
+                    b = best{s, pos, id, true};
+            });
+
+            prev_char = pos;
+            pos += (int)std::min((size_t)(n - pos), utf8_len(text[pos]));
         }
 
-        if (prev < 0)
+        if (!trace[n].matched)
         {
-            auto i = pos - 1;
-            auto &b = trace[i];
             auto &tok = vocab_.id_to_token[unk_id];
-
-            prev = i;
-            max_prop = b.score + tok.score;
-            tok_id = unk_id;
+            trace[n] = best{trace[prev_char].score + tok.score, prev_char, unk_id, true};
         }
 
-        trace.emplace_back(prev, max_prop, tok_id);
+        // backtrace
+        ids.clear();
+        for (int prev = n; prev != 0; prev = trace[prev].prev)
+            ids.push_back(trace[prev].tok_id);
+        output.insert(output.end(), ids.rbegin(), ids.rend());
     }
 
+private:
     const _vocab &vocab_;
-    std::vector<best> trace;
-    std::vector<unigram> symbols_;
-    int tok_max_len;
+    const DoubleArrayTrie &trie;
     int unk_id;
 };
 
-UnigramProcessor::UnigramProcessor(int unk_tok_id) : Processor::Processor(), unk_tok_id(unk_tok_id), tok_max_len(0)
+UnigramProcessor::UnigramProcessor(int unk_tok_id) : Processor::Processor(), unk_tok_id(unk_tok_id)
 {
 
 }
@@ -946,18 +1006,21 @@ size_t UnigramProcessor::Load(const char *buffer, int n_vocab)
 {
     Reader reader(buffer);
 
-    vocab_.token_to_id.clear();
+    vocab_.arena.clear();
     vocab_.id_to_token.resize((size_t)n_vocab + 100);
 
     piece_size = load_vocab_list(vocab_, reader, true, false, 0);
     vocab_.id_to_token.resize(piece_size);
 
-    // TODO: tok_max_len should be number of characters, not bytes
-    for (auto & tok : vocab_.id_to_token)
+    std::vector<std::pair<std::string, int>> keys;
+    for (int id = 0; id < piece_size; id++)
     {
-        if (tok.tok.size() > tok_max_len)
-            tok_max_len = tok.tok.size();
+        auto piece = vocab_.piece(id);
+        if (vocab_.find(piece) == id)
+            keys.emplace_back(std::string(piece), id);
     }
+    std::sort(keys.begin(), keys.end());
+    trie.build(keys);
 
     return reader.get_total_size();
 }
@@ -965,7 +1028,7 @@ size_t UnigramProcessor::Load(const char *buffer, int n_vocab)
 int UnigramProcessor::DoEncode(const std::string &input,
         std::vector<int> *ids) const
 {
-    unigram_tokenizer tokenizer(vocab_, (int)tok_max_len, unk_tok_id);
+    unigram_tokenizer tokenizer(vocab_, trie, unk_tok_id);
     tokenizer.tokenize(input, *ids);
     return 0;
 }
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <string>
+#include <string_view>
+#include <cstdint>
 #include <vector>
 #include <unordered_map>
 #include <map>
@@ -25,18 +27,71 @@ struct _vocab
     using id    = int32_t;
     using token = std::string;
 
+    // pieces are stored in `arena`, a token refers to it by offset
     struct token_score {
-        token tok;
+        uint32_t offset;
+        uint32_t len;
         float score;
         token_type type;
     };
 
-    std::unordered_map<token, id> token_to_id;
+    std::string arena;
     std::vector<token_score> id_to_token;
 
     std::unordered_map<id, token> special_tokens_cache;
     std::map<std::pair<std::string, std::string>, int> bpe_ranks;
 
+    std::string_view piece(id id) const
+    {
+        const auto &t = id_to_token[id];
+        return std::string_view(arena.data() + t.offset, t.len);
+    }
+
+    void set_token(id id, std::string_view piece, float score, token_type type)
+    {
+        auto &t = id_to_token[id];
+        t.offset = (uint32_t)arena.size();
+        t.len    = (uint32_t)piece.size();
+        t.score  = score;
+        t.type   = type;
+        arena.append(piece);
+    }
+
+    // returns -1 if not found
+    id find(std::string_view piece) const
+    {
+        if (id_index.size() < 1) return -1;
+
+        const size_t mask = id_index.size() - 1;
+        for (size_t i = std::hash<std::string_view>{}(piece) & mask; id_index[i] >= 0; i = (i + 1) & mask)
+        {
+            if (this->piece(id_index[i]) == piece)
+                return id_index[i];
+        }
+        return -1;
+    }
+
+    // build the lookup table after all tokens are set.
+    // as with the previous map, the last one wins if a piece is duplicated.
+    void build_index(void)
+    {
+        size_t size = 16;
+        while (size < id_to_token.size() * 2) size *= 2;
+
+        id_index.assign(size, -1);
+        arena.shrink_to_fit();
+
+        const size_t mask = size - 1;
+        for (id k = 0; k < (id)id_to_token.size(); k++)
+        {
+            auto p = piece(k);
+            size_t i = std::hash<std::string_view>{}(p) & mask;
+            while ((id_index[i] >= 0) && (piece(id_index[i]) != p))
+                i = (i + 1) & mask;
+            id_index[i] = k;
+        }
+    }
+
     int find_bpe_rank(std::string token_left, std::string token_right) const
     {
         auto it = bpe_ranks.find(std::make_pair(token_left, token_right));
@@ -62,6 +117,10 @@ struct _vocab
     {
         return is_token_of_type(id, token_type::CONTROL);
     }
+
+private:
+    // open addressing table of ids
+    std::vector<id> id_index;
 };
 
 class TextPreprocessor
@@ -196,6 +255,51 @@ protected:
             std::vector<int> *ids) const override;
 };
 
+// double-array trie, mapping byte strings to ids
+class DoubleArrayTrie
+{
+public:
+    // `keys` must be sorted and unique
+    void build(const std::vector<std::pair<std::string, int>> &keys);
+
+    // calls `f(len, id)` for every key that is a prefix of `text`, shortest first
+    template <class F> void common_prefix_search(const char *text, size_t len, F &&f) const
+    {
+        if (units.size() < 1) return;
+
+        int s = 0;
+        for (size_t i = 0; ; i++)
+        {
+            int t = units[s].base;
+            if ((t < (int)units.size()) && (units[t].check == s))
+                f((int)i, -units[t].base - 1);
+
+            if (i >= len) break;
+
+            t = units[s].base + (uint8_t)text[i] + 1;
+            if ((t >= (int)units.size()) || (units[t].check != s))
+                break;
+            s = t;
+        }
+    }
+
+    int exact_match(const char *text, size_t len) const;
+
+    size_t size(void) const { return units.size(); }
+
+private:
+    int find_base(const std::vector<int> &codes);
+    void insert(int state, size_t depth, const std::vector<std::pair<std::string, int>> &keys, size_t lo, size_t hi);
+
+    struct unit
+    {
+        int base;
+        int check;
+    };
+    std::vector<unit> units;
+    int next_check_pos;
+};
+
 class UnigramProcessor: public Processor
 {
 public:
@@ -210,7 +314,7 @@ private:
             std::vector<int> *ids) const override;
 
 private:
-    size_t tok_max_len;
+    DoubleArrayTrie trie;
 };
 
 size_t get_end_of_valid_utf8(const std::string &utf8, const size_t offset);